@@ -1,13 +1,19 @@
+#define _POSIX_C_SOURCE 199309L
+
 #include <ctype.h>
 #include <errno.h>
+#include <pthread.h>
 #include <setjmp.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "defs.h"
+#include "obj.h"
+#include "opt.h"
 
 #define DIRECTIVE_SET "set"
 #define DIRECTIVE_OFFSET "offset"
@@ -33,9 +39,21 @@ struct token
     LBLVAL,      // &somewhere
     DEREFVAL,    // *A2Bh
     LBLDEREF,    // @somewhere
-    DEREF,       // [r0]
-    DEREFOFF,    // [r0 + #2]
-    DEREFOFFLBL, // [r0 + &somewhere]
+    DEREF,       // [%r0]
+    DEREFOFF,    // [%r0 + 2]
+    DEREFOFFLBL, // [%r0 + somewhere + 2]
+
+    // expressions, see parse_expr. * only multiplies right after a value
+    // outside of [], anywhere else it is a DEREFVAL
+    LBRACKET,
+    RBRACKET,
+    PLUS,
+    MINUS,
+    STAR,
+    SLASH,
+    LPAREN,
+    RPAREN,
+    SIZEOF,
 
     TOK_NOP,
 
@@ -68,6 +86,25 @@ struct token
 
     TOK_READ,
     TOK_WRITE,
+    TOK_SREAD,
+    TOK_SWRITE,
+
+    TOK_MEMCPY,
+    TOK_MEMSET,
+    TOK_MEMCMP,
+
+    TOK_VADDB,
+    TOK_VADDW,
+    TOK_VXORB,
+    TOK_VXORW,
+    TOK_VCMPEQB,
+    TOK_VCMPEQW,
+    TOK_VMINB,
+    TOK_VMINW,
+    TOK_VMAXB,
+    TOK_VMAXW,
+    TOK_VSUMB,
+    TOK_VSUMW,
 
     TOK_ENINT,
     TOK_DISINT,
@@ -82,17 +119,17 @@ struct token
     char* s;
     int i;
 
+    // DEREF, DEREFOFF and DEREFOFFLBL, the linker adds the address of the
+    // label `id` to off. a LBLVAL operand uses off and id too once
+    // parse_value() folded it
     struct
     {
-      int reg, off;
-    } deref_off;
-
-    struct
-    {
-      int reg;
-      char* s;
-    } deref_off_lbl;
+      int reg, off, id;
+    } deref;
   } d;
+
+  // where the token starts in the source, 0 based
+  int line, col;
 };
 
 struct tok_str_pair
@@ -125,6 +162,25 @@ static const struct tok_str_pair tokpairs[] = {
   { .dat = "bgte", .ty = TOK_BGTE },
   { .dat = "read", .ty = TOK_READ },
   { .dat = "write", .ty = TOK_WRITE },
+  { .dat = "bin", .ty = TOK_READ },
+  { .dat = "bout", .ty = TOK_WRITE },
+  { .dat = "sin", .ty = TOK_SREAD },
+  { .dat = "sout", .ty = TOK_SWRITE },
+  { .dat = "memcpy", .ty = TOK_MEMCPY },
+  { .dat = "memset", .ty = TOK_MEMSET },
+  { .dat = "memcmp", .ty = TOK_MEMCMP },
+  { .dat = "vaddb", .ty = TOK_VADDB },
+  { .dat = "vaddw", .ty = TOK_VADDW },
+  { .dat = "vxorb", .ty = TOK_VXORB },
+  { .dat = "vxorw", .ty = TOK_VXORW },
+  { .dat = "vcmpeqb", .ty = TOK_VCMPEQB },
+  { .dat = "vcmpeqw", .ty = TOK_VCMPEQW },
+  { .dat = "vminb", .ty = TOK_VMINB },
+  { .dat = "vminw", .ty = TOK_VMINW },
+  { .dat = "vmaxb", .ty = TOK_VMAXB },
+  { .dat = "vmaxw", .ty = TOK_VMAXW },
+  { .dat = "vsumb", .ty = TOK_VSUMB },
+  { .dat = "vsumw", .ty = TOK_VSUMW },
   { .dat = "enint", .ty = TOK_ENINT },
   { .dat = "disint", .ty = TOK_DISINT },
   { .dat = "halt", .ty = TOK_HALT },
@@ -160,45 +216,103 @@ static const struct reg_str_pair regpairs[] = {
   { "sb", STACK_BASE_REGISTER },
 };
 
-struct symbol
+/// an interned identifier, every occurrence of the same spelling shares one
+/// id. what the spelling means as a mnemonic, register or directive is
+/// looked up the first time it is used as one and kept here.
+struct ident
 {
-  char* label;
-  uint16_t loc;
+  const char* str;
+  int len;
+  unsigned hash;
+
+  int tok, reg, directive;
+  // defined as a label
+  bool sym;
+  // length of the .ascii or .asciz string right after its definition as a
+  // label, -1 if there is none
+  int size;
 };
 
-struct unresolved
+// not looked up yet, and looked up but not one
+#define IDENT_UNKNOWN -2
+#define IDENT_NONE -1
+
+/// all strings of one assemble() are bump allocated from here
+/// and freed together by the next init()
+struct arena_block
 {
-  uint16_t at;
-  char* to;
+  struct arena_block* next;
+  size_t len, cap;
+  char data[];
 };
 
+#define ARENA_BLOCK_SIZE (64 << 10)
+
 #define MAX(x, y) (x > y ? x : y)
+#define PHASH_BITS 8
+#define PHASH_SLOTS (1 << PHASH_BITS)
 #define CURC src[srcidx]
-#define MAX_SYMBOLS 512
-#define MAX_UNRESOLVED 1024
-
-static const char* src;
-static int srcidx;
-
-static struct symbol symbols[MAX_SYMBOLS];
-static struct unresolved unresolved[MAX_UNRESOLVED];
-static char outbuf[ROMLEN];
 
-static int line, col;
-
-static int num_syms;
-static int num_unresolved;
+// everything one assemble() works on is per thread, so threads may each
+// assemble a source of their own at the same time
+static _Thread_local const char* src;
+static _Thread_local int srcidx;
+
+// no per label and per relocation logging, see assemble_quiet
+static bool quiet;
+// run the peephole pass on every object, see assemble_optimize
+static bool optimize;
+// what it did, summed over all threads
+static struct opt_report report;
+static pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static _Thread_local struct assemble_timings timings;
+static _Thread_local struct arena_block* arena;
+
+// all growable, see grow()
+// symbols and relocs name idents until they are handed to the object
+static _Thread_local struct ident* idents;
+static _Thread_local struct token* tokens;
+static _Thread_local struct obj_section* sections;
+static _Thread_local struct obj_ref* symbols;
+static _Thread_local struct obj_ref* relocs;
+static _Thread_local struct opt_insn* insns;
+static _Thread_local int num_idents, num_tokens, num_sections, num_insns;
+static _Thread_local int cap_idents, cap_tokens, cap_sections;
+static _Thread_local int cap_syms, cap_relocs, cap_insns;
+
+// the parser's position in tokens
+static _Thread_local int tokidx;
+
+// open addressed index into idents, a slot holds index + 1, 0 if empty
+// kept at most half full so probes stay short
+static _Thread_local int* ident_index;
+static _Thread_local unsigned ident_index_cap;
+
+// ROMIMAGE_MAX bytes, allocated by the first init() of a thread
+static _Thread_local char* outbuf;
+
+static _Thread_local int line, col;
+// where the token lex_one() is on starts, past any whitespace
+static _Thread_local int tok_line, tok_col;
+// between a [ and its ], where * always multiplies
+static _Thread_local bool in_brackets;
+
+static _Thread_local int num_syms;
+static _Thread_local int num_relocs;
 // the current write index to the outbuf
 // can be modified by directives (see .set)
-static int outbuf_idx;
-static int outbuf_max_len;
+// until the first .set it counts from wherever the linker puts the module
+static _Thread_local int outbuf_idx;
+// where in outbuf the open section, sections[num_sections], starts
+static _Thread_local int section_start;
 
 // the outbuf offset, does not modify the index of the outbuf write
 // makes the current outbuf location "think" that its in a different location
 // useful for writing roms
 // e.g. ".set $0 .offset $0x400h label hi goto hi"
 //       writes a "JMP $0x400h" @ 0x0000 in outbuf
-static int outbuf_offset;
+static _Thread_local int outbuf_offset;
 
 static const char* TOKTY_NAMES[] = {
   [IDENT] = "IDENT",
@@ -213,9 +327,19 @@ static const char* TOKTY_NAMES[] = {
   [LBLVAL] = "LBLVAL",           // &somewhere
   [DEREFVAL] = "DEREFVAL",       // *A2Bh
   [LBLDEREF] = "LBLDEREF",       // @somewhere
-  [DEREF] = "DEREF",             // [r0]
-  [DEREFOFF] = "DEREFOFF",       // [r0 + #2]
-  [DEREFOFFLBL] = "DEREFOFFLBL", // [r0 + &somewhere]
+  [DEREF] = "DEREF",             // [%r0]
+  [DEREFOFF] = "DEREFOFF",       // [%r0 + 2]
+  [DEREFOFFLBL] = "DEREFOFFLBL", // [%r0 + somewhere + 2]
+
+  [LBRACKET] = "LBRACKET",
+  [RBRACKET] = "RBRACKET",
+  [PLUS] = "PLUS",
+  [MINUS] = "MINUS",
+  [STAR] = "STAR",
+  [SLASH] = "SLASH",
+  [LPAREN] = "LPAREN",
+  [RPAREN] = "RPAREN",
+  [SIZEOF] = "SIZEOF",
 
   [TOK_NOP] = "TOK_NOP",
 
@@ -239,6 +363,25 @@ static const char* TOKTY_NAMES[] = {
 
   [TOK_READ] = "TOK_READ",
   [TOK_WRITE] = "TOK_WRITE",
+  [TOK_SREAD] = "TOK_SREAD",
+  [TOK_SWRITE] = "TOK_SWRITE",
+
+  [TOK_MEMCPY] = "TOK_MEMCPY",
+  [TOK_MEMSET] = "TOK_MEMSET",
+  [TOK_MEMCMP] = "TOK_MEMCMP",
+
+  [TOK_VADDB] = "TOK_VADDB",
+  [TOK_VADDW] = "TOK_VADDW",
+  [TOK_VXORB] = "TOK_VXORB",
+  [TOK_VXORW] = "TOK_VXORW",
+  [TOK_VCMPEQB] = "TOK_VCMPEQB",
+  [TOK_VCMPEQW] = "TOK_VCMPEQW",
+  [TOK_VMINB] = "TOK_VMINB",
+  [TOK_VMINW] = "TOK_VMINW",
+  [TOK_VMAXB] = "TOK_VMAXB",
+  [TOK_VMAXW] = "TOK_VMAXW",
+  [TOK_VSUMB] = "TOK_VSUMB",
+  [TOK_VSUMW] = "TOK_VSUMW",
 
   [TOK_ENINT] = "TOK_ENINT",
   [TOK_DISINT] = "TOK_DISINT",
@@ -248,6 +391,123 @@ static const char* TOKTY_NAMES[] = {
   [TOK_EOF] = "TOK_EOF",
 };
 
+/// makes room for one more element in a growable array
+static void*
+grow(void* arr, int* cap, int len, size_t elem)
+{
+  if (len < *cap)
+    return arr;
+
+  *cap = *cap ? *cap * 2 : 256;
+  arr = realloc(arr, *cap * elem);
+  if (!arr)
+    ERR("out of memory\n");
+  return arr;
+}
+
+static char*
+arena_alloc(size_t len)
+{
+  struct arena_block* b = arena;
+
+  if (!b || b->cap - b->len < len) {
+    const size_t cap = MAX(len, (size_t)ARENA_BLOCK_SIZE);
+    b = malloc(sizeof(struct arena_block) + cap);
+    if (!b)
+      ERR("out of memory\n");
+    b->next = arena;
+    b->len = 0;
+    b->cap = cap;
+    arena = b;
+  }
+
+  b->len += len;
+  return &b->data[b->len - len];
+}
+
+static void
+arena_free(void)
+{
+  while (arena) {
+    struct arena_block* next = arena->next;
+    free(arena);
+    arena = next;
+  }
+}
+
+// fnv-1a
+static unsigned
+hash_str(const char* str, int len)
+{
+  unsigned h = 2166136261u;
+  for (int i = 0; i < len; i++)
+    h = (h ^ (uint8_t)str[i]) * 16777619u;
+  return h;
+}
+
+/// the slot `str` lives in, or the empty one it would go in
+static int*
+ident_slot(const char* str, int len, unsigned hash)
+{
+  unsigned i = hash & (ident_index_cap - 1);
+
+  for (; ident_index[i]; i = (i + 1) & (ident_index_cap - 1)) {
+    const struct ident* id = &idents[ident_index[i] - 1];
+    if (id->hash == hash && id->len == len && memcmp(id->str, str, len) == 0)
+      break;
+  }
+
+  return &ident_index[i];
+}
+
+static void
+ident_index_grow(void)
+{
+  const unsigned old_cap = ident_index_cap;
+
+  ident_index_cap = old_cap ? old_cap * 2 : 1024;
+  free(ident_index);
+  ident_index = calloc(ident_index_cap, sizeof(int));
+  if (!ident_index)
+    ERR("out of memory\n");
+
+  for (int i = 0; i < num_idents; i++)
+    *ident_slot(idents[i].str, idents[i].len, idents[i].hash) = i + 1;
+}
+
+/// the id of `len` bytes at `str`, copied into the arena the first time
+static int
+intern(const char* str, int len)
+{
+  const unsigned hash = hash_str(str, len);
+  int* slot;
+  char* copy;
+
+  if ((unsigned)num_idents * 2 >= ident_index_cap)
+    ident_index_grow();
+
+  slot = ident_slot(str, len, hash);
+  if (*slot)
+    return *slot - 1;
+
+  copy = arena_alloc(len + 1);
+  memcpy(copy, str, len);
+  copy[len] = 0;
+
+  idents = grow(idents, &cap_idents, num_idents, sizeof(*idents));
+  idents[num_idents] = (struct ident){
+    .str = copy,
+    .len = len,
+    .hash = hash,
+    .tok = IDENT_UNKNOWN,
+    .reg = IDENT_UNKNOWN,
+    .directive = IDENT_UNKNOWN,
+    .size = -1,
+  };
+  *slot = num_idents + 1;
+  return num_idents++;
+}
+
 static char
 nextc(void)
 {
@@ -270,120 +530,265 @@ ishex(char c)
   return false;
 }
 
+/// hex digits with an h suffix, decimal digits without
 static int
 parse_int(void)
 {
-  int start, end, len, out;
-  char* c;
+  const int start = srcidx;
+  int end, base = 10;
+  long out = 0;
 
-  start = end = srcidx;
+  while (ishex(CURC))
+    nextc();
+  end = srcidx;
 
-  for (;;) {
-    if (!ishex(CURC))
-      break;
+  if (tolower(CURC) == 'h') {
+    base = 16;
     nextc();
-    end += 1;
   }
 
-  len = end - start;
+  // like strtol, a decimal number ends at the first letter
+  for (int i = start; i < end; i++) {
+    const int digit =
+      isdigit(src[i]) ? src[i] - '0' : tolower(src[i]) - 'a' + 10;
+    if (digit >= base)
+      break;
+    out = out * base + digit;
+    if (out > UINT16_MAX)
+      ERR("numbers in ASM cannot be >0xFFFF or <0\n");
+  }
 
-  c = malloc(len + 1);
-  c[len] = 0;
-  for (int i = start; i < end; i++)
-    c[i - start] = src[i];
+  if (start == end || (base == 10 && !isdigit(src[start])))
+    ERR("%i:%i | invalid number %.*s\n",
+        line + 1,
+        col + 1,
+        end - start,
+        &src[start]);
 
-  errno = 0;
-  if (tolower(CURC) == 'h') {
-    out = strtol(c, NULL, 16);
-    nextc();
-  } else
-    out = strtol(c, NULL, 10);
-
-  if (errno == EINVAL)
-    ERR("invalid number %s\n", c);
+  return out;
+}
 
-  free(c);
+static int
+parse_ident(void)
+{
+  const int start = srcidx;
 
-  if (out > UINT16_MAX || out < 0)
-    ERR("numbers in ASM cannot be >0xFFFF or <0\n");
+  while (isalnum(CURC) || CURC == '_')
+    nextc();
 
-  return out;
+  return intern(&src[start], srcidx - start);
 }
 
 static char*
-parse_ident(void)
+parse_string(void)
 {
-  int start, end, len;
+  const int start = srcidx;
   char* c;
 
-  start = end = srcidx;
-
-  for (;;) {
-    if (!isalnum(CURC) && CURC != '_')
-      break;
-    end += 1;
+  while (CURC != '\"') {
+    if (CURC == 0)
+      ERR("%i:%i | unterminated string\n", line + 1, col + 1);
     nextc();
   }
 
-  len = end - start;
-
-  c = malloc(len + 1);
-  c[len] = 0;
-  for (int i = start; i < end; i++)
-    c[i - start] = src[i];
+  c = arena_alloc(srcidx - start + 1);
+  memcpy(c, &src[start], srcidx - start);
+  c[srcidx - start] = 0;
 
+  // skip the closing quote
+  nextc();
   return c;
 }
 
-static char*
-parse_string(void)
+/// perfect hash over a table of structs whose first member is their name
+/// built once, by the first init() of any thread, with the first seed that
+/// gives every name its own slot, a lookup is then one hash of the word and
+/// one compare
+struct phash
 {
-  int start, end, len, out;
-  char* c;
+  const void* base;
+  size_t stride;
+  int n;
+
+  // 0 until built
+  unsigned seed;
+  // index + 1 into base, 0 if empty
+  uint8_t slot[PHASH_SLOTS];
+};
+
+#define PHASH_OF(table)                                                        \
+  {                                                                            \
+    .base = table, .stride = sizeof(table[0]),                                 \
+    .n = sizeof(table) / sizeof(table[0]),                                     \
+  }
 
-  start = end = srcidx;
+static inline const char*
+phash_name(const struct phash* ph, int i)
+{
+  return *(const char* const*)((const char*)ph->base + i * ph->stride);
+}
 
-  while (nextc() != '\"')
-    end += 1;
-  len = end - start;
+// names are matched ignoring case
+static inline unsigned
+phash_hash(const char* str, int len, unsigned seed)
+{
+  for (int i = 0; i < len; i++)
+    seed = (seed ^ (uint8_t)tolower(str[i])) * 16777619u;
+  return seed >> (32 - PHASH_BITS);
+}
 
-  c = malloc(len + 1);
-  c[len] = 0;
-  for (int i = start; i < end; i++)
-    c[i - start] = src[i];
+static void
+phash_build(struct phash* ph)
+{
+  for (unsigned seed = 1;; seed++) {
+    int i;
 
-  return c;
+    memset(ph->slot, 0, sizeof(ph->slot));
+    for (i = 0; i < ph->n; i++) {
+      const char* name = phash_name(ph, i);
+      const unsigned h = phash_hash(name, strlen(name), seed);
+      if (ph->slot[h])
+        break;
+      ph->slot[h] = i + 1;
+    }
+
+    if (i == ph->n) {
+      ph->seed = seed;
+      return;
+    }
+  }
 }
 
-__attribute__((always_inline)) static inline bool
-case_agnostic_strcmp(const char* left, const char* right)
+/// index of `len` bytes at `str` in the table, -1 if it is not there
+static int
+phash_find(struct phash* ph, const char* str, int len)
 {
-  const size_t ll = strlen(left);
-  const size_t rl = strlen(right);
+  const char* name;
+  int i;
 
-  if (ll != rl)
-    return false;
+  if (!(i = ph->slot[phash_hash(str, len, ph->seed)]))
+    return -1;
+
+  name = phash_name(ph, i - 1);
+  for (int c = 0; c < len; c++)
+    if (!name[c] || tolower(name[c]) != tolower(str[c]))
+      return -1;
+  return name[len] ? -1 : i - 1;
+}
+
+static struct phash mnemonics = PHASH_OF(tokpairs);
+static struct phash registers = PHASH_OF(regpairs);
+static pthread_once_t phash_once = PTHREAD_ONCE_INIT;
+
+static void
+phash_build_all(void);
+
+/// the mnemonic token `id` spells, IDENT_NONE if it is not one
+static int
+ident_tok(int id)
+{
+  struct ident* ident = &idents[id];
+  int i;
+
+  if (ident->tok == IDENT_UNKNOWN)
+    ident->tok = (i = phash_find(&mnemonics, ident->str, ident->len)) < 0
+                   ? IDENT_NONE
+                   : (int)tokpairs[i].ty;
+
+  return ident->tok;
+}
+
+static int
+ident_reg(int id)
+{
+  struct ident* ident = &idents[id];
+  int i;
 
-  for (size_t i = 0; i < ll; i++)
-    if (tolower(left[i]) != tolower(right[i]))
+  if (ident->reg == IDENT_UNKNOWN)
+    ident->reg = (i = phash_find(&registers, ident->str, ident->len)) < 0
+                   ? IDENT_NONE
+                   : regpairs[i].reg_val;
+
+  return ident->reg;
+}
+
+/// `id` spells `word`, ignoring case like mnemonics do
+static bool
+ident_is(int id, const char* word)
+{
+  const struct ident* ident = &idents[id];
+
+  for (int i = 0; i < ident->len; i++)
+    if (!word[i] || tolower(ident->str[i]) != word[i])
       return false;
+  return !word[ident->len];
+}
 
-  return true;
+/// the tokens of an expression, see parse_expr
+static bool
+lex_expr(struct token* t)
+{
+  static const struct
+  {
+    char c;
+    enum tokty t;
+  } ops[] = {
+    { '+', PLUS },   { '-', MINUS },  { '*', STAR },
+    { '/', SLASH },  { '(', LPAREN }, { ')', RPAREN },
+  };
+
+  for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++)
+    if (CURC == ops[i].c) {
+      nextc();
+      *t = (struct token){ .t = ops[i].t };
+      return true;
+    }
+
+  // numbers need no # here
+  if (isdigit(CURC)) {
+    *t = (struct token){ .t = IMMVAL, .d.i = parse_int() };
+    return true;
+  }
+
+  return false;
 }
 
-struct token
-next(void)
+/// the token at the cursor, `prev` is the type of the one before it
+static struct token
+lex_one(enum tokty prev)
 {
+  struct token t;
+  int id;
+
 retry:
   while (CURC != 0 && isspace(CURC))
     nextc();
+  tok_line = line;
+  tok_col = col;
+
+  if ((CURC != '*' || in_brackets || prev == IMMVAL || prev == LBLVAL ||
+       prev == RPAREN) &&
+      lex_expr(&t))
+    return t;
 
   switch (CURC) {
     case 0:
       return (struct token){ .t = TOK_EOF };
 
+    case '[':
+      if (in_brackets)
+        ERR("%i:%i | nested '['\n", line + 1, col + 1);
+      nextc();
+      in_brackets = true;
+      return (struct token){ .t = LBRACKET };
+
+    case ']':
+      nextc();
+      in_brackets = false;
+      return (struct token){ .t = RBRACKET };
+
     case '|':
-      while (CURC != '\n')
+      while (CURC != '\n' && CURC != 0)
         nextc();
       goto retry;
 
@@ -397,8 +802,7 @@ retry:
 
     case '.':
       nextc();
-      char* str = parse_ident();
-      return (struct token){ .t = DIRECTIVE, .d.s = str };
+      return (struct token){ .t = DIRECTIVE, .d.i = parse_ident() };
 
     case ',':
       nextc();
@@ -406,16 +810,13 @@ retry:
 
     case '%':
       nextc();
-      char* reg = parse_ident();
-      for (size_t i = 0; i < sizeof(regpairs) / sizeof(struct reg_str_pair);
-           i++) {
-        if (case_agnostic_strcmp(regpairs[i].reg_name, reg)) {
-          free(reg);
-          return (struct token){ .t = REGISTER, .d.i = regpairs[i].reg_val };
-        }
-      }
-
-      ERR("%i:%i | unknown register: %s\n", line + 1, col + 1, reg);
+      id = parse_ident();
+      if (ident_reg(id) == IDENT_NONE)
+        ERR("%i:%i | unknown register: %s\n",
+            line + 1,
+            col + 1,
+            idents[id].str);
+      return (struct token){ .t = REGISTER, .d.i = ident_reg(id) };
 
     case '#':
       nextc();
@@ -435,113 +836,175 @@ retry:
       nextc();
       return (struct token){
         .t = LBLDEREF,
-        .d.s = parse_ident(),
+        .d.i = parse_ident(),
       };
 
     default:
       if (isalpha(CURC) || CURC == '_') {
-        char* str = parse_ident();
+        id = parse_ident();
 
-        for (size_t i = 0; i < sizeof(tokpairs) / sizeof(struct tok_str_pair);
-             i++)
-          if (case_agnostic_strcmp(str, tokpairs[i].dat)) {
-            free(str);
-            return (struct token){ .t = tokpairs[i].ty };
-          }
+        if (ident_tok(id) != IDENT_NONE)
+          return (struct token){ .t = ident_tok(id) };
 
-        if (src[srcidx] == ':') {
+        if (CURC == ':') {
           nextc();
           return (struct token){
             .t = LABELDEF,
-            .d.s = str,
+            .d.i = id,
           };
+        } else if (ident_is(id, "sizeof")) {
+          return (struct token){ .t = SIZEOF };
         } else {
           return (struct token){
             .t = LBLVAL,
-            .d.s = str,
+            .d.i = id,
           };
         }
       }
   }
 
-  ERR("unknown token in lexer <%c>\n", CURC);
+  ERR("%i:%i | unknown token in lexer <%c>\n", line + 1, col + 1, CURC);
+}
+
+/// turns all of src into tokens, ending in a TOK_EOF
+static void
+lex(void)
+{
+  struct token t = { .t = TOK_EOF };
+
+  do {
+    t = lex_one(t.t);
+    t.line = tok_line;
+    t.col = tok_col;
+
+    tokens = grow(tokens, &cap_tokens, num_tokens, sizeof(*tokens));
+    tokens[num_tokens++] = t;
+
+    // "label: .ascii "..."" gives label a size, known before any sizeof
+    if (t.t == STRING && num_tokens >= 3 &&
+        tokens[num_tokens - 2].t == DIRECTIVE &&
+        tokens[num_tokens - 3].t == LABELDEF) {
+      const int dir = tokens[num_tokens - 2].d.i;
+      const bool z = ident_is(dir, DIRECTIVE_ASCIZ);
+
+      if (z || ident_is(dir, DIRECTIVE_ASCII))
+        idents[tokens[num_tokens - 3].d.i].size = strlen(t.d.s) + z;
+    }
+  } while (t.t != TOK_EOF);
+}
+
+__attribute__((always_inline)) static inline struct token
+next(void)
+{
+  // the trailing TOK_EOF is handed out forever
+  return tokidx < num_tokens - 1 ? tokens[tokidx++] : tokens[tokidx];
 }
 
 __attribute__((always_inline)) static inline struct token
 peek(void)
 {
-  int tmp = srcidx;
-  struct token out = next();
-  srcidx = tmp;
-  return out;
+  return tokens[tokidx];
+}
+
+/// starts the next section at outbuf_idx, placed like the one before
+/// unless `flags` says it has a placement of its own now
+static void
+open_section(uint8_t flags)
+{
+  sections = grow(sections, &cap_sections, num_sections, sizeof(*sections));
+  sections[num_sections] = (struct obj_section){
+    .flags = flags,
+    .at = outbuf_idx,
+    .offset = outbuf_offset,
+  };
+  section_start = outbuf_idx;
 }
 
 static void
 init(const char* indat)
 {
+  pthread_once(&phash_once, phash_build_all);
+
+  if (!outbuf && !(outbuf = malloc(ROMIMAGE_MAX)))
+    ERR("out of memory\n");
+
   srcidx = 0;
   src = indat;
 
   line = col = 0;
+  in_brackets = false;
+
+  arena_free();
+  num_idents = 0;
+  if (ident_index)
+    memset(ident_index, 0, ident_index_cap * sizeof(int));
+  num_tokens = 0;
+  tokidx = 0;
 
   num_syms = 0;
+  num_relocs = 0;
+  num_sections = 0;
+  num_insns = 0;
   outbuf_idx = 0;
   outbuf_offset = 0;
+  open_section(OBJ_SEC_FLOAT | OBJ_SEC_INHERIT_OFFSET);
 }
 
-#define PUSH_BYTE(i) outbuf[outbuf_idx++] = (uint8_t)i
+#define PUSH_BYTE(i)                                                           \
+  {                                                                            \
+    if (outbuf_idx >= ROMIMAGE_MAX)                                            \
+      ERR("output is larger than %li bytes\n", ROMIMAGE_MAX);                  \
+    outbuf[outbuf_idx++] = (uint8_t)(i);                                       \
+  }
 #define PUSH_SHORT(i)                                                          \
   {                                                                            \
-    outbuf[outbuf_idx++] = (i >> 8);                                           \
-    outbuf[outbuf_idx++] = (i);                                                \
+    PUSH_BYTE((i) >> 8);                                                       \
+    PUSH_BYTE(i);                                                              \
   }
 #define RELOCATE_THIS 0x10000
 
+/// a reference to `id` from the short just pushed, the linker fills it in
 static inline void
-mark_last_unresolved(char* to)
+mark_last_unresolved(int id)
 {
-  unresolved[num_unresolved++] = (struct unresolved){
-    .at = outbuf_idx - 2,
-    .to = to,
+  relocs = grow(relocs, &cap_relocs, num_relocs, sizeof(*relocs));
+  relocs[num_relocs++] = (struct obj_ref){
+    .name = id,
+    .section = num_sections,
+    .off = outbuf_idx - 2 - section_start,
   };
 }
 
-static struct symbol*
-get_sym(const char* str)
+static inline void
+push_symbol(int id)
 {
-  for (int i = 0; i < num_syms; i++) {
-    if (strcmp(symbols[i].label, str) == 0)
-      return &symbols[i];
-  }
-
-  return NULL;
+  if (idents[id].sym)
+    ERR("label <%s> defined twice\n", idents[id].str);
+
+  symbols = grow(symbols, &cap_syms, num_syms, sizeof(*symbols));
+  symbols[num_syms++] = (struct obj_ref){
+    .name = id,
+    .section = num_sections,
+    .off = outbuf_idx - section_start,
+  };
+  idents[id].sym = true;
+  if (!quiet)
+    printf("new label: <%s> = %04Xh\n",
+           idents[id].str,
+           outbuf_idx + outbuf_offset);
 }
 
-// resolve all symbols
+/// copies the open section out of outbuf, a .set may write over it later
 static void
-link(void)
+close_section(void)
 {
-  for (int i = 0; i < num_unresolved; i++) {
-    struct unresolved cur = unresolved[i];
-    struct symbol* sym = get_sym(cur.to);
+  struct obj_section* s = &sections[num_sections++];
 
-    printf(
-      "linking... @%04Xh -> <%s> = @%04Xh\n", cur.at, sym->label, sym->loc);
-
-    if (!sym)
-      ERR("failed to find symbol\n");
-
-    outbuf[cur.at] = (uint8_t)(sym->loc >> 8);
-    outbuf[cur.at + 1] = (uint8_t)(sym->loc);
-  }
-}
-
-static inline void
-push_symbol(char* name)
-{
-  symbols[num_syms++] =
-    (struct symbol){ .label = name, .loc = outbuf_idx + outbuf_offset };
-  printf("new label: <%s> = %04Xh\n", name, outbuf_idx + outbuf_offset);
+  s->len = outbuf_idx - section_start;
+  s->bytes = malloc(s->len ? s->len : 1);
+  if (!s->bytes)
+    ERR("out of memory\n");
+  memcpy(s->bytes, &outbuf[section_start], s->len);
 }
 
 static void
@@ -550,7 +1013,11 @@ directive_set(void)
   struct token tok = next();
   if (tok.t != IMMVAL)
     ERR("expected immediate value after .set directive\n");
+
+  const uint8_t flags = sections[num_sections].flags & ~OBJ_SEC_FLOAT;
+  close_section();
   outbuf_idx = tok.d.i;
+  open_section(flags);
 }
 
 static void
@@ -559,27 +1026,34 @@ directive_offset(void)
   struct token tok = next();
   if (tok.t != IMMVAL)
     ERR("expected immediate value after .offset directive\n");
+
+  const uint8_t flags =
+    sections[num_sections].flags & ~OBJ_SEC_INHERIT_OFFSET;
+  close_section();
   outbuf_offset = tok.d.i;
+  open_section(flags);
 }
 
+static bool
+starts_value(enum tokty t);
+
+static struct token
+parse_value(void);
+
 static void
 directive_word(void)
 {
-  struct token tok = next();
-  switch (tok.t) {
-    case IMMVAL:
-      PUSH_BYTE(tok.d.i >> 8);
-      PUSH_BYTE(tok.d.i);
-      break;
+  struct token tok;
 
-    case LBLVAL:
-      PUSH_BYTE(0x00);
-      PUSH_BYTE(0x00);
-      mark_last_unresolved(tok.d.s);
-      break;
+  if (!starts_value(peek().t))
+    ERR("expected immediate value or labelptr after .word directive\n");
 
-    default:
-      ERR("expected immediate value or labelptr after .word directive\n");
+  tok = parse_value();
+  if (tok.t == IMMVAL) {
+    PUSH_SHORT(tok.d.i);
+  } else {
+    PUSH_SHORT(tok.d.deref.off);
+    mark_last_unresolved(tok.d.deref.id);
   }
 }
 
@@ -605,8 +1079,8 @@ directive_ascii(void)
   struct token tok = next();
   if (tok.t != STRING)
     ERR(".ascii directive must have a string immediately after\n")
-  for (size_t i = 0; i < strlen(tok.d.s); i++)
-    PUSH_BYTE(tok.d.s[i]);
+  for (const char* c = tok.d.s; *c; c++)
+    PUSH_BYTE(*c);
 }
 
 static void
@@ -615,8 +1089,8 @@ directive_asciz(void)
   struct token tok = next();
   if (tok.t != STRING)
     ERR(".asciz directive must have a string immediately after\n")
-  for (size_t i = 0; i < strlen(tok.d.s); i++)
-    PUSH_BYTE(tok.d.s[i]);
+  for (const char* c = tok.d.s; *c; c++)
+    PUSH_BYTE(*c);
   PUSH_BYTE(0x00);
 }
 
@@ -633,20 +1107,218 @@ struct
   { .name = DIRECTIVE_ASCIZ, .ptr = directive_asciz },
 };
 
-const int directive_pair_len =
-  sizeof(directive_pairs) / sizeof(*directive_pairs);
+static struct phash directives = PHASH_OF(directive_pairs);
+
+static void
+phash_build_all(void)
+{
+  phash_build(&mnemonics);
+  phash_build(&registers);
+  phash_build(&directives);
+}
 
 static bool
-match_directive(const char* in)
+match_directive(int id)
 {
-  for (size_t i = 0; i < directive_pair_len; i++) {
-    if (strcmp(directive_pairs[i].name, in) == 0) {
-      directive_pairs[i].ptr();
-      return true;
+  struct ident* ident = &idents[id];
+
+  if (ident->directive == IDENT_UNKNOWN)
+    ident->directive = phash_find(&directives, ident->str, ident->len);
+
+  if (ident->directive == IDENT_NONE)
+    return false;
+
+  directive_pairs[ident->directive].ptr();
+  return true;
+}
+
+/// a value known when assembling, plus the address of the label `id` if it
+/// is not -1, which the linker adds
+struct value
+{
+  int64_t val;
+  int id;
+};
+
+static struct token
+expect(enum tokty ty, const char* what)
+{
+  const struct token t = next();
+  if (t.t != ty)
+    ERR("%i:%i | expected %s\n", t.line + 1, t.col + 1, what);
+  return t;
+}
+
+static struct value
+parse_expr(void);
+
+static struct value
+parse_sizeof(void)
+{
+  const bool paren = peek().t == LPAREN;
+  struct token t;
+
+  if (paren)
+    next();
+  t = expect(LBLVAL, "a label after sizeof");
+  if (idents[t.d.i].size < 0)
+    ERR("%i:%i | <%s> is not the label of an .ascii or .asciz string\n",
+        t.line + 1,
+        t.col + 1,
+        idents[t.d.i].str);
+  if (paren)
+    expect(RPAREN, "')' after sizeof");
+
+  return (struct value){ idents[t.d.i].size, -1 };
+}
+
+static struct value
+parse_primary(void)
+{
+  const struct token t = next();
+  struct value v;
+
+  switch (t.t) {
+    case IMMVAL:
+      return (struct value){ t.d.i, -1 };
+
+    case LBLVAL:
+      return (struct value){ 0, t.d.i };
+
+    case SIZEOF:
+      return parse_sizeof();
+
+    case LPAREN:
+      v = parse_expr();
+      expect(RPAREN, "')'");
+      return v;
+
+    case MINUS:
+      v = parse_primary();
+      if (v.id >= 0)
+        ERR("%i:%i | a label can not be negated\n", t.line + 1, t.col + 1);
+      return (struct value){ -v.val, -1 };
+
+    default:
+      ERR("%i:%i | expected a number, label or sizeof in expression\n",
+          t.line + 1,
+          t.col + 1);
+  }
+}
+
+/// errors out unless `v` still fits a short either way, so nothing overflows
+static struct value
+in_range(struct value v, struct token at)
+{
+  if (v.val < -UINT16_MAX || v.val > UINT16_MAX)
+    ERR("%i:%i | expression out of range\n", at.line + 1, at.col + 1);
+  return v;
+}
+
+static struct value
+parse_term(void)
+{
+  struct value v = parse_primary();
+
+  while (peek().t == STAR || peek().t == SLASH) {
+    const struct token op = next();
+    const struct value r = parse_primary();
+
+    if (v.id >= 0 || r.id >= 0)
+      ERR("%i:%i | labels can only be added to and subtracted from\n",
+          op.line + 1,
+          op.col + 1);
+    if (op.t == SLASH && r.val == 0)
+      ERR("%i:%i | division by zero\n", op.line + 1, op.col + 1);
+
+    v.val = op.t == STAR ? v.val * r.val : v.val / r.val;
+    v = in_range(v, op);
+  }
+
+  return v;
+}
+
+/// + and - over * and /, over unary -, numbers, labels, sizeof and ()
+/// a label may be added once, the linker does that, or subtracted from
+/// itself
+static struct value
+parse_expr(void)
+{
+  struct value v = parse_term();
+
+  while (peek().t == PLUS || peek().t == MINUS) {
+    const struct token op = next();
+    const struct value r = parse_term();
+
+    if (op.t == PLUS && v.id >= 0 && r.id >= 0)
+      ERR("%i:%i | only one label can be added\n", op.line + 1, op.col + 1);
+    if (op.t == MINUS && r.id >= 0 && r.id != v.id)
+      ERR("%i:%i | a label can only be subtracted from itself\n",
+          op.line + 1,
+          op.col + 1);
+
+    if (op.t == PLUS) {
+      v.val += r.val;
+      v.id = v.id >= 0 ? v.id : r.id;
+    } else {
+      v.val -= r.val;
+      v.id = r.id >= 0 ? -1 : v.id;
     }
+    v = in_range(v, op);
   }
 
-  return false;
+  return v;
+}
+
+/// "[%r]", "[%r + expr]" or "[%r - expr]" as one DEREF, DEREFOFF or
+/// DEREFOFFLBL token. the offset wraps around like the address it is
+/// added to, an offset of 0 is left out
+static struct token
+parse_deref(void)
+{
+  struct token t = next();
+  struct value v = { 0, -1 };
+
+  t.d.deref.reg = expect(REGISTER, "a register after '['").d.i;
+
+  // a - is left for parse_expr, so "[%r - 2 + 1]" is %r - 1
+  if (peek().t == PLUS || peek().t == MINUS) {
+    if (peek().t == PLUS)
+      next();
+    v = parse_expr();
+  }
+  expect(RBRACKET, "']'");
+
+  t.t = v.id >= 0 ? DEREFOFFLBL : v.val ? DEREFOFF : DEREF;
+  t.d.deref.off = (uint16_t)v.val;
+  t.d.deref.id = v.id;
+  return t;
+}
+
+static bool
+starts_value(enum tokty t)
+{
+  return t == IMMVAL || t == LBLVAL || t == SIZEOF || t == LPAREN ||
+         t == MINUS;
+}
+
+/// an expression as one IMMVAL, or one LBLVAL whose label's address the
+/// linker adds to d.deref.off
+static struct token
+parse_value(void)
+{
+  struct token t = peek();
+  const struct value v = parse_expr();
+
+  if (v.id < 0) {
+    t.t = IMMVAL;
+    t.d.i = (uint16_t)v.val;
+  } else {
+    t.t = LBLVAL;
+    t.d.deref.off = (uint16_t)v.val;
+    t.d.deref.id = v.id;
+  }
+  return t;
 }
 
 struct matrix_variant
@@ -663,15 +1335,16 @@ struct matrix_instruction
   const struct matrix_variant* variants;
 };
 
+// instruction_matrix is indexed by the mnemonic's token
 #define DEFNINSTR(whensees, ...)                                               \
-  {                                                                            \
+  [whensees] = {                                                               \
     whensees,                                                                  \
       sizeof((const struct matrix_variant[])__VA_ARGS__) /                     \
         sizeof(const struct matrix_variant),                                   \
       (const struct matrix_variant[])__VA_ARGS__,                              \
   }
 #define DEFNZINSTR(whensees, out)                                              \
-  {                                                                            \
+  [whensees] = {                                                               \
     whensees, 1,                                                               \
       (const struct matrix_variant[]){                                         \
         out,                                                                   \
@@ -685,7 +1358,7 @@ struct matrix_instruction
       (const enum tokty[])__VA_ARGS__,                                         \
   }
 
-struct matrix_instruction instruction_matrix[] = {
+static const struct matrix_instruction instruction_matrix[TOK_EOF] = {
   DEFNZINSTR(TOK_NOP, NOP),
   DEFNZINSTR(TOK_RET, RET),
   DEFNZINSTR(TOK_ENINT, ENINT),
@@ -704,6 +1377,9 @@ struct matrix_instruction instruction_matrix[] = {
               DEFNVARI(LOAD_REG_IMM, { REGISTER, LBLVAL }),
               DEFNVARI(LOAD_REG_DEREF, { REGISTER, DEREFVAL }),
               DEFNVARI(LOAD_REG_DEREF, { REGISTER, LBLDEREF }),
+              DEFNVARI(LOAD_REG_REGDEREF, { REGISTER, DEREF }),
+              DEFNVARI(LOAD_REG_REGDEREF_OFF, { REGISTER, DEREFOFF }),
+              DEFNVARI(LOAD_REG_REGDEREF_OFF, { REGISTER, DEREFOFFLBL }),
             }),
   DEFNINSTR(TOK_STOR,
             {
@@ -714,6 +1390,15 @@ struct matrix_instruction instruction_matrix[] = {
 
               DEFNVARI(STOR_PTRDEREF_REG, { DEREFVAL, REGISTER }),
               DEFNVARI(STOR_PTRDEREF_REG, { LBLDEREF, REGISTER }),
+              DEFNVARI(STOR_REGDEREF_REG, { DEREF, REGISTER }),
+              DEFNVARI(STOR_REGDEREF_OFF_REG, { DEREFOFF, REGISTER }),
+              DEFNVARI(STOR_REGDEREF_OFF_REG, { DEREFOFFLBL, REGISTER }),
+              DEFNVARI(STOR_REGDEREF_IMM, { DEREF, IMMVAL }),
+              DEFNVARI(STOR_REGDEREF_IMM, { DEREF, LBLVAL }),
+              DEFNVARI(STOR_REGDEREF_OFF_IMM, { DEREFOFF, IMMVAL }),
+              DEFNVARI(STOR_REGDEREF_OFF_IMM, { DEREFOFF, LBLVAL }),
+              DEFNVARI(STOR_REGDEREF_OFF_IMM, { DEREFOFFLBL, IMMVAL }),
+              DEFNVARI(STOR_REGDEREF_OFF_IMM, { DEREFOFFLBL, LBLVAL }),
             }),
   DEFNINSTR(TOK_ADD,
             {
@@ -775,31 +1460,77 @@ struct matrix_instruction instruction_matrix[] = {
               DEFNVARI(BRANCH_GREATER_THAN_EQUAL, { IMMVAL }),
               DEFNVARI(BRANCH_GREATER_THAN_EQUAL, { LBLVAL }),
             }),
+  // port io, e.g. "READ #A0h %r0;" and "WRITE #1 %r0;"
   DEFNINSTR(TOK_WRITE,
             {
-              DEFNVARI(WRITEOUT_IMM_IMM, { IMMVAL, DEREFVAL }),
-              DEFNVARI(WRITEOUT_IMM_IMM, { IMMVAL, LBLDEREF }),
-              DEFNVARI(WRITEOUT_REG_IMM, { REGISTER, DEREFVAL }),
-              DEFNVARI(WRITEOUT_REG_IMM, { REGISTER, LBLDEREF }),
-              DEFNVARI(WRITEOUT_IMM_REG, { IMMVAL, REGISTER }),
-              DEFNVARI(WRITEOUT_REG_REG, { REGISTER, REGISTER }),
+              DEFNVARI(BOUT, { IMMVAL, REGISTER }),
             }),
   DEFNINSTR(TOK_READ,
             {
-              DEFNVARI(READIN_IMM_IMM, { IMMVAL, DEREFVAL }),
-              DEFNVARI(READIN_IMM_IMM, { IMMVAL, LBLDEREF }),
-              DEFNVARI(READIN_REG_IMM, { REGISTER, DEREFVAL }),
-              DEFNVARI(READIN_REG_IMM, { REGISTER, LBLDEREF }),
-              DEFNVARI(READIN_IMM_REG, { IMMVAL, REGISTER }),
-              DEFNVARI(READIN_REG_REG, { REGISTER, REGISTER }),
+              DEFNVARI(BIN, { IMMVAL, REGISTER }),
+            }),
+  DEFNINSTR(TOK_SWRITE,
+            {
+              DEFNVARI(SOUT, { IMMVAL, REGISTER }),
+            }),
+  DEFNINSTR(TOK_SREAD,
+            {
+              DEFNVARI(SIN, { IMMVAL, REGISTER }),
+            }),
+  // block ops, e.g. "MEMCPY %r0 %r1 %r2;" copies %r2 bytes from [%r1] to [%r0]
+  DEFNINSTR(TOK_MEMCPY,
+            {
+              DEFNVARI(MEMCPY, { REGISTER, REGISTER, REGISTER }),
+            }),
+  DEFNINSTR(TOK_MEMSET,
+            {
+              DEFNVARI(MEMSET, { REGISTER, REGISTER, REGISTER }),
+            }),
+  DEFNINSTR(TOK_MEMCMP,
+            {
+              DEFNVARI(MEMCMP, { REGISTER, REGISTER, REGISTER }),
             }),
+  // lane ops, e.g. "VADDB %r0 %r1 %r2;" adds %r2 bytes at [%r1] into [%r0]
+  // and "VSUMW %r0 %r1 %r2;" sums %r2 shorts at [%r0] into %r1
+  DEFNINSTR(TOK_VADDB, { DEFNVARI(VADDB, { REGISTER, REGISTER, REGISTER }) }),
+  DEFNINSTR(TOK_VADDW, { DEFNVARI(VADDW, { REGISTER, REGISTER, REGISTER }) }),
+  DEFNINSTR(TOK_VXORB, { DEFNVARI(VXORB, { REGISTER, REGISTER, REGISTER }) }),
+  DEFNINSTR(TOK_VXORW, { DEFNVARI(VXORW, { REGISTER, REGISTER, REGISTER }) }),
+  DEFNINSTR(TOK_VCMPEQB,
+            { DEFNVARI(VCMPEQB, { REGISTER, REGISTER, REGISTER }) }),
+  DEFNINSTR(TOK_VCMPEQW,
+            { DEFNVARI(VCMPEQW, { REGISTER, REGISTER, REGISTER }) }),
+  DEFNINSTR(TOK_VMINB, { DEFNVARI(VMINB, { REGISTER, REGISTER, REGISTER }) }),
+  DEFNINSTR(TOK_VMINW, { DEFNVARI(VMINW, { REGISTER, REGISTER, REGISTER }) }),
+  DEFNINSTR(TOK_VMAXB, { DEFNVARI(VMAXB, { REGISTER, REGISTER, REGISTER }) }),
+  DEFNINSTR(TOK_VMAXW, { DEFNVARI(VMAXW, { REGISTER, REGISTER, REGISTER }) }),
+  DEFNINSTR(TOK_VSUMB, { DEFNVARI(VSUMB, { REGISTER, REGISTER, REGISTER }) }),
+  DEFNINSTR(TOK_VSUMW, { DEFNVARI(VSUMW, { REGISTER, REGISTER, REGISTER }) }),
 };
 
-const int instr_matrix_len =
-  sizeof(instruction_matrix) / sizeof(struct matrix_instruction);
+static inline bool
+is_deref(enum tokty t)
+{
+  return t == DEREF || t == DEREFOFF || t == DEREFOFFLBL;
+}
+
+/// a [] operand, its register low and `reg` high in one byte, then the
+/// offset if it has one
+static void
+push_deref(int reg, const struct token* t)
+{
+  PUSH_BYTE(reg << 4 | t->d.deref.reg);
+  if (t->t == DEREF)
+    return;
+
+  PUSH_SHORT(t->d.deref.off);
+  if (t->t == DEREFOFFLBL)
+    mark_last_unresolved(t->d.deref.id);
+}
 
+/// assembles the instruction whose mnemonic is `at`
 static void
-matrix_instr_perform(struct matrix_instruction instr)
+matrix_instr_perform(struct matrix_instruction instr, struct token at)
 {
   struct token toks[4];
   int num_ops = 0;
@@ -808,7 +1539,14 @@ matrix_instr_perform(struct matrix_instruction instr)
     const struct token t = peek();
     if (t.t == SEMICOLON)
       break;
-    toks[num_ops++] = next();
+    if (t.t == TOK_EOF || num_ops == sizeof(toks) / sizeof(toks[0]))
+      ERR("%i:%i | expected ';' after <%s>\n",
+          t.line + 1,
+          t.col + 1,
+          TOKTY_NAMES[instr.tok]);
+    toks[num_ops++] = t.t == LBRACKET      ? parse_deref()
+                      : starts_value(t.t) ? parse_value()
+                                          : next();
   }
 
   // skip the semicolon...
@@ -825,9 +1563,28 @@ matrix_instr_perform(struct matrix_instruction instr)
         goto fail;
     }
 
+    const int start = outbuf_idx;
     PUSH_BYTE(cv.out);
 
     for (int opi = 0; opi < cv.num_ops; opi++) {
+      // a register next to a [] shares its byte, either side of it
+      if (opi < num_ops - 1 && toks[opi].t == REGISTER &&
+          is_deref(toks[opi + 1].t)) {
+        push_deref(toks[opi].d.i, &toks[opi + 1]);
+        opi++;
+        continue;
+      }
+      if (opi < num_ops - 1 && is_deref(toks[opi].t) &&
+          toks[opi + 1].t == REGISTER) {
+        push_deref(toks[opi + 1].d.i, &toks[opi]);
+        opi++;
+        continue;
+      }
+      if (is_deref(toks[opi].t)) {
+        push_deref(0, &toks[opi]);
+        continue;
+      }
+
       // special case for "dual registers"
       if (opi < num_ops - 1 && toks[opi].t == REGISTER &&
           toks[opi + 1].t == REGISTER) {
@@ -840,11 +1597,23 @@ matrix_instr_perform(struct matrix_instruction instr)
         PUSH_BYTE(toks[opi].d.i);
       } else if (toks[opi].t == IMMVAL || toks[opi].t == DEREFVAL) {
         PUSH_SHORT(toks[opi].d.i);
-      } else if (toks[opi].t == LBLVAL || toks[opi].t == LBLDEREF) {
+      } else if (toks[opi].t == LBLVAL) {
+        PUSH_SHORT(toks[opi].d.deref.off);
+        mark_last_unresolved(toks[opi].d.deref.id);
+      } else if (toks[opi].t == LBLDEREF) {
         PUSH_SHORT(0);
-        mark_last_unresolved(toks[opi].d.s);
+        mark_last_unresolved(toks[opi].d.i);
       }
     }
+
+    insns = grow(insns, &cap_insns, num_insns, sizeof(*insns));
+    insns[num_insns++] = (struct opt_insn){
+      .section = num_sections,
+      .off = start - section_start,
+      .len = outbuf_idx - start,
+      .line = at.line + 1,
+      .col = at.col + 1,
+    };
     return;
 
   fail:;
@@ -858,8 +1627,8 @@ matrix_instr_perform(struct matrix_instruction instr)
     for (int opi = 0; opi < cv.num_ops; opi++) {
       if (toks[opi].t != cv.operands[opi]) {
         ERR("%i:%i invalid value in opcode <%s>\n",
-            line + 1,
-            col + 1,
+            toks[opi].line + 1,
+            toks[opi].col + 1,
             TOKTY_NAMES[instr.tok]);
       }
     }
@@ -872,19 +1641,15 @@ matrix_instr_perform(struct matrix_instruction instr)
 }
 
 static struct matrix_instruction
-matrix_lookup(enum tokty ty)
+matrix_lookup(struct token t)
 {
-  fflush(stdout);
-  for (size_t opidx = 0; opidx < instr_matrix_len; opidx++) {
-    struct matrix_instruction cur_matr = instruction_matrix[opidx];
-    if (cur_matr.tok == ty)
-      return cur_matr;
-  }
+  if (t.t < TOK_EOF && instruction_matrix[t.t].num_vars)
+    return instruction_matrix[t.t];
 
   ERR("%i:%i unknown instruction in perform_matrix: <%s>\n",
-      line + 1,
-      col + 1,
-      TOKTY_NAMES[ty]);
+      t.line + 1,
+      t.col + 1,
+      TOKTY_NAMES[t.t]);
 }
 
 static void
@@ -897,29 +1662,198 @@ begin_assemble(void)
     if (t.t == TOK_EOF)
       break;
     else if (t.t == LABELDEF) {
-      push_symbol(t.d.s);
+      push_symbol(t.d.i);
     } else if (t.t == DIRECTIVE) {
-      if (!match_directive(t.d.s))
-        ERR("unknown directive %s\n", t.d.s);
+      if (!match_directive(t.d.i))
+        ERR("unknown directive %s\n", idents[t.d.i].str);
     } else {
-      matrix_instr_perform(matrix_lookup(t.t));
+      matrix_instr_perform(matrix_lookup(t), t);
     }
+  }
+}
+
+static uint64_t
+now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+extern void
+assemble_quiet(bool q)
+{
+  quiet = q;
+  link_quiet(q);
+}
 
-    outbuf_max_len = MAX(outbuf_max_len, outbuf_idx);
+extern void
+assemble_optimize(bool on)
+{
+  optimize = on;
+}
+
+extern void
+assemble_add_report(const struct opt_report* r)
+{
+  pthread_mutex_lock(&report_lock);
+  report.threaded += r->threaded;
+  report.jumps += r->jumps;
+  report.moves += r->moves;
+  report.tests += r->tests;
+  report.shortened += r->shortened;
+  report.relaxed += r->relaxed;
+  report.bytes += r->bytes;
+  report.cycles += r->cycles;
+  pthread_mutex_unlock(&report_lock);
+}
+
+extern void
+assemble_get_report(struct opt_report* out)
+{
+  pthread_mutex_lock(&report_lock);
+  *out = report;
+  pthread_mutex_unlock(&report_lock);
+}
+
+extern void
+assemble_release(void)
+{
+  arena_free();
+  free(idents);
+  free(tokens);
+  free(sections);
+  free(symbols);
+  free(relocs);
+  free(insns);
+  free(ident_index);
+  free(outbuf);
+  link_release();
+
+  idents = NULL;
+  tokens = NULL;
+  sections = NULL;
+  symbols = NULL;
+  relocs = NULL;
+  insns = NULL;
+  ident_index = NULL;
+  outbuf = NULL;
+  cap_idents = cap_tokens = cap_sections = cap_syms = cap_relocs = 0;
+  cap_insns = 0;
+  ident_index_cap = 0;
+}
+
+extern void
+assemble_get_timings(struct assemble_timings* out)
+{
+  *out = timings;
+}
+
+/// hands the sections, symbols and relocs over to a new object, names
+/// become indexes into its own table of the labels they use
+static struct obj*
+make_object(void)
+{
+  struct obj* o = calloc(1, sizeof(*o));
+  int* name_of = malloc(num_idents * sizeof(int) + 1);
+
+  if (!o || !name_of)
+    ERR("out of memory\n");
+
+  close_section();
+  o->num_sections = num_sections;
+  o->sections = sections;
+  sections = NULL;
+  cap_sections = 0;
+
+  o->names = malloc((num_syms + num_relocs + 1) * sizeof(char*));
+  o->symbols = malloc((num_syms + 1) * sizeof(struct obj_ref));
+  o->relocs = malloc((num_relocs + 1) * sizeof(struct obj_ref));
+  if (!o->names || !o->symbols || !o->relocs)
+    ERR("out of memory\n");
+
+  for (int i = 0; i < num_idents; i++)
+    name_of[i] = -1;
+
+  for (int i = 0; i < num_syms + num_relocs; i++) {
+    struct obj_ref* r = i < num_syms ? &symbols[i] : &relocs[i - num_syms];
+    const struct ident* id = &idents[r->name];
+
+    if (name_of[r->name] < 0) {
+      char* name = malloc(id->len + 1);
+      if (!name)
+        ERR("out of memory\n");
+      memcpy(name, id->str, id->len + 1);
+      name_of[r->name] = o->num_names;
+      o->names[o->num_names++] = name;
+    }
+    r->name = name_of[r->name];
   }
+
+  memcpy(o->symbols, symbols, num_syms * sizeof(struct obj_ref));
+  memcpy(o->relocs, relocs, num_relocs * sizeof(struct obj_ref));
+  o->num_symbols = num_syms;
+  o->num_relocs = num_relocs;
+
+  if (optimize) {
+    o->report = calloc(1, sizeof(*o->report));
+    if (!o->report)
+      ERR("out of memory\n");
+    opt_peephole(o, insns, &num_insns, o->report);
+    assemble_add_report(o->report);
+  }
+
+  // after the peephole pass, which moves and drops instructions
+  o->lines = malloc((num_insns + 1) * sizeof(struct obj_line));
+  if (!o->lines)
+    ERR("out of memory\n");
+  for (int i = 0; i < num_insns; i++)
+    o->lines[i] = (struct obj_line){
+      .section = insns[i].section,
+      .off = insns[i].off,
+      .line = insns[i].line,
+      .col = insns[i].col,
+    };
+  o->num_lines = num_insns;
+
+  free(name_of);
+  return o;
+}
+
+extern struct obj*
+assemble_object(const char* in)
+{
+  init(in);
+
+  lex();
+  begin_assemble();
+  return make_object();
 }
 
 extern char*
 assemble(const char* in, size_t* outlen)
 {
+  uint64_t t0, t1, t2, t3;
+  struct obj* o;
+  char* out;
+
   init(in);
 
+  t0 = now_ns();
+  lex();
+  t1 = now_ns();
   begin_assemble();
-  link();
-
-  char* outbufcpy = malloc(outbuf_max_len);
-  memcpy(outbufcpy, outbuf, outbuf_max_len);
-  *outlen = outbuf_max_len;
+  t2 = now_ns();
+  o = make_object();
+  out = link_objects(&o, 1, outlen);
+  t3 = now_ns();
+
+  timings = (struct assemble_timings){
+    .lex_ns = t1 - t0,
+    .match_ns = t2 - t1,
+    .link_ns = t3 - t2,
+  };
 
-  return outbufcpy;
+  obj_free(o);
+  return out;
 }
@@ -0,0 +1,219 @@
+#define _POSIX_C_SOURCE 200809L
+
+/* bench/assembler.c
+
+        assembler throughput
+        generates sources of 1k to 1m lines out of every mnemonic, directive
+        and kind of label reference the assembler knows, assembles each a
+        few times quietly and prints lines per second for lexing, matching
+        against the instruction matrix and linking, plus peak rss.
+        `assembler -o file.psm n` only writes an n line source.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../defs.h"
+
+// new .set/.offset every this many lines, keeps the output in 64kb
+#define LINES_PER_PAGE 4096
+#define RUNS 3
+
+static const size_t sizes[] = { 1000, 10000, 100000, 1000000 };
+
+// one line each, $P is the label defined last, $F one defined a bit later
+// and $V the data label at the start of the page
+static const char* const templates[] = {
+  "\tNOP;",
+  "\tLOAD %r1 %r2;",
+  "\tLOAD %r3 #1234h;",
+  "\tLOAD %x0 l$F;",
+  "\tLOAD %r4 *8000h;",
+  "\tLOAD %r5 @v$V;",
+  "\tSTOR *8002h #42;",
+  "\tSTOR *8004h l$P;",
+  "\tSTOR @v$V #0FFh;",
+  "\tSTOR @v$V l$P;",
+  "\tSTOR *8006h %r6;",
+  "\tSTOR @v$V %r7;",
+  "\tADD %r0 %r1;",
+  "\tADD %r0 #1;",
+  "\tSUB %r0 %r1;",
+  "\tSUB %r0 #1;",
+  "\tMUL %r2 %r3;",
+  "\tMUL %r2 #3;",
+  "\tDIV %r2 %r3;",
+  "\tDIV %r2 #3;",
+  "\tTEST %r0 %r1;",
+  "\tTEST %r0 #0;",
+  "\tJUMP l$P;",
+  "\tBEQL l$P;",
+  "\tBNEQ l$F;",
+  "\tBLES l$P;",
+  "\tBGRT #C000h;",
+  "\tBLTE l$P;",
+  "\tBGTE l$F;",
+  "\tCALL l$P;",
+  "\tCALL #C000h;",
+  "\tRET;",
+  "\tREAD #1 %r0;",
+  "\tWRITE #1 %r0;",
+  "\tSIN #0A0h %r0;",
+  "\tSOUT #0A0h %r0;",
+  "\tMEMCPY %r0 %r1 %r2;",
+  "\tMEMSET %r0 %r1 %r2;",
+  "\tMEMCMP %r0 %r1 %r2;",
+  "\tVADDB %r0 %r1 %r2;",
+  "\tVADDW %r0 %r1 %r2;",
+  "\tVXORB %r0 %r1 %r2;",
+  "\tVXORW %r0 %r1 %r2;",
+  "\tVCMPEQB %r0 %r1 %r2;",
+  "\tVCMPEQW %r0 %r1 %r2;",
+  "\tVMINB %r0 %r1 %r2;",
+  "\tVMINW %r0 %r1 %r2;",
+  "\tVMAXB %r0 %r1 %r2;",
+  "\tVMAXW %r0 %r1 %r2;",
+  "\tVSUMB %r0 %r1 %r2;",
+  "\tVSUMW %r0 %r1 %r2;",
+  "\tENINT;",
+  "\tDISINT;",
+  "\tRTI;",
+  "\t.word l$P",
+  "\t.word #BEEFh",
+  "\t.byte #7",
+  "\t.ascii \"a few bytes\"",
+  "\t.asciz \"and a nul\"",
+  "| a comment",
+  "\tHALT;",
+};
+
+#define NUM_TEMPLATES (sizeof(templates) / sizeof(templates[0]))
+
+static void
+put_line(FILE* out, const char* t, unsigned label, unsigned page)
+{
+  for (; *t; t++) {
+    if (*t != '$') {
+      fputc(*t, out);
+      continue;
+    }
+
+    switch (*++t) {
+      case 'P':
+        fprintf(out, "%u", label - 1);
+        break;
+      case 'F':
+        fprintf(out, "%u", label + 1);
+        break;
+      case 'V':
+        fprintf(out, "%u", page);
+        break;
+    }
+  }
+  fputc('\n', out);
+}
+
+static void
+generate(FILE* out, size_t lines)
+{
+  unsigned label = 0, page = 0;
+
+  for (size_t i = 0; i < lines; i++) {
+    const size_t in_page = i % LINES_PER_PAGE;
+
+    if (in_page == 0)
+      fprintf(out, ".set #0h\n");
+    else if (in_page == 1)
+      fprintf(out, ".offset #C000h\n");
+    else if (in_page == 2)
+      fprintf(out, "v%u:\n", page++);
+    else if (in_page % 16 == 3)
+      fprintf(out, "l%u:\n", label++);
+    else
+      put_line(out, templates[i % NUM_TEMPLATES], label, page - 1);
+  }
+
+  // forward references from the last lines
+  fprintf(out, "l%u:\nl%u:\n", label, label + 1);
+}
+
+static double
+now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+extern int
+main(int argc, char** argv)
+{
+  int opt;
+
+  while ((opt = getopt(argc, argv, "o:")) != -1) {
+    if (opt != 'o' || optind >= argc) {
+      fprintf(stderr, "usage: %s [-o out.psm n]\n", argv[0]);
+      return 1;
+    }
+
+    FILE* out = fopen(optarg, "w");
+    if (!out) {
+      perror(optarg);
+      return 1;
+    }
+    generate(out, strtoul(argv[optind], NULL, 10));
+    fclose(out);
+    return 0;
+  }
+
+  assemble_quiet(true);
+
+  printf("%9s %12s %12s %12s %12s %10s\n",
+         "lines",
+         "lex l/s",
+         "match l/s",
+         "link l/s",
+         "total l/s",
+         "rss kb");
+
+  for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+    struct assemble_timings t, best = { UINT64_MAX, UINT64_MAX, UINT64_MAX };
+    struct rusage ru;
+    char* src;
+    size_t srclen, outlen;
+    double total = 1e30;
+
+    FILE* mem = open_memstream(&src, &srclen);
+    generate(mem, sizes[s]);
+    fclose(mem);
+
+    for (int run = 0; run < RUNS; run++) {
+      const double start = now();
+      free(assemble(src, &outlen));
+      const double secs = now() - start;
+
+      assemble_get_timings(&t);
+      best.lex_ns = t.lex_ns < best.lex_ns ? t.lex_ns : best.lex_ns;
+      best.match_ns = t.match_ns < best.match_ns ? t.match_ns : best.match_ns;
+      best.link_ns = t.link_ns < best.link_ns ? t.link_ns : best.link_ns;
+      total = secs < total ? secs : total;
+    }
+
+    getrusage(RUSAGE_SELF, &ru);
+    printf("%9zu %12.0f %12.0f %12.0f %12.0f %10ld\n",
+           sizes[s],
+           sizes[s] / (best.lex_ns / 1e9),
+           sizes[s] / (best.match_ns / 1e9),
+           sizes[s] / (best.link_ns / 1e9),
+           sizes[s] / total,
+           ru.ru_maxrss);
+
+    free(src);
+  }
+
+  return 0;
+}
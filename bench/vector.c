@@ -0,0 +1,110 @@
+#define _POSIX_C_SOURCE 199309L
+
+/* bench/vector.c
+
+        microbenchmarks for the lane op kernels
+        runs every op of every table the host supports over a few buffer
+        sizes, checks each against the scalar table and prints ns per byte.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../vector.h"
+
+// bytes touched per size before moving on, keeps every row ~equally long
+#define BENCH_BYTES (64 << 20)
+
+static const char* const op_names[VECTOR_NUM_OPS] = {
+  [VECTOR_ADD] = "add",     [VECTOR_XOR] = "xor", [VECTOR_CMPEQ] = "cmpeq",
+  [VECTOR_MIN] = "min",     [VECTOR_MAX] = "max", [VECTOR_SUM] = "sum",
+};
+
+static const size_t sizes[] = { 64, 256, 1024, 4096 };
+
+static uint8_t a[4096], b[4096], ref[4096];
+
+static void
+fill(uint8_t* buf, size_t len, unsigned seed)
+{
+  for (size_t i = 0; i < len; i++) {
+    seed = seed * 1103515245 + 12345;
+    buf[i] = seed >> 16;
+  }
+}
+
+static double
+now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// the simd kernel has to leave the same bytes and sum as the scalar one
+static int
+check(const struct vector_kernels* tab, int op, int w, size_t bytes)
+{
+  uint16_t want, got;
+
+  // odd lengths so the tails get exercised too
+  bytes -= 3 * (w + 1);
+  fill(ref, bytes, 1);
+  fill(b, bytes, 2);
+  // some equal lanes for cmpeq
+  memcpy(b, ref, bytes / 4);
+  memcpy(a, ref, bytes);
+
+  want = vector_scalar.k[op][w](ref, b, bytes / (w + 1));
+  got = tab->k[op][w](a, b, bytes / (w + 1));
+
+  return want == got && memcmp(a, ref, bytes) == 0;
+}
+
+extern int
+main(void)
+{
+  int failed = 0;
+
+  printf("%-7s %-6s %-2s", "table", "op", "w");
+  for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+    printf(" %8zuB", sizes[s]);
+  printf("   (ns/byte)\n");
+
+  for (int t = 0; vector_tables[t]; t++) {
+    const struct vector_kernels* tab = vector_tables[t];
+    if (!vector_supported(tab))
+      continue;
+
+    for (int op = 0; op < VECTOR_NUM_OPS; op++) {
+      for (int w = 0; w < 2; w++) {
+        printf("%-7s %-6s %-2i", tab->name, op_names[op], w + 1);
+
+        for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+          const size_t bytes = sizes[s];
+          const long iters = BENCH_BYTES / bytes;
+          volatile uint16_t sink = 0;
+
+          if (!check(tab, op, w, bytes)) {
+            printf("  MISMATCH");
+            failed = 1;
+            continue;
+          }
+
+          fill(a, bytes, 3);
+          const double start = now();
+          for (long i = 0; i < iters; i++)
+            sink += tab->k[op][w](a, b, bytes / (w + 1));
+          const double secs = now() - start;
+
+          printf(" %9.3f", secs * 1e9 / ((double)iters * bytes));
+        }
+        printf("\n");
+      }
+    }
+  }
+
+  return failed;
+}
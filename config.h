@@ -14,13 +14,55 @@ struct vm_config
   const char* input_filename;
   const char* output_filename;
   const char* parallel_loc;
+  // where -S writes its binary trace
+  const char* trace_filename;
+  // label map, written by the assembler and read by the profiler
+  const char* label_map_filename;
+  // unix socket the counters are served on
+  const char* stats_loc;
+  // keeps objects of assembled sources, named after a hash of their text
+  const char* object_cache;
   
+  // assemble into an object, see obj.h, instead of a rom
+  bool object_only;
+  // run the peephole optimizer, see opt.h
+  bool optimize;
+  // assemble every source into a rom of its own instead of linking them
+  bool rom_per_source;
+  // threads assembling sources side by side
+  int jobs;
+
   bool dump_registers;
   bool dump_memory;
-  bool show_steps;
+
+  // 1 traces ip and op per step, 2 also traces register changes
+  int show_steps;
+
+  // park the host thread when the guest spins waiting on an interrupt
+  bool idle_park;
 
   // if not 0, sleep n number of millis between vm steps
   int step_sleep;
+
+  // if not 0, 16kb banks behind the bank switching mmu
+  unsigned banks;
+
+  // if not -1, page the buffered console is mapped onto
+  int console_window;
+
+  // mmap'd and handed to the guest on the infile ports
+  const char* data_filename;
+
+  // if not 0, sample ip and the call stack every n cycles
+  long profile_period;
+
+  // histogram interrupt latency, printed at halt
+  bool latency;
+
+  // log every port read and interrupt into this file
+  const char* record_filename;
+  // feed the guest from a log written with record_filename
+  const char* replay_filename;
 };
 
 extern struct vm_config vm_config;
@@ -0,0 +1,132 @@
+#define _POSIX_C_SOURCE 199309L
+
+/* console.c
+
+        maps stdin/stdout onto CONSOLE_PORT
+        BIN/SIN take the next byte from stdin and block the guest while
+        there is none. once stdin is closed SIN reads 0xFFFF.
+        BOUT/SOUT write the low byte to stdout.
+
+        the console window is the same console behind a memory mapped page,
+        for guests that would rather move a buffer at a time with LOAD/STOR.
+        the first CONSOLE_WINDOW_CTL bytes are a buffer. STOR n to
+        CONSOLE_WINDOW_CTL writes the first n bytes of it to stdout, LOAD from
+        it refills the buffer with whatever stdin has ready and reads how many
+        bytes that was, 0 if none yet and 0xFFFF once stdin is closed.
+*/
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "console.h"
+#include "picovm.h"
+
+static enum picovm_io
+console_in(void* ctx, uint8_t port, int width, uint16_t* val)
+{
+  (void)ctx;
+  (void)port;
+  (void)width;
+
+  uint8_t c;
+  ssize_t n = read(STDIN_FILENO, &c, 1);
+
+  if (n == 1) {
+    *val = c;
+    return PICOVM_IO_OK;
+  }
+
+  if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    return PICOVM_IO_BLOCKED;
+
+  *val = 0xFFFF;
+  return PICOVM_IO_OK;
+}
+
+static enum picovm_io
+console_out(void* ctx, uint8_t port, int width, uint16_t val)
+{
+  (void)ctx;
+  (void)port;
+  (void)width;
+
+  putchar(val & 0xFF);
+  fflush(stdout);
+  return PICOVM_IO_OK;
+}
+
+struct console_window
+{
+  uint8_t buf[CONSOLE_WINDOW_CTL];
+};
+
+// the control short reads as 0 when straddled
+static uint8_t
+window_byte(const struct console_window* w, unsigned off)
+{
+  return off < CONSOLE_WINDOW_CTL ? w->buf[off] : 0;
+}
+
+static uint16_t
+window_read(void* ctx, uint16_t addr)
+{
+  struct console_window* w = ctx;
+  const uint8_t off = addr % PICOVM_PAGE_SIZE;
+  ssize_t n;
+
+  if (off != CONSOLE_WINDOW_CTL)
+    return (uint16_t)(window_byte(w, off) << 8) | window_byte(w, off + 1);
+
+  n = read(STDIN_FILENO, w->buf, sizeof(w->buf));
+  if (n > 0)
+    return n;
+  if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    return 0;
+  return 0xFFFF;
+}
+
+static void
+window_write(void* ctx, uint16_t addr, uint16_t val)
+{
+  struct console_window* w = ctx;
+  const uint8_t off = addr % PICOVM_PAGE_SIZE;
+
+  if (off == CONSOLE_WINDOW_CTL) {
+    fwrite(w->buf, 1, val < sizeof(w->buf) ? val : sizeof(w->buf), stdout);
+    fflush(stdout);
+    return;
+  }
+
+  if (off < CONSOLE_WINDOW_CTL)
+    w->buf[off] = val >> 8;
+  if (off + 1 < CONSOLE_WINDOW_CTL)
+    w->buf[off + 1] = val;
+}
+
+extern struct console_window*
+console_map_window(struct picovm* vm, uint8_t page)
+{
+  struct console_window* w = calloc(1, sizeof(*w));
+
+  if (w &&
+      picovm_map_mmio(vm, page, window_read, window_write, w) != PICOVM_OK) {
+    free(w);
+    return NULL;
+  }
+  return w;
+}
+
+extern void
+console_free_window(struct console_window* w)
+{
+  free(w);
+}
+
+extern void
+console_init(struct picovm* vm)
+{
+  picovm_map_port(vm, CONSOLE_PORT, console_in, console_out, NULL);
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+/* console.h
+
+        stdin/stdout device used by the cli
+*/
+
+#include <stdint.h>
+
+#define CONSOLE_PORT 0x01
+
+struct picovm;
+struct console_window;
+
+// shorts at the end of the console window, see console.c
+#define CONSOLE_WINDOW_CTL (256 - 2)
+
+extern void console_init(struct picovm* vm);
+
+/// maps a buffered console of its own onto `page`, NULL if picovm_map_mmio
+/// refused it
+extern struct console_window*
+console_map_window(struct picovm* vm, uint8_t page);
+
+/// frees `w`, once the vm it is mapped on no longer runs
+extern void console_free_window(struct console_window* w);
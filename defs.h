@@ -3,6 +3,7 @@
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
 
 #define ERR(...)                                                               \
   {                                                                            \
@@ -10,15 +11,17 @@
     exit(1);                                                                   \
   }
 
-#define INTFIFO "/tmp/picovmint.in"
-
 /// the maximum addressable space of 16bit is 0xFFFF + 1 (includes 0)
 #define RAMSIZE (0xFFFF + 1)
 #define ROMLOC 0xC000
 #define ROMLEN ((long)((0xFFFF - 0xC000) + 0x01))
+/// largest image the assembler writes, the rom window followed by
+/// banks for the mmu (see mmu.h)
+#define ROMIMAGE_MAX (ROMLEN * 64)
 #define STARTUP_VECTOR 0xFFFE
 #define STACK_HEAD_REGISTER 14
 #define STACK_BASE_REGISTER 15
+#define BLOCK_BYTES_PER_CYCLE 8
 
 enum flags {
   CRRY_FLAG = 0x01,
@@ -45,6 +48,19 @@ enum vm_ops {
   STOR_REGDEREF_IMM = 0x19, // stor [%0], 00
   STOR_REGDEREF_OFF_IMM = 0x1a, // stor [%0 + 24], 0x02
 
+  // block ops over ram, encoded as op, (a << 4 | b), len register
+  // addresses wrap around at 64kb, like every other access
+  // cost 1 cycle plus 1 per BLOCK_BYTES_PER_CYCLE bytes
+
+  // copy len bytes from [b] to [a], overlapping ranges are fine
+  MEMCPY = 0x20,
+  // fill len bytes at [a] with the low byte of b
+  MEMSET = 0x21,
+  // compare len bytes at [a] and [b], flags as TEST on the first bytes
+  // that differ (ZERO when all are equal). len is left holding the offset
+  // of the first difference, or is unchanged when all are equal
+  MEMCMP = 0x22,
+
   // arithmetic/bin functions store the result in the second register
   // division rounds down
 
@@ -65,6 +81,25 @@ enum vm_ops {
   XOR_REG_REG = 0x45,
   XOR_REG_IMM = 0x46,
 
+  // packed lane ops over ram, encoded as op, (a << 4 | b), lanes register
+  // ..B ops work on byte lanes, ..W ops on big endian short lanes, all
+  // unsigned. [a] = [a] op [b] for every lane, costed like the block ops.
+  // laid out as VADDB + 2 * enum vector_op + (short lanes), see vector.h
+  VADDB = 0x60,
+  VADDW = 0x61,
+  VXORB = 0x62,
+  VXORW = 0x63,
+  // lanes that are equal become all ones, the rest zero
+  VCMPEQB = 0x64,
+  VCMPEQW = 0x65,
+  VMINB = 0x66,
+  VMINW = 0x67,
+  VMAXB = 0x68,
+  VMAXW = 0x69,
+  // register b = sum of the lanes at [a], modulo 64k
+  VSUMB = 0x6A,
+  VSUMW = 0x6B,
+
   // subtract src from dest, set flags, restore dest
   TEST_REG_REG = 0x50,
   TEST_REG_IMM = 0x51,
@@ -74,6 +109,8 @@ enum vm_ops {
   RET = 0xA2,
   // return from interrupt
   RTI = 0xA3,
+  // CALL to a signed byte displacement, see BRANCH_SHORT
+  CALL_SHORT = 0xA4,
   PUSH = 0xA5,
   POP = 0xA6,
 
@@ -86,6 +123,7 @@ enum vm_ops {
   BRANCH_GREATER_THAN_EQUAL = 0xB6,
 
   /// read/write byte to port
+  /// encoded as op, port (short), register (byte)
   BIN,
   BOUT,
 
@@ -93,6 +131,17 @@ enum vm_ops {
   SIN,
   SOUT,
 
+  /// BRANCH and on, 0x10 further up, with the target as a signed byte
+  /// displacement from the end of the 2 byte instruction instead of an
+  /// address. the assembler picks them when the target is close enough
+  BRANCH_SHORT = 0xC0,
+  BRANCH_EQUAL_SHORT = 0xC1,
+  BRANCH_NOT_EQUAL_SHORT = 0xC2,
+  BRANCH_LESS_THAN_SHORT = 0xC3,
+  BRANCH_GREATER_THAN_SHORT = 0xC4,
+  BRANCH_LESS_THAN_EQUAL_SHORT = 0xC5,
+  BRANCH_GREATER_THAN_EQUAL_SHORT = 0xC6,
+
 
   /// enable interrupts
   ENINT = 0xFA,
@@ -103,6 +152,42 @@ enum vm_ops {
   HALT = 0xFF,
 };
 
-extern void run_with_rom(const uint8_t *rom, size_t len);
-
 extern char *assemble(const char *in, size_t *outlen);
+
+/// writes the labels of the last assemble() or link_objects() (see obj.h)
+/// as "ADDR label" lines
+extern void assemble_write_map(FILE *out);
+
+/// writes the labels and instruction lines of the last assemble() or
+/// link_objects() as a sidecar the VM can symbolize with, see symtab.h
+extern bool assemble_write_symbols(FILE *out);
+
+/// stops assemble() from printing every label and relocation
+extern void assemble_quiet(bool quiet);
+
+/// runs the peephole pass (see opt.h) on everything assembled from now on
+extern void assemble_optimize(bool on);
+
+struct opt_report;
+
+/// adds what the pass did on an object that was not assembled here, such
+/// as one out of the object cache
+extern void assemble_add_report(const struct opt_report *r);
+
+/// what the peephole pass did so far, over every source and thread
+extern void assemble_get_report(struct opt_report *out);
+
+/// frees what assemble() keeps around between calls on this thread,
+/// every thread assembles with state of its own
+extern void assemble_release(void);
+
+/// wall time spent in each phase of the last assemble()
+struct assemble_timings
+{
+  uint64_t lex_ns;
+  // instructions and directives against instruction_matrix
+  uint64_t match_ns;
+  uint64_t link_ns;
+};
+
+extern void assemble_get_timings(struct assemble_timings *out);
@@ -0,0 +1,248 @@
+/* hash.c
+
+        checksum device, see hash.h
+*/
+
+#include <pthread.h>
+#include <string.h>
+
+#include "hash.h"
+#include "picovm.h"
+#include "vm.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HASH_X86
+#include <immintrin.h>
+#endif
+
+// reflected castagnoli polynomial
+#define CRC32C_POLY 0x82F63B78u
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_table_once = PTHREAD_ONCE_INIT;
+
+static void
+crc_table_init(void)
+{
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t c = i;
+    for (int k = 0; k < 8; k++)
+      c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+    crc_table[i] = c;
+  }
+}
+
+extern uint32_t
+hash_crc32c_table(uint32_t crc, const uint8_t* p, size_t len)
+{
+  pthread_once(&crc_table_once, crc_table_init);
+
+  while (len--)
+    crc = (crc >> 8) ^ crc_table[(crc ^ *p++) & 0xFF];
+  return crc;
+}
+
+#ifdef HASH_X86
+
+__attribute__((target("sse4.2"))) static uint32_t
+crc32c_sse42(uint32_t crc, const uint8_t* p, size_t len)
+{
+#ifdef __x86_64__
+  uint64_t c = crc;
+  for (; len >= 8; p += 8, len -= 8) {
+    uint64_t w;
+    memcpy(&w, p, 8);
+    c = _mm_crc32_u64(c, w);
+  }
+  crc = (uint32_t)c;
+#endif
+  for (; len >= 4; p += 4, len -= 4) {
+    uint32_t w;
+    memcpy(&w, p, 4);
+    crc = _mm_crc32_u32(crc, w);
+  }
+  while (len--)
+    crc = _mm_crc32_u8(crc, *p++);
+  return crc;
+}
+
+#endif
+
+extern hash_crc_fn
+hash_crc32c_hw(void)
+{
+#ifdef HASH_X86
+  if (__builtin_cpu_supports("sse4.2"))
+    return crc32c_sse42;
+#endif
+  return NULL;
+}
+
+static inline uint32_t
+rotl32(uint32_t x, int r)
+{
+  return (x << r) | (x >> (32 - r));
+}
+
+static inline uint32_t
+murmur_k(uint32_t k)
+{
+  return rotl32(k * 0xCC9E2D51u, 15) * 0x1B873593u;
+}
+
+static inline uint32_t
+load_le32(const uint8_t* p)
+{
+  return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+         (uint32_t)p[3] << 24;
+}
+
+static inline uint32_t
+murmur_block(uint32_t h, uint32_t k)
+{
+  return rotl32(h ^ murmur_k(k), 13) * 5 + 0xE6546B64u;
+}
+
+static void
+murmur_update(struct hash* hs, const uint8_t* p, size_t len)
+{
+  size_t fill = hs->len & 3;
+
+  hs->len += len;
+
+  // finish a word left over from the previous update first
+  if (fill) {
+    while (fill < 4 && len) {
+      hs->tail[fill++] = *p++;
+      len--;
+    }
+    if (fill < 4)
+      return;
+    hs->h = murmur_block(hs->h, load_le32(hs->tail));
+  }
+
+  for (; len >= 4; p += 4, len -= 4)
+    hs->h = murmur_block(hs->h, load_le32(p));
+
+  memcpy(hs->tail, p, len);
+}
+
+static uint32_t
+murmur_digest(const struct hash* hs)
+{
+  uint32_t h = hs->h, k = 0;
+
+  switch (hs->len & 3) {
+    case 3:
+      k ^= (uint32_t)hs->tail[2] << 16;
+      /* fall through */
+    case 2:
+      k ^= (uint32_t)hs->tail[1] << 8;
+      /* fall through */
+    case 1:
+      k ^= hs->tail[0];
+      h ^= murmur_k(k);
+  }
+
+  h ^= hs->len;
+  h ^= h >> 16;
+  h *= 0x85EBCA6Bu;
+  h ^= h >> 13;
+  h *= 0xC2B2AE35u;
+  h ^= h >> 16;
+  return h;
+}
+
+static void
+hash_update(struct hash* hs, const uint8_t* p, size_t len)
+{
+  if (hs->algo == HASH_CRC32C)
+    hs->crc = hs->crc32c(hs->crc, p, len);
+  else
+    murmur_update(hs, p, len);
+}
+
+static uint32_t
+hash_digest(const struct hash* hs)
+{
+  return hs->algo == HASH_CRC32C ? ~hs->crc : murmur_digest(hs);
+}
+
+static void
+hash_reset(struct hash* hs, enum hash_algo algo)
+{
+  hs->algo = algo;
+  hs->crc = 0xFFFFFFFFu;
+  hs->h = 0;
+  hs->len = 0;
+}
+
+static enum picovm_io
+hash_in(void* ctx, uint8_t port, int width, uint16_t* val)
+{
+  struct picovm* vm = ctx;
+  (void)width;
+
+  switch (port) {
+    case HASH_PORT_CTL:
+      *val = vm->hash.algo;
+      break;
+    case HASH_PORT_PTR:
+      *val = vm->hash.at;
+      break;
+    case HASH_PORT_LO:
+      *val = (uint16_t)hash_digest(&vm->hash);
+      break;
+    case HASH_PORT_HI:
+      *val = hash_digest(&vm->hash) >> 16;
+      break;
+    default:
+      *val = 0xFFFF;
+  }
+  return PICOVM_IO_OK;
+}
+
+static enum picovm_io
+hash_out(void* ctx, uint8_t port, int width, uint16_t val)
+{
+  struct picovm* vm = ctx;
+  struct hash* hs = &vm->hash;
+  uint8_t data[2] = { val >> 8, val };
+
+  switch (port) {
+    case HASH_PORT_CTL:
+      hash_reset(hs, val & 1 ? HASH_MURMUR3 : HASH_CRC32C);
+      break;
+
+    case HASH_PORT_PTR:
+      hs->at = val;
+      break;
+
+    case HASH_PORT_LEN: {
+      // a block running past 64kb carries on from 0, like the block ops
+      const uint16_t first = RAMSIZE - hs->at < val ? RAMSIZE - hs->at : val;
+      hash_update(hs, &vm->ram[hs->at], first);
+      hash_update(hs, vm->ram, val - first);
+      hs->at += val;
+      vm->cycles += val / BLOCK_BYTES_PER_CYCLE;
+      break;
+    }
+
+    case HASH_PORT_DATA:
+      hash_update(hs, width == 1 ? &data[1] : data, width);
+      break;
+  }
+  return PICOVM_IO_OK;
+}
+
+extern void
+hash_attach(struct picovm* vm)
+{
+  vm->hash.crc32c = hash_crc32c_hw();
+  if (!vm->hash.crc32c)
+    vm->hash.crc32c = hash_crc32c_table;
+  hash_reset(&vm->hash, HASH_CRC32C);
+
+  for (int port = HASH_PORT_CTL; port <= HASH_PORT_HI; port++)
+    picovm_map_port(vm, port, hash_in, hash_out, vm);
+}
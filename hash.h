@@ -0,0 +1,65 @@
+#pragma once
+
+/* hash.h
+
+        checksum device
+        folds guest bytes into a CRC32C (sse4.2 crc32 when the host has it,
+        a table otherwise) or a 32 bit murmur3 hash, so integrity checks
+        over received frames are a port write instead of a guest loop.
+
+        SOUT to HASH_PORT_CTL resets the state and picks the algorithm.
+        SOUT to HASH_PORT_PTR sets where the next block starts, SOUT of a
+        length to HASH_PORT_LEN folds in that many bytes and moves the
+        pointer past them, so a buffer may be streamed in pieces. BOUT/SOUT
+        to HASH_PORT_DATA folds in a byte or a big endian short.
+        HASH_PORT_LO and HASH_PORT_HI read the digest of everything so far.
+        block updates cost a cycle per BLOCK_BYTES_PER_CYCLE bytes.
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define HASH_PORT_CTL 0xC4
+#define HASH_PORT_PTR 0xC5
+#define HASH_PORT_LEN 0xC6
+#define HASH_PORT_DATA 0xC7
+#define HASH_PORT_LO 0xC8
+#define HASH_PORT_HI 0xC9
+
+enum hash_algo
+{
+  HASH_CRC32C,
+  HASH_MURMUR3,
+};
+
+typedef uint32_t (*hash_crc_fn)(uint32_t crc, const uint8_t* p, size_t len);
+
+struct hash
+{
+  enum hash_algo algo;
+  // start of the next block update
+  uint16_t at;
+
+  // running crc, not yet inverted
+  uint32_t crc;
+
+  // murmur3 works on 4 byte words, a partial one waits in tail
+  uint32_t h, len;
+  uint8_t tail[4];
+
+  // the best crc32c the host has
+  hash_crc_fn crc32c;
+};
+
+struct picovm;
+
+extern uint32_t
+hash_crc32c_table(uint32_t crc, const uint8_t* p, size_t len);
+
+/// NULL when the host lacks sse4.2
+extern hash_crc_fn
+hash_crc32c_hw(void);
+
+/// maps the device's ports on `vm`
+extern void
+hash_attach(struct picovm* vm);
@@ -0,0 +1,153 @@
+/* hcall.c
+
+        hypercall device and its built-ins, see hcall.h
+*/
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "hcall.h"
+#include "picovm.h"
+#include "vm.h"
+
+/// whether the span an argument block points at stays clear of the wrap
+static bool
+span_ok(const uint16_t args[PICOVM_HCALL_ARGS])
+{
+  return (uint32_t)args[0] + args[1] <= RAMSIZE;
+}
+
+static uint16_t
+hcall_format(void* ctx, uint8_t* ram, const uint16_t args[PICOVM_HCALL_ARGS])
+{
+  static const char digits[] = "0123456789ABCDEF";
+  char buf[16];
+  uint16_t val = args[2];
+  int n = 0;
+  (void)ctx;
+
+  if (!span_ok(args) || args[3] < 2 || args[3] > 16)
+    return 0xFFFF;
+
+  do {
+    buf[n++] = digits[val % args[3]];
+    val /= args[3];
+  } while (val);
+
+  if (n > args[1])
+    return 0;
+
+  for (int i = 0; i < n; i++)
+    ram[args[0] + i] = buf[n - 1 - i];
+  return n;
+}
+
+static uint16_t
+hcall_hash(void* ctx, uint8_t* ram, const uint16_t args[PICOVM_HCALL_ARGS])
+{
+  uint32_t h = 2166136261u;
+  (void)ctx;
+
+  if (!span_ok(args))
+    return 0xFFFF;
+
+  for (unsigned i = 0; i < args[1]; i++)
+    h = (h ^ ram[args[0] + i]) * 16777619u;
+
+  return (uint16_t)(h >> 16) ^ (uint16_t)h;
+}
+
+static int
+cmp_short(const void* a, const void* b)
+{
+  const uint8_t *x = a, *y = b;
+  return ((x[0] << 8) | x[1]) - ((y[0] << 8) | y[1]);
+}
+
+static uint16_t
+hcall_sort(void* ctx, uint8_t* ram, const uint16_t args[PICOVM_HCALL_ARGS])
+{
+  (void)ctx;
+
+  if (!span_ok(args))
+    return 0xFFFF;
+
+  qsort(&ram[args[0]], args[1] / 2, 2, cmp_short);
+  return 0;
+}
+
+static const struct picovm_hcall builtins[] = {
+  [HCALL_FORMAT] = { .fn = hcall_format, .cycles = 20 },
+  [HCALL_HASH] = { .fn = hcall_hash, .cycles = 4, .bytes_per_cycle = 4 },
+  [HCALL_SORT] = { .fn = hcall_sort, .cycles = 16, .bytes_per_cycle = 1 },
+};
+
+static enum picovm_io
+hcall_in(void* ctx, uint8_t port, int width, uint16_t* val)
+{
+  struct picovm* vm = ctx;
+  (void)width;
+
+  *val = port == HCALL_PORT_CALL ? vm->hcall.result : vm->hcall.args_at;
+  return PICOVM_IO_OK;
+}
+
+static enum picovm_io
+hcall_out(void* ctx, uint8_t port, int width, uint16_t val)
+{
+  struct picovm* vm = ctx;
+  struct hcall* hc = &vm->hcall;
+  const struct picovm_hcall* call = &hc->table[val & 0xFF];
+  uint16_t args[PICOVM_HCALL_ARGS];
+  (void)width;
+
+  if (port == HCALL_PORT_ARGS) {
+    hc->args_at = val;
+    return PICOVM_IO_OK;
+  }
+
+  if (!call->fn) {
+    hc->result = 0xFFFF;
+    return PICOVM_IO_OK;
+  }
+
+  for (int i = 0; i < PICOVM_HCALL_ARGS; i++) {
+    const uint16_t at = hc->args_at + 2 * i;
+    args[i] = (uint16_t)(vm->ram[at] << 8) | vm->ram[(uint16_t)(at + 1)];
+  }
+
+  hc->result = call->fn(call->ctx, vm->ram, args);
+  vm->cycles += call->cycles;
+  if (call->bytes_per_cycle)
+    vm->cycles += args[1] / call->bytes_per_cycle;
+
+  return PICOVM_IO_OK;
+}
+
+extern void
+hcall_attach(struct picovm* vm)
+{
+  for (unsigned id = 0; id < sizeof(builtins) / sizeof(builtins[0]); id++)
+    if (builtins[id].fn)
+      picovm_register_hcall(vm, id, &builtins[id]);
+
+  picovm_map_port(vm, HCALL_PORT_ARGS, hcall_in, hcall_out, vm);
+  picovm_map_port(vm, HCALL_PORT_CALL, hcall_in, hcall_out, vm);
+}
+
+extern void
+picovm_register_hcall(struct picovm* vm,
+                      uint8_t id,
+                      const struct picovm_hcall* call)
+{
+  if (call)
+    vm->hcall.table[id] = *call;
+  else
+    vm->hcall.table[id] = (struct picovm_hcall){ 0 };
+}
+
+extern const struct picovm_hcall*
+picovm_hcall(struct picovm* vm, uint8_t id)
+{
+  return vm->hcall.table[id].fn ? &vm->hcall.table[id] : NULL;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+/* hcall.h
+
+        hypercall device
+        hands guest routines that would take thousands of interpreted
+        instructions, number formatting, hashing, sorting, to native code
+        that works on guest ram directly.
+
+        SOUT to HCALL_PORT_ARGS sets where the argument block is, four
+        big endian shorts: pointer, length in bytes, and two more that are
+        up to the call. SOUT of an id to HCALL_PORT_CALL runs the call
+        registered under it and charges its cost to the cycle count, SIN
+        from HCALL_PORT_CALL reads what the last call returned. unknown ids
+        and spans that wrap around at 64kb return 0xFFFF.
+
+        built-ins:
+          HCALL_FORMAT  arg2 as text in base arg3 (2..16) into the span,
+                        returns the number of digits, 0 if it does not fit
+          HCALL_HASH    32 bit fnv-1a of the span folded to 16 bits
+          HCALL_SORT    sorts the span as unsigned big endian shorts
+*/
+
+#include <stdint.h>
+
+#include "picovm.h"
+
+#define HCALL_PORT_ARGS 0xC0
+#define HCALL_PORT_CALL 0xC1
+
+enum hcall_id
+{
+  HCALL_FORMAT = 0x01,
+  HCALL_HASH = 0x02,
+  HCALL_SORT = 0x03,
+};
+
+struct hcall
+{
+  // address of the argument block
+  uint16_t args_at;
+  // returned by the last call
+  uint16_t result;
+
+  struct picovm_hcall table[PICOVM_NUM_HCALLS];
+};
+
+struct picovm;
+
+/// registers the built-ins and maps the device's ports on `vm`
+extern void
+hcall_attach(struct picovm* vm);
@@ -0,0 +1,142 @@
+#define _POSIX_C_SOURCE 200112L
+
+/* infile.c
+
+        maps an input file read only and hands it to the guest through a
+        cursor, see infile.h. nothing is read() past the mmap, the guest
+        pulls bytes as fast as it can process them, and block reads copy
+        straight out of the mapping into guest ram, costing a cycle per
+        BLOCK_BYTES_PER_CYCLE bytes like the block ops.
+        reads past the end give 0xFFFF and copy nothing.
+*/
+
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "infile.h"
+#include "picovm.h"
+#include "vm.h"
+
+struct infile
+{
+  struct picovm* vm;
+
+  const uint8_t* data;
+  size_t len, pos;
+
+  uint16_t ptr;
+  uint16_t copied;
+};
+
+static enum picovm_io
+infile_in(void* ctx, uint8_t port, int width, uint16_t* val)
+{
+  struct infile* in = ctx;
+  const size_t left = in->len - in->pos;
+
+  switch (port) {
+    case INFILE_PORT_DATA:
+      if (left < (size_t)width) {
+        *val = 0xFFFF;
+        break;
+      }
+      *val = width == 1 ? in->data[in->pos]
+                        : (uint16_t)(in->data[in->pos] << 8) |
+                            in->data[in->pos + 1];
+      in->pos += width;
+      break;
+
+    case INFILE_PORT_PTR:
+      *val = in->ptr;
+      break;
+
+    case INFILE_PORT_BLOCK:
+      *val = in->copied;
+      break;
+
+    case INFILE_PORT_LEFT:
+      *val = left < 0xFFFF ? left : 0xFFFF;
+      break;
+  }
+  return PICOVM_IO_OK;
+}
+
+static enum picovm_io
+infile_out(void* ctx, uint8_t port, int width, uint16_t val)
+{
+  struct infile* in = ctx;
+  struct picovm* vm = in->vm;
+  size_t n = in->len - in->pos;
+  (void)width;
+
+  if (port == INFILE_PORT_PTR) {
+    in->ptr = val;
+    return PICOVM_IO_OK;
+  }
+  if (port != INFILE_PORT_BLOCK)
+    return PICOVM_IO_OK;
+
+  // stop at the end of ram rather than wrap onto the interrupt vectors
+  if (n > val)
+    n = val;
+  if (n > (size_t)RAMSIZE - in->ptr)
+    n = RAMSIZE - in->ptr;
+
+  memcpy(&vm->ram[in->ptr], in->data + in->pos, n);
+  vm->idle.dirty = true;
+  vm->cycles += n / BLOCK_BYTES_PER_CYCLE;
+  in->pos += n;
+  in->copied = n;
+  return PICOVM_IO_OK;
+}
+
+extern struct infile*
+infile_init(struct picovm* vm, const char* path)
+{
+  struct stat st;
+  struct infile* in;
+  int fd = open(path, O_RDONLY);
+
+  if (fd < 0)
+    return NULL;
+
+  if (fstat(fd, &st) < 0 || !(in = calloc(1, sizeof(*in)))) {
+    close(fd);
+    return NULL;
+  }
+
+  in->vm = vm;
+  in->len = st.st_size;
+  if (in->len) {
+    void* map = mmap(NULL, in->len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+      close(fd);
+      free(in);
+      return NULL;
+    }
+    posix_madvise(map, in->len, POSIX_MADV_SEQUENTIAL);
+    in->data = map;
+  }
+  close(fd);
+
+  for (int port = INFILE_PORT_DATA; port <= INFILE_PORT_LEFT; port++)
+    picovm_map_port(vm, port, infile_in, infile_out, in);
+  return in;
+}
+
+extern void
+infile_close(struct infile* in)
+{
+  if (!in)
+    return;
+
+  if (in->data)
+    munmap((void*)in->data, in->len);
+  free(in);
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+/* infile.h
+
+        mmap backed input file device used by the cli
+*/
+
+
+// BIN/SIN take the next byte or big endian short at the cursor
+#define INFILE_PORT_DATA 0x02
+// SOUT sets where block reads land in guest ram
+#define INFILE_PORT_PTR 0x03
+// SOUT n copies up to n bytes to the pointer, SIN reads how many that was
+#define INFILE_PORT_BLOCK 0x04
+// SIN reads the bytes left, saturated at 0xFFFF, 0 at end of file
+#define INFILE_PORT_LEFT 0x05
+
+struct picovm;
+struct infile;
+
+/// maps `path` and its ports on `vm`, NULL if it could not be opened
+extern struct infile* infile_init(struct picovm* vm, const char* path);
+
+/// unmaps `in`, once `vm` no longer runs
+extern void infile_close(struct infile* in);
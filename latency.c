@@ -0,0 +1,165 @@
+/* latency.c
+
+        recording and reporting of interrupt delivery latency
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "latency.h"
+#include "picovm.h"
+#include "vm.h"
+
+static const char* const stage_names[LATENCY_NUM_STAGES] = {
+  [LATENCY_QUEUE] = "queue",
+  [LATENCY_DISPATCH] = "dispatch",
+  [LATENCY_TOTAL] = "total",
+};
+
+extern void
+latency_record(struct latency_hist* h, uint64_t ns)
+{
+  if (h->count == 0 || ns < h->min)
+    h->min = ns;
+  if (ns > h->max)
+    h->max = ns;
+
+  h->count += 1;
+  h->sum += ns;
+  h->buckets[latency_bucket(ns)] += 1;
+}
+
+// largest value that still lands in bucket `idx`
+static uint64_t
+bucket_upper(unsigned idx)
+{
+  if (idx < 2 * LATENCY_SUB)
+    return idx;
+
+  const unsigned shift = idx / LATENCY_SUB - 1;
+  const uint64_t mant = idx % LATENCY_SUB + LATENCY_SUB;
+  return (mant << shift) + ((uint64_t)1 << shift) - 1;
+}
+
+static uint64_t
+percentile(const struct latency_hist* h, double q)
+{
+  const uint64_t want = (uint64_t)(q * h->count + 0.5);
+  uint64_t seen = 0;
+
+  for (unsigned i = 0; i < LATENCY_BUCKETS; i++) {
+    seen += h->buckets[i];
+    if (seen >= want && seen)
+      return bucket_upper(i) < h->max ? bucket_upper(i) : h->max;
+  }
+
+  return h->max;
+}
+
+extern enum picovm_result
+picovm_latency_start(struct picovm* vm)
+{
+  picovm_latency_stop(vm);
+
+  vm->latency = calloc(1, sizeof(struct latency));
+  if (!vm->latency)
+    return PICOVM_ERR_NOMEM;
+
+  return PICOVM_OK;
+}
+
+extern void
+picovm_latency_stop(struct picovm* vm)
+{
+  free(vm->latency);
+  vm->latency = NULL;
+}
+
+extern void
+picovm_latency_write(const struct picovm* vm, FILE* out)
+{
+  static const double qs[] = { 0.5, 0.9, 0.99, 0.999 };
+
+  if (!vm->latency)
+    return;
+
+  fprintf(out,
+          "%-6s %-8s %10s %10s %10s %10s %10s %10s  (us)\n",
+          "source",
+          "stage",
+          "count",
+          "p50",
+          "p90",
+          "p99",
+          "p99.9",
+          "max");
+
+  for (int src = 0; src < PICOVM_NUM_INTERRUPTS; src++) {
+    for (int st = 0; st < LATENCY_NUM_STAGES; st++) {
+      const struct latency_hist* h = &vm->latency->hist[src][st];
+      if (!h->count)
+        continue;
+
+      fprintf(out,
+              "p%-5i %-8s %10lu",
+              src,
+              stage_names[st],
+              (unsigned long)h->count);
+      for (size_t i = 0; i < sizeof(qs) / sizeof(qs[0]); i++)
+        fprintf(out, " %10.1f", percentile(h, qs[i]) / 1e3);
+      fprintf(out, " %10.1f\n", h->max / 1e3);
+    }
+  }
+}
+
+extern void
+latency_write_prometheus(const struct latency* lat, FILE* out)
+{
+  const char* name = "picovm_interrupt_latency_seconds";
+
+  fprintf(out,
+          "# HELP %s device input to isr entry, per stage\n"
+          "# TYPE %s histogram\n",
+          name,
+          name);
+
+  for (int src = 0; src < PICOVM_NUM_INTERRUPTS; src++) {
+    for (int st = 0; st < LATENCY_NUM_STAGES; st++) {
+      const struct latency_hist* h = &lat->hist[src][st];
+      // scraped while the vm runs, count off the buckets so +Inf never
+      // ends up below the last bucket
+      uint64_t seen = 0;
+
+      for (unsigned i = 0; i < LATENCY_BUCKETS; i++) {
+        if (!h->buckets[i])
+          continue;
+        seen += h->buckets[i];
+        fprintf(out,
+                "%s_bucket{source=\"p%i\",stage=\"%s\",le=\"%.9f\"} %lu\n",
+                name,
+                src,
+                stage_names[st],
+                bucket_upper(i) / 1e9,
+                (unsigned long)seen);
+      }
+
+      fprintf(out,
+              "%s_bucket{source=\"p%i\",stage=\"%s\",le=\"+Inf\"} %lu\n"
+              "%s_sum{source=\"p%i\",stage=\"%s\"} %.9f\n"
+              "%s_count{source=\"p%i\",stage=\"%s\"} %lu\n",
+              name,
+              src,
+              stage_names[st],
+              (unsigned long)seen,
+              name,
+              src,
+              stage_names[st],
+              h->sum / 1e9,
+              name,
+              src,
+              stage_names[st],
+              (unsigned long)seen);
+    }
+  }
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+/* latency.h
+
+        interrupt delivery latency histograms
+        every interrupt source keeps one histogram per stage of the path
+        from a device seeing input to the guest isr running. histograms
+        are log-linear (hdr style): each power of two is split into
+        LATENCY_SUB buckets, so any value is within ~6% of its bucket,
+        from nanoseconds to centuries, in a fixed 8kb per histogram.
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "picovm.h"
+
+#define LATENCY_SUB_BITS 4
+#define LATENCY_SUB (1 << LATENCY_SUB_BITS)
+// values below 2 * LATENCY_SUB get a bucket each, then LATENCY_SUB per octave
+#define LATENCY_BUCKETS ((64 - LATENCY_SUB_BITS + 1) * LATENCY_SUB)
+
+enum latency_stage
+{
+  // device saw the input -> picovm_raise_interrupt_at
+  LATENCY_QUEUE,
+  // raised -> isr vector fetched by the interpreter
+  LATENCY_DISPATCH,
+  // device saw the input -> isr vector fetched
+  LATENCY_TOTAL,
+
+  LATENCY_NUM_STAGES,
+};
+
+struct latency_hist
+{
+  uint64_t count;
+  uint64_t sum;
+  uint64_t min, max;
+  uint64_t buckets[LATENCY_BUCKETS];
+};
+
+/// only ever written by the thread running the instance
+struct latency
+{
+  struct latency_hist hist[PICOVM_NUM_INTERRUPTS][LATENCY_NUM_STAGES];
+};
+
+__attribute__((always_inline)) static inline unsigned
+latency_bucket(uint64_t ns)
+{
+  if (ns < 2 * LATENCY_SUB)
+    return ns;
+
+  const unsigned shift = 63 - __builtin_clzll(ns) - LATENCY_SUB_BITS;
+  return (shift + 1) * LATENCY_SUB + (unsigned)(ns >> shift) - LATENCY_SUB;
+}
+
+extern void
+latency_record(struct latency_hist* h, uint64_t ns);
+
+/// cumulative prometheus histograms, only buckets that hold samples are listed
+extern void
+latency_write_prometheus(const struct latency* lat, FILE* out);
@@ -0,0 +1,74 @@
+#pragma once
+
+/* leb.h
+
+        the unsigned leb128 numbers every file format here is made of,
+        objects, sidecars, traces and replay logs, and the allocator the
+        assembler side reads them into
+*/
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "defs.h"
+
+static inline void
+put_leb(FILE* f, uint64_t v)
+{
+  while (v >= 0x80) {
+    putc((int)(v | 0x80) & 0xFF, f);
+    v >>= 7;
+  }
+  putc((int)v, f);
+}
+
+/// false at the end of `f` or on a number longer than 64 bits
+static inline bool
+get_leb64(FILE* f, uint64_t* out)
+{
+  uint64_t v = 0;
+  int c, shift = 0;
+
+  do {
+    if ((c = getc(f)) == EOF || shift > 63)
+      return false;
+    v |= (uint64_t)(c & 0x7F) << shift;
+    shift += 7;
+  } while (c & 0x80);
+
+  *out = v;
+  return true;
+}
+
+/// false at the end of `f` or on a number that does not fit 32 bits
+static inline bool
+get_leb(FILE* f, uint32_t* out)
+{
+  uint64_t v = 0;
+  int c, shift = 0;
+
+  do {
+    if ((c = getc(f)) == EOF || shift > 35)
+      return false;
+    v |= (uint64_t)(c & 0x7F) << shift;
+    shift += 7;
+  } while (c & 0x80);
+
+  if (v > UINT32_MAX)
+    return false;
+  *out = (uint32_t)v;
+  return true;
+}
+
+/// calloc that errors out instead of failing, never asks for 0 bytes
+static inline void*
+xcalloc(size_t n, size_t elem)
+{
+  void* p = calloc(n ? n : 1, elem);
+  if (!p)
+    ERR("out of memory\n");
+  return p;
+}
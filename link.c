@@ -0,0 +1,322 @@
+/* link.c
+
+        the linker, lays objects out into a rom image, see obj.h
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "defs.h"
+#include "leb.h"
+#include "obj.h"
+#include "symtab.h"
+
+#define MAX(x, y) (x > y ? x : y)
+
+struct symbol
+{
+  char* label;
+  uint16_t loc;
+  unsigned hash;
+};
+
+/// where an instruction ended up, file indexes sources
+struct line
+{
+  uint16_t loc;
+  uint32_t file, line, col;
+};
+
+/// where a section ended up
+struct placed
+{
+  uint32_t at, offset;
+};
+
+static bool quiet;
+
+// every label of the last link on this thread, for assemble_write_map
+static _Thread_local struct symbol* symbols;
+static _Thread_local int num_syms;
+
+// every instruction of it, and the sources of its objects
+static _Thread_local struct line* lines;
+static _Thread_local int num_lines;
+static _Thread_local char** sources;
+static _Thread_local int num_sources;
+
+// open addressed index into symbols, a slot holds index + 1, 0 if empty
+static _Thread_local int* sym_index;
+static _Thread_local unsigned sym_index_cap;
+
+// fnv-1a
+static unsigned
+hash_str(const char* str)
+{
+  unsigned h = 2166136261u;
+  while (*str)
+    h = (h ^ (uint8_t)*str++) * 16777619u;
+  return h;
+}
+
+/// the slot `label` lives in, or the empty one it would go in
+static int*
+sym_slot(const char* label, unsigned hash)
+{
+  unsigned i = hash & (sym_index_cap - 1);
+
+  for (; sym_index[i]; i = (i + 1) & (sym_index_cap - 1)) {
+    const struct symbol* sym = &symbols[sym_index[i] - 1];
+    if (sym->hash == hash && strcmp(sym->label, label) == 0)
+      break;
+  }
+
+  return &sym_index[i];
+}
+
+/// forgets the last link and makes room for `n` labels, `n_lines` lines
+/// and `n_sources` sources
+static void
+reset(size_t n, size_t n_lines, size_t n_sources)
+{
+  for (int i = 0; i < num_syms; i++)
+    free(symbols[i].label);
+  for (int i = 0; i < num_sources; i++)
+    free(sources[i]);
+  free(symbols);
+  free(sym_index);
+  free(lines);
+  free(sources);
+
+  symbols = xcalloc(n, sizeof(*symbols));
+  num_syms = 0;
+  lines = xcalloc(n_lines, sizeof(*lines));
+  num_lines = 0;
+  sources = xcalloc(n_sources, sizeof(*sources));
+  num_sources = 0;
+
+  // kept at most half full so probes stay short
+  for (sym_index_cap = 16; sym_index_cap < n * 2; sym_index_cap *= 2)
+    ;
+  sym_index = xcalloc(sym_index_cap, sizeof(int));
+}
+
+static void
+define(const char* label, uint16_t loc)
+{
+  const unsigned hash = hash_str(label);
+  int* slot = sym_slot(label, hash);
+  const size_t len = strlen(label);
+
+  if (*slot)
+    ERR("label <%s> defined twice\n", label);
+
+  symbols[num_syms] = (struct symbol){
+    .label = xcalloc(len + 1, 1),
+    .loc = loc,
+    .hash = hash,
+  };
+  memcpy(symbols[num_syms].label, label, len);
+  *slot = ++num_syms;
+}
+
+static const struct symbol*
+lookup(const char* label)
+{
+  const int* slot = sym_slot(label, hash_str(label));
+  return *slot ? &symbols[*slot - 1] : NULL;
+}
+
+/// places the sections of `o`, which starts where the module before it
+/// ended, and moves that on to where `o` ends
+static struct placed*
+place(const struct obj* o, uint32_t* idx, uint32_t* offset, uint8_t* image)
+{
+  struct placed* p = xcalloc(o->num_sections, sizeof(*p));
+  const uint32_t base = *idx, base_offset = *offset;
+
+  for (uint32_t i = 0; i < o->num_sections; i++) {
+    const struct obj_section* s = &o->sections[i];
+
+    p[i].at = s->flags & OBJ_SEC_FLOAT ? base + s->at : s->at;
+    p[i].offset = s->flags & OBJ_SEC_INHERIT_OFFSET ? base_offset : s->offset;
+
+    if ((uint64_t)p[i].at + s->len > ROMIMAGE_MAX)
+      ERR("output is larger than %li bytes\n", ROMIMAGE_MAX);
+    memcpy(&image[p[i].at], s->bytes, s->len);
+
+    *idx = p[i].at + s->len;
+    *offset = p[i].offset;
+  }
+
+  for (uint32_t i = 0; i < o->num_symbols; i++) {
+    const struct obj_ref* sym = &o->symbols[i];
+    const struct placed* in = &p[sym->section];
+    define(o->names[sym->name], in->at + sym->off + in->offset);
+  }
+
+  for (uint32_t i = 0; i < o->num_lines; i++) {
+    const struct obj_line* l = &o->lines[i];
+    const struct placed* in = &p[l->section];
+    lines[num_lines++] = (struct line){
+      .loc = in->at + l->off + in->offset,
+      .file = num_sources,
+      .line = l->line,
+      .col = l->col,
+    };
+  }
+
+  sources[num_sources] = xcalloc(o->source ? strlen(o->source) + 1 : 1, 1);
+  if (o->source)
+    strcpy(sources[num_sources], o->source);
+  num_sources += 1;
+
+  return p;
+}
+
+static void
+relocate(const struct obj* o, const struct placed* p, uint8_t* image)
+{
+  for (uint32_t i = 0; i < o->num_relocs; i++) {
+    const struct obj_ref* r = &o->relocs[i];
+    const struct symbol* sym = lookup(o->names[r->name]);
+    const uint32_t at = p[r->section].at + r->off;
+    uint16_t loc;
+
+    if (!sym)
+      ERR("failed to find symbol <%s>\n", o->names[r->name]);
+
+    // the short holds what to add to the label, "[%r0 + table + 2]"
+    loc = sym->loc + (image[at] << 8 | image[at + 1]);
+    if (!quiet)
+      printf("linking... @%04Xh -> <%s> = @%04Xh\n", at, sym->label, loc);
+
+    image[at] = (uint8_t)(loc >> 8);
+    image[at + 1] = (uint8_t)(loc);
+  }
+}
+
+extern char*
+link_objects(struct obj* const* objs, int n, size_t* outlen)
+{
+  struct placed** placed = xcalloc(n, sizeof(*placed));
+  uint8_t* image = xcalloc(ROMIMAGE_MAX, 1);
+  uint32_t idx = 0, offset = 0;
+  size_t total = 0, total_lines = 0, len = 0;
+
+  for (int i = 0; i < n; i++) {
+    total += objs[i]->num_symbols;
+    total_lines += objs[i]->num_lines;
+  }
+  reset(total, total_lines, n);
+
+  // every label has to be known before the first relocation
+  for (int i = 0; i < n; i++) {
+    placed[i] = place(objs[i], &idx, &offset, image);
+    for (uint32_t s = 0; s < objs[i]->num_sections; s++)
+      len = MAX(len, placed[i][s].at + objs[i]->sections[s].len);
+  }
+
+  for (int i = 0; i < n; i++) {
+    relocate(objs[i], placed[i], image);
+    free(placed[i]);
+  }
+  free(placed);
+
+  *outlen = len;
+  return realloc(image, MAX(len, (size_t)1));
+}
+
+extern void
+link_release(void)
+{
+  reset(0, 0, 0);
+  free(symbols);
+  free(sym_index);
+  free(lines);
+  free(sources);
+
+  symbols = NULL;
+  sym_index = NULL;
+  lines = NULL;
+  sources = NULL;
+  sym_index_cap = 0;
+}
+
+extern void
+link_quiet(bool q)
+{
+  quiet = q;
+}
+
+extern void
+assemble_write_map(FILE* out)
+{
+  for (int i = 0; i < num_syms; i++)
+    fprintf(out, "%04X %s\n", symbols[i].loc, symbols[i].label);
+}
+
+// by address, then in the order they were defined
+static int
+symbol_cmp(const void* left, const void* right)
+{
+  const struct symbol* l = *(const struct symbol* const*)left;
+  const struct symbol* r = *(const struct symbol* const*)right;
+  if (l->loc != r->loc)
+    return (int)l->loc - (int)r->loc;
+  return l < r ? -1 : l > r;
+}
+
+static int
+line_cmp(const void* left, const void* right)
+{
+  const struct line* l = *(const struct line* const*)left;
+  const struct line* r = *(const struct line* const*)right;
+  if (l->loc != r->loc)
+    return (int)l->loc - (int)r->loc;
+  return l < r ? -1 : l > r;
+}
+
+extern bool
+assemble_write_symbols(FILE* out)
+{
+  const struct symbol** syms = xcalloc(num_syms, sizeof(*syms));
+  const struct line** by_loc = xcalloc(num_lines, sizeof(*by_loc));
+  uint16_t last = 0;
+
+  for (int i = 0; i < num_syms; i++)
+    syms[i] = &symbols[i];
+  for (int i = 0; i < num_lines; i++)
+    by_loc[i] = &lines[i];
+  qsort(syms, num_syms, sizeof(*syms), symbol_cmp);
+  qsort(by_loc, num_lines, sizeof(*by_loc), line_cmp);
+
+  fwrite(SYMTAB_MAGIC, 1, 4, out);
+  putc(SYMTAB_VERSION, out);
+
+  put_leb(out, num_sources);
+  for (int i = 0; i < num_sources; i++) {
+    put_leb(out, strlen(sources[i]));
+    fwrite(sources[i], 1, strlen(sources[i]), out);
+  }
+
+  put_leb(out, num_syms);
+  for (int i = 0; i < num_syms; i++) {
+    put_leb(out, syms[i]->loc);
+    put_leb(out, strlen(syms[i]->label));
+    fwrite(syms[i]->label, 1, strlen(syms[i]->label), out);
+  }
+
+  put_leb(out, num_lines);
+  for (int i = 0; i < num_lines; i++) {
+    put_leb(out, by_loc[i]->loc - last);
+    put_leb(out, by_loc[i]->file);
+    put_leb(out, by_loc[i]->line);
+    put_leb(out, by_loc[i]->col);
+    last = by_loc[i]->loc;
+  }
+
+  free(syms);
+  free(by_loc);
+  return !ferror(out);
+}
@@ -3,8 +3,10 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <inttypes.h>
 #include <libgen.h>
 #include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -13,15 +15,33 @@
 #include <unistd.h>
 
 #include "config.h"
+#include "console.h"
 #include "defs.h"
+#include "infile.h"
+#include "mmu.h"
+#include "obj.h"
+#include "opt.h"
+#include "parallel.h"
+#include "picovm.h"
+#include "trace.h"
 
 struct vm_config vm_config = {
   .input_filename = NULL,
   .output_filename = NULL,
   .dump_registers = false,
   .dump_memory = false,
-  .show_steps = false,
+  .trace_filename = "./vm.trace",
+  .show_steps = 0,
+  .idle_park = true,
   .step_sleep = 0,
+  .banks = 0,
+  .console_window = -1,
+  .data_filename = NULL,
+  .jobs = 1,
+  .profile_period = 0,
+  .latency = false,
+  .record_filename = NULL,
+  .replay_filename = NULL,
 };
 
 enum runtype
@@ -29,6 +49,8 @@ enum runtype
   RUN_HELP,
   RUN_VM,
   RUN_ASM,
+  RUN_LINK,
+  RUN_TRACE,
 };
 
 struct argument_help
@@ -41,69 +63,566 @@ struct argument_help help_args[] = {
   { .c = 'h', "print this help" },
   { .c = 'a', "run picovm in assembler mode" },
   { .c = 'v', "run picovm in vm mode" },
+  { .c = 'q', "when running in asm mode, do not print labels and relocations" },
+  { .c = 'c', "when running in asm mode, write an object instead of a rom" },
+  { .c = 'O',
+    "when running in asm mode, run the peephole optimizer and report what it "
+    "saved" },
+  { .c = 'C',
+    "when running in asm mode, keep objects of the sources in this directory "
+    "and only assemble the ones that changed" },
+  { .c = 'l', "link the objects given after the options into a rom" },
+  { .c = 'e',
+    "when running in asm mode, assemble every source into a rom of its own "
+    "instead of linking them" },
+  { .c = 'j',
+    "when running in asm mode, assemble 'n' sources at a time on threads, "
+    "implies -q" },
+  { .c = 'T', "decode a binary trace (-f) into text" },
   { .c = 'f', "specify an input filepath" },
   { .c = 'o', "specify an output filepath" },
   { .c = 's', "when running in vm mode, 'n' number of millis between steps" },
-  { .c = 'S', "when running in vm mode, display current IP and op per step" },
+  { .c = 'S',
+    "when running in vm mode, trace IP and op per step (-SS adds registers)" },
+  { .c = 't', "when running in vm mode, trace filepath (default ./vm.trace)" },
   { .c = 'd', "when running in vm mode, dump registers" },
   { .c = 'D', "when running in vm mode, dump memory to outfile/generic" },
   { .c = 'p',
-    "when running in vm mode, open a parrallel port over a TCP port" },
+    "when running in vm mode, open a parrallel port over a unix socket" },
+  { .c = 'I', "when running in vm mode, never park on idle loops" },
+  { .c = 'P',
+    "when running in vm mode, sample every 'n' cycles into ./vm.prof and "
+    "./vm.folded" },
+  { .c = 'm',
+    "label map filepath, written in asm mode, used by -P and -T in vm mode "
+    "instead of the sidecar next to the rom" },
+  { .c = 'M',
+    "when running in vm mode, serve counters over a unix socket" },
+  { .c = 'b',
+    "when running in vm mode, back the bank switching mmu with 'n' 16kb "
+    "banks" },
+  { .c = 'w',
+    "when running in vm mode, map the buffered console onto page 'n', "
+    "at n * 256" },
+  { .c = 'i',
+    "when running in vm mode, map a file for the guest to read on ports 2-5" },
+  { .c = 'L',
+    "when running in vm mode, histogram interrupt latency, printed at halt" },
+  { .c = 'r',
+    "when running in vm mode, record port reads and interrupts into a file" },
+  { .c = 'R',
+    "when running in vm mode, replay a recording at full speed" },
 };
 
 static void
 print_help(void)
 {
   printf("usage: picovm [-av] -f input [-o output]\n");
+  printf("       picovm -a [-ce] [-j n] [-C cachedir] [-o output] "
+         "input.psm...\n");
+  printf("       picovm -l [-o output] input.o...\n");
   for (size_t i = 0; i < sizeof(help_args) / sizeof(struct argument_help);
        i++) {
     printf("(-%c) %s\n", help_args[i].c, help_args[i].def);
   }
 }
 
+/// the whole of `path`, nul terminated
+static char*
+read_file(const char* path, size_t* len)
+{
+  FILE* file = fopen(path, "r");
+  char* data;
+
+  if (!file)
+    ERR("failed to open infile \"%s\"\n", path);
+
+  fseek(file, 0, SEEK_END);
+  *len = ftell(file);
+  rewind(file);
+
+  data = malloc(*len + 1);
+  data[*len] = 0;
+  if (fread(data, 1, *len, file) != *len)
+    ERR("failed to read input file \"%s\"\n", path);
+
+  fclose(file);
+  return data;
+}
+
+/// -o, or `input` renamed to ./name`ext`
+static char*
+output_name(const char* input, const char* ext)
+{
+  char *input_copy, *buf, *outname, *dot;
+
+  if (vm_config.output_filename)
+    return strcpy(malloc(strlen(vm_config.output_filename) + 1),
+                  vm_config.output_filename);
+
+  input_copy = malloc(strlen(input) + 1);
+  strcpy(input_copy, input);
+  buf = basename(input_copy);
+  if ((dot = strrchr(buf, '.')))
+    *dot = 0;
+  outname = malloc(strlen(buf) + strlen(ext) + 3);
+  sprintf(outname, "./%s%s", buf, ext);
+  free(input_copy);
+  return outname;
+}
+
+/// `rom` with its extension swapped for the one of its symbol sidecar
+static char*
+sidecar_name(const char* rom)
+{
+  char* name = malloc(strlen(rom) + sizeof(".dbg"));
+  char *dot, *slash;
+
+  strcpy(name, rom);
+  dot = strrchr(name, '.');
+  slash = strrchr(name, '/');
+  if (dot && (!slash || dot > slash))
+    *dot = 0;
+  return strcat(name, ".dbg");
+}
+
 static void
-run_assembler(void)
+write_rom(const char* input, const char* data, size_t len)
 {
-  FILE *infile, *outfile;
-  size_t infilelen, asmlen;
-  char *filedata, *input_copy, *outname, *asmdata;
+  char* outname = output_name(input, ".rom");
+  char* symname = sidecar_name(outname);
+  FILE* outfile = fopen(outname, "w");
 
-  if (!vm_config.output_filename) {
-    input_copy = malloc(strlen(vm_config.input_filename) + 1);
-    strcpy(input_copy, vm_config.input_filename);
-    char* buf = basename(input_copy);
-    outname = malloc(strlen(buf) + 6);
-    strrchr(buf, '.')[0] = 0;
-    sprintf(outname, "./%s.rom", buf);
-    free(input_copy);
-  } else
-    outname = (char*)vm_config.output_filename;
+  if (!outfile)
+    ERR("failed to open outfile \"%s\"\n", outname);
+  fwrite(data, 1, len, outfile);
+  fclose(outfile);
 
-  infile = fopen(vm_config.input_filename, "r");
+  if (!(outfile = fopen(symname, "wb")))
+    ERR("failed to open symbol file \"%s\"\n", symname);
+  if (!assemble_write_symbols(outfile) || fclose(outfile) != 0)
+    ERR("failed to write symbol file \"%s\"\n", symname);
+
+  free(outname);
+  free(symname);
+
+  if (vm_config.label_map_filename) {
+    FILE* mapfile = fopen(vm_config.label_map_filename, "w");
+    if (!mapfile)
+      ERR("failed to open label map file \"%s\"\n",
+          vm_config.label_map_filename);
+    assemble_write_map(mapfile);
+    fclose(mapfile);
+  }
+}
 
-  if (!infile)
-    ERR("failed to open infile \n");
+static void
+write_object(const char* path, const struct obj* o)
+{
+  FILE* file = fopen(path, "wb");
+
+  if (!file)
+    ERR("failed to open object file \"%s\"\n", path);
+  if (!obj_write(o, file) || fclose(file) != 0)
+    ERR("failed to write object file \"%s\"\n", path);
+}
 
-  fseek(infile, 0, SEEK_END);
-  infilelen = ftell(infile);
-  rewind(infile);
+/// the object of the source at `path`, out of the cache (-C) if it has
+/// one of the same text, assembled and put there otherwise
+static struct obj*
+source_object(const char* path)
+{
+  size_t len;
+  char *src = read_file(path, &len), *cached = NULL;
+  struct obj* o = NULL;
+
+  if (vm_config.object_cache) {
+    FILE* file;
+
+    cached = malloc(strlen(vm_config.object_cache) + 32);
+    sprintf(cached,
+            "%s/%016" PRIx64 ".o",
+            vm_config.object_cache,
+            obj_source_hash(src, len, vm_config.optimize));
+
+    if ((file = fopen(cached, "rb"))) {
+      o = obj_read(file);
+      fclose(file);
+    }
 
-  filedata = malloc(infilelen + 1);
-  filedata[infilelen] = 0;
-  if (fread(filedata, 1, infilelen, infile) != infilelen) {
-    ERR("failed to read input file\n");
+    // counted like the run that assembled it
+    if (o && o->report)
+      assemble_add_report(o->report);
   }
 
-  asmdata = assemble(filedata, &asmlen);
+  if (!o) {
+    o = assemble_object(src);
+
+    // written aside and renamed, a reader never sees half an object. the
+    // name is unique to this process and source, other builds and other
+    // sources with the same text may be writing the same object right now
+    if (cached) {
+      char* tmp = malloc(strlen(cached) + 48);
+      sprintf(tmp, "%s.%ld.%p.tmp", cached, (long)getpid(), (void*)o);
+      write_object(tmp, o);
+      if (rename(tmp, cached) != 0)
+        ERR("failed to move object into \"%s\"\n", cached);
+      free(tmp);
+    }
+  }
 
-  outfile = fopen(outname, "w");
-  if (!outfile)
-    ERR("failed to open outfile \n");
-  fwrite(asmdata, 1, asmlen, outfile);
+  // a cached object may be from a copy of the source somewhere else
+  free(o->source);
+  o->source = strcpy(malloc(strlen(path) + 1), path);
 
-  free(filedata);
-  fclose(infile);
-  fclose(outfile);
+  free(cached);
+  free(src);
+  return o;
+}
+
+/// -f followed by the `argc` arguments left after the options
+static char**
+input_files(int argc, char** argv, int* num_files)
+{
+  char** files = malloc((argc + 1) * sizeof(*files));
+
+  *num_files = 0;
+  if (vm_config.input_filename)
+    files[(*num_files)++] = (char*)vm_config.input_filename;
+  for (int i = 0; i < argc; i++)
+    files[(*num_files)++] = argv[i];
+  return files;
+}
+
+/// sources handed out to the assembler threads, one at a time in order
+struct asm_pool
+{
+  char** files;
+  int num_files;
+  // one per source when they are linked into one rom, NULL otherwise
+  struct obj** objs;
+
+  pthread_mutex_t lock;
+  int next;
+};
+
+static void
+assemble_one(struct asm_pool* pool, int i)
+{
+  struct obj* o = source_object(pool->files[i]);
+  char* out;
+  size_t len;
+
+  if (pool->objs) {
+    pool->objs[i] = o;
+    return;
+  }
+
+  if (vm_config.object_only) {
+    out = output_name(pool->files[i], ".o");
+    write_object(out, o);
+  } else {
+    out = link_objects(&o, 1, &len);
+    write_rom(pool->files[i], out, len);
+  }
+
+  free(out);
+  obj_free(o);
+}
+
+static void*
+assemble_worker(void* arg)
+{
+  struct asm_pool* pool = arg;
+
+  for (;;) {
+    pthread_mutex_lock(&pool->lock);
+    const int i = pool->next++;
+    pthread_mutex_unlock(&pool->lock);
+
+    if (i >= pool->num_files)
+      break;
+    assemble_one(pool, i);
+  }
+
+  assemble_release();
+  return NULL;
+}
+
+/// assembles `files` on up to -j threads. with -c or -e every source gets
+/// an output of its own, otherwise they are linked into one rom in order
+static void
+run_assembler(char** files, int num_files)
+{
+  struct asm_pool pool = {
+    .files = files,
+    .num_files = num_files,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+  };
+  const int jobs = vm_config.jobs < num_files ? vm_config.jobs : num_files;
+  const bool each = vm_config.object_only || vm_config.rom_per_source;
+  pthread_t* threads = malloc(jobs * sizeof(*threads));
+
+  if (num_files == 0)
+    ERR("no input file (-f)\n");
+  if (each && num_files > 1 && vm_config.output_filename)
+    ERR("-o names one output, -c and -e write one per source\n");
+  if (each && num_files > 1 && vm_config.label_map_filename)
+    ERR("-m names one label map, -c and -e write one rom per source\n");
+
+  // the label logs of sources assembled side by side would interleave
+  if (jobs > 1)
+    assemble_quiet(true);
+
+  if (!each)
+    pool.objs = malloc(num_files * sizeof(*pool.objs));
+
+  // this thread is one of the workers
+  for (int i = 1; i < jobs; i++)
+    if (pthread_create(&threads[i], NULL, assemble_worker, &pool) != 0)
+      ERR("failed to start an assembler thread\n");
+  assemble_worker(&pool);
+  for (int i = 1; i < jobs; i++)
+    pthread_join(threads[i], NULL);
+  free(threads);
+
+  if (pool.objs) {
+    size_t len;
+    char* rom = link_objects(pool.objs, num_files, &len);
+    write_rom(files[0], rom, len);
+
+    for (int i = 0; i < num_files; i++)
+      obj_free(pool.objs[i]);
+    free(pool.objs);
+    free(rom);
+  }
+
+  if (vm_config.optimize) {
+    struct opt_report r;
+    assemble_get_report(&r);
+    printf("peephole: %u jumps threaded, %u jumps to the next instruction, "
+           "%u moves and %u tests dropped, %u shorter encodings, "
+           "%u short branches, %li bytes and ~%li cycles saved\n",
+           r.threaded,
+           r.jumps,
+           r.moves,
+           r.tests,
+           r.shortened,
+           r.relaxed,
+           r.bytes,
+           r.cycles);
+  }
+}
+
+static void
+run_linker(char** files, int num_files)
+{
+  struct obj** objs;
+  size_t len;
+  char* rom;
+
+  if (num_files == 0)
+    ERR("no objects to link\n");
+
+  objs = malloc(num_files * sizeof(*objs));
+  for (int i = 0; i < num_files; i++) {
+    FILE* file = fopen(files[i], "rb");
+    if (!file)
+      ERR("failed to open object file \"%s\"\n", files[i]);
+    if (!(objs[i] = obj_read(file)))
+      ERR("\"%s\" is not a picovm object\n", files[i]);
+    fclose(file);
+  }
+
+  rom = link_objects(objs, num_files, &len);
+  write_rom(files[0], rom, len);
+
+  for (int i = 0; i < num_files; i++)
+    obj_free(objs[i]);
+  free(objs);
+  free(rom);
+}
+
+// the instance run_vm is driving, so SIGINT can stop it
+static struct picovm* running_vm;
+
+/// -m, or else the sidecar next to the rom if there is one. NULL if there
+/// is neither, loaded the first time something wants a name
+static struct picovm_symtab*
+vm_symbols(void)
+{
+  static struct picovm_symtab* syms;
+  static bool loaded;
+  char* path;
+
+  if (loaded)
+    return syms;
+  loaded = true;
+
+  if (vm_config.label_map_filename) {
+    if (!(syms = picovm_symtab_load(vm_config.label_map_filename)))
+      ERR("failed to load label map \"%s\"\n",
+          vm_config.label_map_filename);
+  } else if (vm_config.input_filename) {
+    path = sidecar_name(vm_config.input_filename);
+    syms = picovm_symtab_load(path);
+    free(path);
+  }
+
+  return syms;
+}
+
+static void
+signal_handler(int sig)
+{
+  (void)sig;
+  if (running_vm)
+    picovm_halt(running_vm);
+}
+
+static void
+dump_registers(struct picovm* vm)
+{
+  uint16_t val;
+
+  for (int i = 0; i < PICOVM_NUM_REGS; i++) {
+    picovm_get_reg(vm, i, &val);
+    printf("\x1b[32;49m%s\x1b[39;49m = \x1b[33;49m%04Xh\x1b[39;49m ",
+           picovm_reg_name(i),
+           val);
+    if (i % 4 == 3)
+      printf("\n");
+  }
+}
+
+static void
+run_with_rom(const uint8_t* in, size_t len)
+{
+  struct picovm_options opts;
+  struct picovm* vm;
+  struct infile* infile = NULL;
+  struct console_window* window = NULL;
+  enum picovm_result res;
+  unsigned long parks;
+  uint64_t parked_ns;
+
+  picovm_default_options(&opts);
+  opts.step_sleep = vm_config.step_sleep;
+  opts.idle_park = vm_config.idle_park;
+  opts.banks = vm_config.banks;
+
+  vm = picovm_create(&opts);
+  if (!vm)
+    ERR("failed to create vm instance\n");
+
+  res = picovm_load_rom(vm, in, len);
+  if (res != PICOVM_OK)
+    ERR("failed to load rom: %s | must be <= %lu bytes\n",
+        picovm_strerror(res),
+        ROMLEN + (vm_config.banks > MMU_WINDOWS
+                    ? (vm_config.banks - MMU_WINDOWS) * MMU_BANK_SIZE
+                    : 0));
+
+  running_vm = vm;
+  signal(SIGINT, signal_handler);
+
+  int stdin_fl = fcntl(STDIN_FILENO, F_GETFL);
+  fcntl(STDIN_FILENO, F_SETFL, stdin_fl | O_NONBLOCK);
+
+  console_init(vm);
+  if (vm_config.console_window >= 0 &&
+      !(window = console_map_window(vm, vm_config.console_window)))
+    ERR("console window must be below the rom, page < %i\n",
+        ROMLOC / PICOVM_PAGE_SIZE);
+  if (vm_config.data_filename) {
+    // block reads land in ram without going through the log
+    if (vm_config.record_filename || vm_config.replay_filename)
+      ERR("an input file can not be recorded or replayed\n");
+    if (!(infile = infile_init(vm, vm_config.data_filename)))
+      ERR("failed to map input file \"%s\"\n", vm_config.data_filename);
+  }
+  parallel_init(vm);
+
+  if (vm_config.record_filename &&
+      picovm_record_start(vm, vm_config.record_filename) != PICOVM_OK)
+    ERR("failed to open recording \"%s\"\n", vm_config.record_filename);
+
+  if (vm_config.replay_filename &&
+      picovm_replay_start(vm, vm_config.replay_filename) != PICOVM_OK)
+    ERR("failed to open replay log \"%s\"\n", vm_config.replay_filename);
+
+  if (vm_config.stats_loc &&
+      picovm_stats_listen(vm, vm_config.stats_loc) != PICOVM_OK)
+    ERR("failed to open stats socket at %s\n", vm_config.stats_loc);
+
+  if (vm_config.latency && picovm_latency_start(vm) != PICOVM_OK)
+    ERR("failed to start latency histograms\n");
+
+  if (vm_config.profile_period &&
+      picovm_profile_start(vm, vm_config.profile_period) != PICOVM_OK)
+    ERR("failed to start the profiler\n");
+
+  if (vm_config.show_steps) {
+    res = picovm_trace_start(
+      vm, vm_config.trace_filename, vm_config.show_steps > 1);
+    if (res != PICOVM_OK)
+      ERR("failed to open trace file \"%s\"\n", vm_config.trace_filename);
+  }
+
+  res = picovm_run_for(vm, PICOVM_RUN_FOREVER);
+  if (res != PICOVM_HALTED) {
+    char where[256];
+
+    if (picovm_symtab_describe(
+          vm_symbols(), picovm_get_ip(vm), where, sizeof(where)))
+      ERR("vm faulted @%04Xh (%s): %s\n",
+          picovm_get_ip(vm),
+          where,
+          picovm_strerror(res));
+    ERR("vm faulted @%04Xh: %s\n", picovm_get_ip(vm), picovm_strerror(res));
+  }
+
+  printf("\nvm halted\n");
+
+  picovm_idle_time(vm, &parks, &parked_ns);
+  if (parks)
+    printf("idle: parked %lu times, %lu.%03lus of spinning saved\n",
+           parks,
+           (unsigned long)(parked_ns / 1000000000),
+           (unsigned long)(parked_ns / 1000000 % 1000));
+
+  if (vm_config.latency)
+    picovm_latency_write(vm, stdout);
+
+  if (vm_config.profile_period) {
+    if (picovm_profile_write(vm, vm_symbols(), "./vm.prof", "./vm.folded") !=
+        PICOVM_OK)
+      ERR("failed to write profile\n");
+    printf("profile written to: ./vm.prof, ./vm.folded\n");
+  }
+
+  if (vm_config.dump_registers) {
+    dump_registers(vm);
+    picovm_write_stats(vm, stdout);
+  }
+
+  if (vm_config.dump_memory) {
+    const char* outfile = vm_config.output_filename;
+    if (!outfile)
+      outfile = "./vm.dump";
+    printf("memory contents dumped to: %s\n", outfile);
+    FILE* dumpfile = fopen(outfile, "w");
+    if (!dumpfile)
+      ERR("failed to open dumpfile for writing\n");
+    fwrite(picovm_memory(vm), 1, RAMSIZE, dumpfile);
+    fclose(dumpfile);
+  }
+
+  running_vm = NULL;
+  // also flushes the trace and any recording
+  picovm_destroy(vm);
+  infile_close(infile);
+  console_free_window(window);
 }
 
 static void
@@ -136,14 +655,36 @@ run_vm(void)
   free(filedata);
 }
 
+static void
+run_trace_decoder(void)
+{
+  FILE* file;
+
+  if (!vm_config.input_filename)
+    ERR("decoding a trace needs an input file (-f)\n");
+
+  file = fopen(vm_config.input_filename, "rb");
+  if (!file)
+    ERR("failed to open trace file \"%s\"\n", vm_config.input_filename);
+
+  if (!trace_decode(file, stdout, vm_symbols()))
+    ERR("\"%s\" is not a picovm trace\n", vm_config.input_filename);
+
+  fclose(file);
+}
+
 extern int
 main(int argc, char** argv)
 {
   enum runtype type = RUN_HELP;
   char b;
+  char** files;
   int tmp;
 
-  while ((b = getopt(argc, argv, "+avhf:o:s:dDSp:")) != -1) {
+  while ((b = getopt(argc,
+                     argv,
+                     "+avqhTcOC:lej:f:o:s:dDSt:p:IP:m:M:"
+                     "Lr:R:b:w:i:")) != -1) {
     switch (b) {
       case 'h':
         type = RUN_HELP;
@@ -157,6 +698,43 @@ main(int argc, char** argv)
         type = RUN_VM;
         break;
 
+      case 'q':
+        assemble_quiet(true);
+        break;
+
+      case 'T':
+        type = RUN_TRACE;
+        break;
+
+      case 'c':
+        vm_config.object_only = true;
+        break;
+
+      case 'C':
+        vm_config.object_cache = optarg;
+        break;
+
+      case 'O':
+        vm_config.optimize = true;
+        assemble_optimize(true);
+        break;
+
+      case 'l':
+        type = RUN_LINK;
+        break;
+
+      case 'e':
+        vm_config.rom_per_source = true;
+        break;
+
+      case 'j':
+        errno = 0;
+        tmp = strtol(optarg, NULL, 10);
+        if (errno != 0 || tmp < 1)
+          ERR("expected a number of threads as an argument to 'j'\n");
+        vm_config.jobs = tmp;
+        break;
+
       case 'f':
         vm_config.input_filename = optarg;
         break;
@@ -166,11 +744,7 @@ main(int argc, char** argv)
         break;
 
       case 'p':
-        errno = 0;
-        tmp = strtol(optarg, NULL, 10);
-        if (errno != 0)
-          ERR("expected a number as an argument to 'p'\n");
-        vm_config.parallel_port = tmp;
+        vm_config.parallel_loc = optarg;
         break;
 
       case 'd':
@@ -190,7 +764,63 @@ main(int argc, char** argv)
         break;
 
       case 'S':
-        vm_config.show_steps = true;
+        vm_config.show_steps += 1;
+        break;
+
+      case 't':
+        vm_config.trace_filename = optarg;
+        break;
+
+      case 'I':
+        vm_config.idle_park = false;
+        break;
+
+      case 'P':
+        errno = 0;
+        vm_config.profile_period = strtol(optarg, NULL, 10);
+        if (errno != 0 || vm_config.profile_period < 0)
+          ERR("expected a positive number as an argument to 'P'\n");
+        break;
+
+      case 'm':
+        vm_config.label_map_filename = optarg;
+        break;
+
+      case 'M':
+        vm_config.stats_loc = optarg;
+        break;
+
+      case 'L':
+        vm_config.latency = true;
+        break;
+
+      case 'b':
+        errno = 0;
+        tmp = strtol(optarg, NULL, 10);
+        if (errno != 0 || tmp < 0)
+          ERR("expected a positive number as an argument to 'b'\n");
+        vm_config.banks = tmp;
+        break;
+
+      case 'w':
+        errno = 0;
+        tmp = strtol(optarg, NULL, 0);
+        if (errno != 0 || tmp < 0 || tmp >= PICOVM_NUM_PAGES)
+          ERR("expected a page number below %i as an argument to 'w'\n",
+              PICOVM_NUM_PAGES);
+        vm_config.console_window = tmp;
+        break;
+
+      case 'r':
+        vm_config.record_filename = optarg;
+        break;
+
+      case 'R':
+        vm_config.replay_filename = optarg;
+        break;
+
+      case 'i':
+        vm_config.data_filename = optarg;
         break;
 
       case '?':
@@ -209,11 +839,21 @@ main(int argc, char** argv)
       return 0;
 
     case RUN_ASM:
-      run_assembler();
+    case RUN_LINK:
+      files = input_files(argc - optind, &argv[optind], &tmp);
+      if (type == RUN_ASM)
+        run_assembler(files, tmp);
+      else
+        run_linker(files, tmp);
+      free(files);
       return 0;
 
     case RUN_VM:
       run_vm();
       return 0;
+
+    case RUN_TRACE:
+      run_trace_decoder();
+      return 0;
   }
 }
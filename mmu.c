@@ -0,0 +1,110 @@
+/* mmu.c
+
+        bank switching device, see mmu.h
+*/
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mmu.h"
+#include "picovm.h"
+#include "vm.h"
+
+extern struct mmu*
+mmu_new(unsigned num_banks)
+{
+  struct mmu* mmu;
+
+  if (num_banks < MMU_WINDOWS)
+    num_banks = MMU_WINDOWS;
+  if (num_banks > UINT16_MAX)
+    return NULL;
+
+  mmu = calloc(1, sizeof(struct mmu));
+  if (!mmu)
+    return NULL;
+
+  mmu->num_banks = num_banks;
+  mmu->banks = calloc(num_banks, MMU_BANK_SIZE);
+  if (!mmu->banks) {
+    free(mmu);
+    return NULL;
+  }
+
+  for (int w = 0; w < MMU_WINDOWS; w++)
+    mmu->mapped[w] = w;
+
+  return mmu;
+}
+
+extern void
+mmu_free(struct mmu* mmu)
+{
+  if (!mmu)
+    return;
+
+  free(mmu->banks);
+  free(mmu);
+}
+
+extern bool
+mmu_reset(struct mmu* mmu, const uint8_t* extra, size_t len)
+{
+  if (len > (size_t)(mmu->num_banks - MMU_WINDOWS) * MMU_BANK_SIZE)
+    return false;
+
+  for (int w = 0; w < MMU_WINDOWS; w++)
+    mmu->mapped[w] = w;
+
+  memset(mmu->banks, 0, (size_t)mmu->num_banks * MMU_BANK_SIZE);
+  if (len)
+    memcpy(mmu->banks[MMU_WINDOWS], extra, len);
+  return true;
+}
+
+static enum picovm_io
+mmu_in(void* ctx, uint8_t port, int width, uint16_t* val)
+{
+  struct picovm* vm = ctx;
+  (void)width;
+
+  if (port == MMU_PORT_BANKS)
+    *val = vm->mmu->num_banks;
+  else
+    *val = vm->mmu->mapped[port - MMU_PORT_BASE];
+
+  return PICOVM_IO_OK;
+}
+
+static enum picovm_io
+mmu_out(void* ctx, uint8_t port, int width, uint16_t val)
+{
+  struct picovm* vm = ctx;
+  struct mmu* mmu = vm->mmu;
+  const unsigned w = port - MMU_PORT_BASE;
+  uint8_t* window = &vm->ram[w * MMU_BANK_SIZE];
+  (void)width;
+
+  if (port == MMU_PORT_BANKS || val >= mmu->num_banks ||
+      val == mmu->mapped[w])
+    return PICOVM_IO_OK;
+
+  // a second window on the same bank would not see the first one's stores
+  for (int i = 0; i < MMU_WINDOWS; i++)
+    if (mmu->mapped[i] == val)
+      return PICOVM_IO_OK;
+
+  memcpy(mmu->banks[mmu->mapped[w]], window, MMU_BANK_SIZE);
+  memcpy(window, mmu->banks[val], MMU_BANK_SIZE);
+  mmu->mapped[w] = val;
+
+  return PICOVM_IO_OK;
+}
+
+extern void
+mmu_attach(struct picovm* vm)
+{
+  for (int port = MMU_PORT_BASE; port <= MMU_PORT_BANKS; port++)
+    picovm_map_port(vm, port, mmu_in, mmu_out, vm);
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+/* mmu.h
+
+        bank switching
+        guest ram is split into MMU_WINDOWS windows of MMU_BANK_SIZE
+        bytes, each showing one bank of a larger host side store.
+        switching a window copies its bytes back into the bank it showed
+        and the new bank in, so guest ram stays a flat array and loads
+        and stores never translate anything.
+
+        banks 0..MMU_WINDOWS-1 are what the windows show after a reset,
+        bank MMU_WINDOWS onwards start out as the rest of a rom image
+        bigger than ROMLEN, then zero.
+
+        BOUT/SOUT to MMU_PORT_BASE + w maps a bank into window w,
+        BIN/SIN reads which bank it shows. a bank shows in at most one
+        window, mapping one that is already showing elsewhere, or one
+        past the end of the store, is ignored. MMU_PORT_BANKS reads how
+        many banks there are.
+*/
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "defs.h"
+
+#define MMU_BANK_SIZE 0x4000
+#define MMU_WINDOWS (RAMSIZE / MMU_BANK_SIZE)
+
+#define MMU_PORT_BASE 0xB0
+#define MMU_PORT_BANKS (MMU_PORT_BASE + MMU_WINDOWS)
+
+struct picovm;
+
+struct mmu
+{
+  uint8_t (*banks)[MMU_BANK_SIZE];
+  unsigned num_banks;
+
+  // bank showing in each window
+  uint16_t mapped[MMU_WINDOWS];
+};
+
+/// returns NULL if the store could not be allocated
+/// `num_banks` is raised to MMU_WINDOWS if smaller
+extern struct mmu*
+mmu_new(unsigned num_banks);
+
+extern void
+mmu_free(struct mmu* mmu);
+
+/// maps the mmu's ports on `vm`
+extern void
+mmu_attach(struct picovm* vm);
+
+/// back to the identity mapping, with `extra` (the part of a rom image
+/// past ROMLEN) in the banks after the home banks and the rest zeroed.
+/// returns false if `extra` does not fit
+extern bool
+mmu_reset(struct mmu* mmu, const uint8_t* extra, size_t len);
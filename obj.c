@@ -0,0 +1,233 @@
+/* obj.c
+
+        reading and writing of relocatable objects, see obj.h
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "defs.h"
+#include "leb.h"
+#include "obj.h"
+#include "opt.h"
+
+static void
+put_refs(FILE* f, const struct obj_ref* refs, uint32_t n)
+{
+  put_leb(f, n);
+  for (uint32_t i = 0; i < n; i++) {
+    put_leb(f, refs[i].name);
+    put_leb(f, refs[i].section);
+    put_leb(f, refs[i].off);
+  }
+}
+
+extern bool
+obj_write(const struct obj* o, FILE* out)
+{
+  fwrite(OBJ_MAGIC, 1, 4, out);
+  putc(OBJ_VERSION, out);
+
+  put_leb(out, o->source ? strlen(o->source) : 0);
+  if (o->source)
+    fwrite(o->source, 1, strlen(o->source), out);
+
+  put_leb(out, o->num_names);
+  for (uint32_t i = 0; i < o->num_names; i++) {
+    const size_t len = strlen(o->names[i]);
+    put_leb(out, len);
+    fwrite(o->names[i], 1, len, out);
+  }
+
+  put_leb(out, o->num_sections);
+  for (uint32_t i = 0; i < o->num_sections; i++) {
+    const struct obj_section* s = &o->sections[i];
+    put_leb(out, s->flags);
+    put_leb(out, s->at);
+    put_leb(out, s->offset);
+    put_leb(out, s->len);
+    fwrite(s->bytes, 1, s->len, out);
+  }
+
+  put_refs(out, o->symbols, o->num_symbols);
+  put_refs(out, o->relocs, o->num_relocs);
+
+  put_leb(out, o->num_lines);
+  for (uint32_t i = 0; i < o->num_lines; i++) {
+    put_leb(out, o->lines[i].section);
+    put_leb(out, o->lines[i].off);
+    put_leb(out, o->lines[i].line);
+    put_leb(out, o->lines[i].col);
+  }
+
+  put_leb(out, o->report != NULL);
+  if (o->report) {
+    put_leb(out, o->report->threaded);
+    put_leb(out, o->report->jumps);
+    put_leb(out, o->report->moves);
+    put_leb(out, o->report->tests);
+    put_leb(out, o->report->shortened);
+    put_leb(out, o->report->relaxed);
+    put_leb(out, o->report->bytes);
+    put_leb(out, o->report->cycles);
+  }
+
+  return !ferror(out);
+}
+
+/// a length and that many bytes as a string, NULL if it does not read
+static char*
+get_string(FILE* f)
+{
+  uint32_t len;
+  char* str;
+
+  if (!get_leb(f, &len) || len > UINT16_MAX)
+    return NULL;
+  str = xcalloc(len + 1, 1);
+  if (fread(str, 1, len, f) != len || memchr(str, 0, len)) {
+    free(str);
+    return NULL;
+  }
+  return str;
+}
+
+/// reads `n` refs, `tail` bytes from the end of their section at the most
+static struct obj_ref*
+get_refs(FILE* f, const struct obj* o, uint32_t* n, uint32_t tail)
+{
+  struct obj_ref* refs;
+
+  if (!get_leb(f, n) || *n > ROMIMAGE_MAX)
+    return NULL;
+
+  refs = xcalloc(*n, sizeof(*refs));
+  for (uint32_t i = 0; i < *n; i++) {
+    struct obj_ref* r = &refs[i];
+
+    if (!get_leb(f, &r->name) || !get_leb(f, &r->section) ||
+        !get_leb(f, &r->off) || r->name >= o->num_names ||
+        r->section >= o->num_sections ||
+        (uint64_t)r->off + tail > o->sections[r->section].len) {
+      free(refs);
+      return NULL;
+    }
+  }
+  return refs;
+}
+
+extern struct obj*
+obj_read(FILE* in)
+{
+  struct obj* o = xcalloc(1, sizeof(*o));
+  uint8_t header[5];
+  uint32_t n, flags, bytes, cycles;
+
+  if (fread(header, 1, 5, in) != 5 || memcmp(header, OBJ_MAGIC, 4) != 0 ||
+      header[4] != OBJ_VERSION)
+    goto bad;
+
+  if (!(o->source = get_string(in)))
+    goto bad;
+  if (!*o->source) {
+    free(o->source);
+    o->source = NULL;
+  }
+
+  if (!get_leb(in, &n) || n > ROMIMAGE_MAX)
+    goto bad;
+  o->names = xcalloc(n, sizeof(*o->names));
+  while (o->num_names < n) {
+    if (!(o->names[o->num_names] = get_string(in)))
+      goto bad;
+    o->num_names += 1;
+  }
+
+  if (!get_leb(in, &n) || n > ROMIMAGE_MAX)
+    goto bad;
+  o->sections = xcalloc(n, sizeof(*o->sections));
+  while (o->num_sections < n) {
+    struct obj_section* s = &o->sections[o->num_sections++];
+
+    if (!get_leb(in, &flags) || !get_leb(in, &s->at) ||
+        !get_leb(in, &s->offset) || !get_leb(in, &s->len) ||
+        flags > (OBJ_SEC_FLOAT | OBJ_SEC_INHERIT_OFFSET) ||
+        s->len > ROMIMAGE_MAX)
+      goto bad;
+    s->flags = flags;
+    s->bytes = xcalloc(s->len, 1);
+    if (fread(s->bytes, 1, s->len, in) != s->len)
+      goto bad;
+  }
+
+  if (!(o->symbols = get_refs(in, o, &o->num_symbols, 0)) ||
+      !(o->relocs = get_refs(in, o, &o->num_relocs, 2)))
+    goto bad;
+
+  if (!get_leb(in, &n) || n > ROMIMAGE_MAX)
+    goto bad;
+  o->lines = xcalloc(n, sizeof(*o->lines));
+  o->num_lines = n;
+  for (uint32_t i = 0; i < n; i++) {
+    struct obj_line* l = &o->lines[i];
+
+    if (!get_leb(in, &l->section) || !get_leb(in, &l->off) ||
+        !get_leb(in, &l->line) || !get_leb(in, &l->col) ||
+        l->section >= o->num_sections ||
+        l->off >= o->sections[l->section].len)
+      goto bad;
+  }
+
+  if (!get_leb(in, &n) || n > 1)
+    goto bad;
+  if (n) {
+    struct opt_report* r = o->report = xcalloc(1, sizeof(*r));
+
+    if (!get_leb(in, &r->threaded) || !get_leb(in, &r->jumps) ||
+        !get_leb(in, &r->moves) || !get_leb(in, &r->tests) ||
+        !get_leb(in, &r->shortened) || !get_leb(in, &r->relaxed) ||
+        !get_leb(in, &bytes) || !get_leb(in, &cycles))
+      goto bad;
+    r->bytes = bytes;
+    r->cycles = cycles;
+  }
+
+  return o;
+
+bad:
+  obj_free(o);
+  return NULL;
+}
+
+extern void
+obj_free(struct obj* o)
+{
+  if (!o)
+    return;
+
+  for (uint32_t i = 0; i < o->num_names; i++)
+    free(o->names[i]);
+  for (uint32_t i = 0; i < o->num_sections; i++)
+    free(o->sections[i].bytes);
+
+  free(o->source);
+  free(o->names);
+  free(o->sections);
+  free(o->symbols);
+  free(o->relocs);
+  free(o->lines);
+  free(o->report);
+  free(o);
+}
+
+// 64 bit fnv-1a
+extern uint64_t
+obj_source_hash(const char* src, size_t len, uint32_t flags)
+{
+  // a new object format makes every cached object stale
+  uint64_t h = 14695981039346656037u ^ OBJ_VERSION ^ (uint64_t)flags << 8;
+
+  for (size_t i = 0; i < len; i++)
+    h = (h ^ (uint8_t)src[i]) * 1099511628211u;
+  return h;
+}
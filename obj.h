@@ -0,0 +1,122 @@
+#pragma once
+
+/* obj.h
+
+        relocatable objects and the linker
+        assemble_object() turns one source into the bytes it emits, cut
+        into sections, the labels it defines and the relocations that want
+        a label's address. link_objects() lays the sections of any number
+        of objects out into one rom image and patches the relocations, so a
+        module only has to be assembled again when its own source changes.
+
+        a module starts a new section at its top and at every .set and
+        .offset. until a module's first .set its sections continue where
+        the module before it ended, until its first .offset they keep the
+        address offset that module ended with. linking a.o and b.o gives
+        the same rom as assembling a.psm and b.psm as one file.
+
+        file layout, every number leb128:
+          header   "PVMO", version byte
+          source   length and bytes of the path it was assembled from
+          names    count, then per name its length and bytes
+          sections count, then per section flags, at, offset, length, bytes
+          symbols  count, then per symbol name, section, offset in section
+          relocs   count, then per relocation name, section, offset in
+                   section of the big endian short the label's address is
+                   added to
+          lines    count, then per instruction section, offset in section,
+                   line and column of the source it came from
+          peephole 0, or 1 and what the pass saved: jumps threaded, jumps
+                   dropped, moves, tests, shorter encodings, short branches,
+                   bytes and cycles, see struct opt_report
+*/
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define OBJ_MAGIC "PVMO"
+#define OBJ_VERSION 4
+
+enum obj_section_flags
+{
+  // at is relative to where the previous module ended
+  OBJ_SEC_FLOAT = 1 << 0,
+  // offset is whatever the previous module ended with
+  OBJ_SEC_INHERIT_OFFSET = 1 << 1,
+};
+
+struct obj_section
+{
+  uint8_t flags;
+  // index into the rom image and the offset its addresses are seen at,
+  // see .set and .offset
+  uint32_t at, offset;
+  uint32_t len;
+  uint8_t* bytes;
+};
+
+/// a label, or a place that wants one's address
+struct obj_ref
+{
+  // index into names
+  uint32_t name;
+  uint32_t section, off;
+};
+
+/// where an instruction came from, line and column are 1 based
+struct obj_line
+{
+  uint32_t section, off;
+  uint32_t line, col;
+};
+
+struct opt_report;
+
+struct obj
+{
+  // NULL if not known
+  char* source;
+  uint32_t num_names, num_sections, num_symbols, num_relocs, num_lines;
+  char** names;
+  struct obj_section* sections;
+  struct obj_ref* symbols;
+  struct obj_ref* relocs;
+  struct obj_line* lines;
+  // what the peephole pass saved, NULL if it did not run
+  struct opt_report* report;
+};
+
+/// a source as an object, see defs.h for the plain rom
+extern struct obj*
+assemble_object(const char* in);
+
+extern bool
+obj_write(const struct obj* o, FILE* out);
+
+/// NULL if `in` is not a well formed object
+extern struct obj*
+obj_read(FILE* in);
+
+extern void
+obj_free(struct obj* o);
+
+/// cache key of an object assembled from `len` bytes of source at `src`,
+/// `flags` are the settings that change what the assembler makes of it
+extern uint64_t
+obj_source_hash(const char* src, size_t len, uint32_t flags);
+
+/// the rom image `n` objects make in that order, errors out on labels
+/// defined twice or never
+extern char*
+link_objects(struct obj* const* objs, int n, size_t* outlen);
+
+/// frees what the last link_objects() on this thread kept for
+/// assemble_write_map() and assemble_write_symbols()
+extern void
+link_release(void);
+
+/// stops link_objects() from printing every relocation
+extern void
+link_quiet(bool quiet);
@@ -0,0 +1,587 @@
+/* opt.c
+
+        peephole optimizer, see opt.h
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "defs.h"
+#include "leb.h"
+#include "opt.h"
+
+#define NUM_REGS 16
+#define UNKNOWN -1
+
+/// what the pass knows about one section
+struct section_view
+{
+  struct obj_section* s;
+  // per byte offset, len + 1 of them: a label points here, the relocation
+  // whose short starts here (-1 if none), the instruction starting here
+  // (-1 if none)
+  bool* labelled;
+  int* reloc_at;
+  int* insn_at;
+};
+
+/// what a run of instructions has left in the registers and flags
+struct state
+{
+  // the value a register holds, UNKNOWN if not a constant
+  long known[NUM_REGS];
+  // the instruction whose LOAD into a register nothing has read yet
+  int unread[NUM_REGS];
+
+  // the TEST the flags are from, a against b, or against imm if b < 0
+  bool tested;
+  int test_a, test_b;
+  long test_imm;
+};
+
+/// what becomes of an instruction
+struct fate
+{
+  bool dead;
+  // if not 0, the shorter encoding replacing it
+  uint8_t len;
+  uint8_t bytes[2];
+};
+
+static void
+forget(struct state* st)
+{
+  for (int r = 0; r < NUM_REGS; r++) {
+    st->known[r] = UNKNOWN;
+    st->unread[r] = -1;
+  }
+  st->tested = false;
+  st->test_a = st->test_b = -1;
+  st->test_imm = 0;
+}
+
+/// something may read `r` now, a LOAD before stays
+static void
+read_reg(struct state* st, int r)
+{
+  st->unread[r] = -1;
+}
+
+/// `r` changes, to `val` if that is known
+static void
+write_reg(struct state* st, int r, long val)
+{
+  st->known[r] = val;
+  if (st->tested && (st->test_a == r || st->test_b == r))
+    st->tested = false;
+}
+
+/// the label `name` names in this object, NULL if it is defined elsewhere
+static const struct obj_ref*
+find_symbol(const struct obj* o, const int* sym_of_name, uint32_t name)
+{
+  return sym_of_name[name] < 0 ? NULL : &o->symbols[sym_of_name[name]];
+}
+
+/// what the label's address is added to by the relocation at `off`
+static int
+reloc_addend(const struct section_view* view, uint32_t off)
+{
+  return view->s->bytes[off] << 8 | view->s->bytes[off + 1];
+}
+
+/// the instruction a relocation at `off` in `view` lands on, -1 if that is
+/// not known, such as for a label plus an offset
+static int
+reloc_target(const struct obj* o,
+             const struct section_view* views,
+             const int* sym_of_name,
+             const struct section_view* view,
+             uint32_t off)
+{
+  const struct obj_ref* sym;
+  const int r = view->reloc_at[off];
+
+  if (r < 0 || reloc_addend(view, off) ||
+      !(sym = find_symbol(o, sym_of_name, o->relocs[r].name)))
+    return -1;
+  return views[sym->section].insn_at[sym->off];
+}
+
+/// points jumps and calls at a JUMP straight at where it goes
+static void
+thread_jumps(struct obj* o,
+             const struct opt_insn* insns,
+             int num_insns,
+             const struct section_view* views,
+             const int* sym_of_name,
+             struct opt_report* report)
+{
+  for (int i = 0; i < num_insns; i++) {
+    const struct section_view* view = &views[insns[i].section];
+    const uint8_t op = view->s->bytes[insns[i].off];
+    int r, hops = 0, j = i;
+
+    if ((op < BRANCH || op > BRANCH_GREATER_THAN_EQUAL) && op != CALL)
+      continue;
+    if ((r = view->reloc_at[insns[i].off + 1]) < 0)
+      continue;
+
+    // a loop of jumps ends once every one of them has been followed
+    while (hops < num_insns) {
+      const struct section_view* at;
+      int next;
+
+      j = reloc_target(o, views, sym_of_name, &views[insns[j].section],
+                       insns[j].off + 1);
+      if (j < 0)
+        break;
+
+      at = &views[insns[j].section];
+      next = at->reloc_at[insns[j].off + 1];
+      if (at->s->bytes[insns[j].off] != BRANCH || next < 0 ||
+          reloc_addend(at, insns[j].off + 1) ||
+          o->relocs[next].name == o->relocs[r].name)
+        break;
+
+      o->relocs[r].name = o->relocs[next].name;
+      hops++;
+    }
+
+    if (hops) {
+      report->threaded += 1;
+      report->cycles += hops;
+    }
+  }
+}
+
+/// decides the fate of every instruction in one straight walk over them
+static void
+scan(const struct obj* o,
+     const struct opt_insn* insns,
+     int num_insns,
+     const struct section_view* views,
+     const int* sym_of_name,
+     struct fate* fates,
+     struct opt_report* report)
+{
+  struct state st;
+  uint32_t section = UINT32_MAX, end = 0;
+
+  forget(&st);
+
+  for (int i = 0; i < num_insns; i++) {
+    const struct section_view* view = &views[insns[i].section];
+    const uint8_t* b = &view->s->bytes[insns[i].off];
+    // reg-imm forms are op, register, big endian immediate
+    const bool has_imm = insns[i].len >= 4;
+    const bool imm_fixed =
+      has_imm && view->reloc_at[insns[i].off + 2] < 0;
+    const long imm = has_imm ? b[2] << 8 | b[3] : 0;
+    int hi = insns[i].len >= 2 ? b[1] >> 4 : 0;
+    int lo = insns[i].len >= 2 ? b[1] & 0x0F : 0;
+    int target, with = -1;
+
+    // anything may jump to a label, and data may sit between instructions
+    if (insns[i].section != section || insns[i].off != end ||
+        view->labelled[insns[i].off])
+      forget(&st);
+    section = insns[i].section;
+    end = insns[i].off + insns[i].len;
+
+    switch (b[0]) {
+      case NOP:
+      case ENINT:
+      case DISINT:
+      case STOR_PTRDEREF_IMM:
+        break;
+
+      case LOAD_REG_REG:
+        read_reg(&st, lo);
+        if (hi == lo || (st.known[hi] != UNKNOWN && st.known[hi] ==
+                                                      st.known[lo])) {
+          fates[i].dead = true;
+          report->moves += 1;
+          break;
+        }
+        goto load;
+
+      case LOAD_REG_IMM:
+        hi = b[1] & 0x0F;
+        if (imm_fixed && st.known[hi] == imm) {
+          fates[i].dead = true;
+          report->moves += 1;
+          break;
+        }
+
+        for (int r = 0; r < NUM_REGS && imm_fixed; r++)
+          if (r != hi && st.known[r] == imm) {
+            with = r;
+            break;
+          }
+
+        if (with >= 0) {
+          fates[i] = (struct fate){ .len = 2, .bytes = { LOAD_REG_REG,
+                                                         hi << 4 | with } };
+          read_reg(&st, with);
+          report->shortened += 1;
+        }
+
+      load:
+        // the LOAD before, into the same register, was for nothing
+        if (st.unread[hi] >= 0) {
+          if (fates[st.unread[hi]].len)
+            report->shortened -= 1;
+          fates[st.unread[hi]] = (struct fate){ .dead = true };
+          report->moves += 1;
+        }
+        write_reg(&st,
+                  hi,
+                  b[0] == LOAD_REG_REG ? st.known[lo]
+                  : imm_fixed          ? imm
+                                       : UNKNOWN);
+        st.unread[hi] = i;
+        break;
+
+      case ADD_REG_IMM:
+      case SUB_REG_IMM:
+      case MUL_REG_IMM:
+      case DIV_REG_IMM:
+      case TEST_REG_IMM:
+        lo = b[1] & 0x0F;
+        read_reg(&st, lo);
+
+        // the reg-reg form of each is the one before it
+        for (int r = 0; r < NUM_REGS && imm_fixed; r++)
+          if (st.known[r] == imm && (b[0] != DIV_REG_IMM || imm != 0)) {
+            with = r;
+            break;
+          }
+
+        if (b[0] == TEST_REG_IMM) {
+          if (imm_fixed && st.tested && st.test_a == lo && st.test_b < 0 &&
+              st.test_imm == imm) {
+            fates[i].dead = true;
+            report->tests += 1;
+            break;
+          }
+          st.tested = imm_fixed;
+          st.test_a = lo;
+          st.test_b = -1;
+          st.test_imm = imm;
+        } else {
+          write_reg(&st, lo, UNKNOWN);
+        }
+
+        if (with >= 0) {
+          fates[i] =
+            (struct fate){ .len = 2, .bytes = { b[0] - 1, lo << 4 | with } };
+          read_reg(&st, with);
+          report->shortened += 1;
+        }
+        break;
+
+      case ADD_REG_REG:
+      case SUB_REG_REG:
+      case MUL_REG_REG:
+      case DIV_REG_REG:
+        read_reg(&st, hi);
+        read_reg(&st, lo);
+        write_reg(&st, hi, UNKNOWN);
+        break;
+
+      case TEST_REG_REG:
+        read_reg(&st, hi);
+        read_reg(&st, lo);
+        if (st.tested && st.test_a == hi && st.test_b == lo) {
+          fates[i].dead = true;
+          report->tests += 1;
+          break;
+        }
+        st.tested = true;
+        st.test_a = hi;
+        st.test_b = lo;
+        break;
+
+      case LOAD_REG_DEREF:
+        // a load from a device is not for nothing, it stays
+        write_reg(&st, b[1] & 0x0F, UNKNOWN);
+        st.unread[b[1] & 0x0F] = -1;
+        break;
+
+      case STOR_PTRDEREF_REG:
+      case BOUT:
+      case SOUT:
+        read_reg(&st, b[3] & 0x0F);
+        break;
+
+      case BIN:
+      case SIN:
+        write_reg(&st, b[3] & 0x0F, UNKNOWN);
+        st.unread[b[3] & 0x0F] = -1;
+        break;
+
+      case BRANCH:
+      case BRANCH_EQUAL:
+      case BRANCH_NOT_EQUAL:
+      case BRANCH_LESS_THAN:
+      case BRANCH_GREATER_THAN:
+      case BRANCH_LESS_THAN_EQUAL:
+      case BRANCH_GREATER_THAN_EQUAL:
+        target = reloc_target(o, views, sym_of_name, view, insns[i].off + 1);
+        if (target >= 0 && insns[target].section == insns[i].section &&
+            insns[target].off == end) {
+          fates[i].dead = true;
+          report->jumps += 1;
+          break;
+        }
+
+        // whatever is at the target may read any register
+        for (int r = 0; r < NUM_REGS; r++)
+          st.unread[r] = -1;
+        if (b[0] == BRANCH)
+          forget(&st);
+        break;
+
+      default:
+        // calls, returns and everything else the pass does not model
+        forget(&st);
+    }
+  }
+}
+
+/// picks the 2 byte BRANCH_SHORT or CALL_SHORT form for every branch and
+/// call to a label in its own section that ends up within a signed byte of
+/// it. shorter branches only bring others closer, so it starts with every
+/// candidate short and makes the ones out of reach long again until none is
+static void
+relax(struct obj* o,
+      const struct opt_insn* insns,
+      int num_insns,
+      const struct section_view* views,
+      const int* sym_of_name,
+      struct fate* fates,
+      struct opt_report* report)
+{
+  // per section and byte offset, how many short instructions start before it
+  uint32_t** before = xcalloc(o->num_sections, sizeof(*before));
+  int* target = xcalloc(num_insns, sizeof(int));
+  bool changed = true;
+
+  for (uint32_t i = 0; i < o->num_sections; i++)
+    before[i] = xcalloc(o->sections[i].len + 1, sizeof(uint32_t));
+
+  for (int i = 0; i < num_insns; i++) {
+    const struct section_view* view = &views[insns[i].section];
+    const uint8_t op = view->s->bytes[insns[i].off];
+    const struct obj_ref* sym;
+    int r;
+
+    target[i] = -1;
+    if ((op < BRANCH || op > BRANCH_GREATER_THAN_EQUAL) && op != CALL)
+      continue;
+    if ((r = view->reloc_at[insns[i].off + 1]) < 0 ||
+        reloc_addend(view, insns[i].off + 1) ||
+        !(sym = find_symbol(o, sym_of_name, o->relocs[r].name)) ||
+        sym->section != insns[i].section)
+      continue;
+
+    target[i] = sym->off;
+    fates[i].len = 2;
+    fates[i].bytes[0] = op == CALL ? CALL_SHORT : op + 0x10;
+  }
+
+  while (changed) {
+    changed = false;
+
+    for (uint32_t i = 0; i < o->num_sections; i++)
+      memset(before[i], 0, (o->sections[i].len + 1) * sizeof(uint32_t));
+    for (int i = 0; i < num_insns; i++)
+      if (fates[i].len)
+        before[insns[i].section][insns[i].off + 1] += 1;
+    for (uint32_t i = 0; i < o->num_sections; i++)
+      for (uint32_t off = 1; off <= o->sections[i].len; off++)
+        before[i][off] += before[i][off - 1];
+
+    for (int i = 0; i < num_insns; i++) {
+      const uint32_t* b = before[insns[i].section];
+      long disp;
+
+      if (!fates[i].len)
+        continue;
+
+      disp = (long)(target[i] - b[target[i]]) -
+             (long)(insns[i].off - b[insns[i].off] + 2);
+      if (disp < INT8_MIN || disp > INT8_MAX) {
+        fates[i].len = 0;
+        changed = true;
+      } else
+        fates[i].bytes[1] = (uint8_t)(int8_t)disp;
+    }
+  }
+
+  for (int i = 0; i < num_insns; i++)
+    report->relaxed += fates[i].len != 0;
+
+  for (uint32_t i = 0; i < o->num_sections; i++)
+    free(before[i]);
+  free(before);
+  free(target);
+}
+
+/// rewrites the section behind `view`, moving its labels, relocations and
+/// instructions. a dead instruction is left with a length of 0
+static void
+rewrite(struct obj* o,
+        uint32_t section,
+        const struct section_view* view,
+        struct opt_insn* insns,
+        const struct fate* fates,
+        bool* reloc_dead,
+        struct opt_report* report)
+{
+  struct obj_section* s = view->s;
+  uint8_t* bytes = xcalloc(s->len, 1);
+  uint32_t* moved = xcalloc(s->len + 1, sizeof(*moved));
+  uint32_t from = 0, to = 0;
+
+  while (from < s->len) {
+    const int i = view->insn_at[from];
+    const struct fate* f = i >= 0 ? &fates[i] : NULL;
+
+    if (!f || (!f->dead && !f->len)) {
+      const uint32_t n = f ? insns[i].len : 1;
+      if (f)
+        insns[i].off = to;
+      for (uint32_t k = 0; k < n; k++) {
+        moved[from + k] = to;
+        bytes[to++] = s->bytes[from + k];
+      }
+      from += n;
+      continue;
+    }
+
+    for (uint32_t k = 0; k < insns[i].len; k++) {
+      if (view->reloc_at[from + k] >= 0)
+        reloc_dead[view->reloc_at[from + k]] = true;
+      moved[from + k] = to;
+    }
+    if (!f->dead) {
+      memcpy(&bytes[to], f->bytes, f->len);
+      to += f->len;
+    }
+    report->bytes += insns[i].len - (f->dead ? 0 : f->len);
+    from += insns[i].len;
+    insns[i].off = to - (f->dead ? 0 : f->len);
+    insns[i].len = f->dead ? 0 : f->len;
+  }
+  moved[s->len] = to;
+
+  for (uint32_t i = 0; i < o->num_symbols; i++)
+    if (o->symbols[i].section == section)
+      o->symbols[i].off = moved[o->symbols[i].off];
+  for (uint32_t i = 0; i < o->num_relocs; i++)
+    if (o->relocs[i].section == section)
+      o->relocs[i].off = moved[o->relocs[i].off];
+
+  free(s->bytes);
+  s->bytes = bytes;
+  s->len = to;
+  free(moved);
+}
+
+static struct section_view*
+make_views(const struct obj* o,
+           const struct opt_insn* insns,
+           int num_insns,
+           int* sym_of_name)
+{
+  struct section_view* views = xcalloc(o->num_sections, sizeof(*views));
+
+  for (uint32_t i = 0; i < o->num_sections; i++) {
+    struct section_view* v = &views[i];
+    const uint32_t len = o->sections[i].len + 1;
+
+    v->s = &o->sections[i];
+    v->labelled = xcalloc(len, sizeof(bool));
+    v->reloc_at = xcalloc(len, sizeof(int));
+    v->insn_at = xcalloc(len, sizeof(int));
+    for (uint32_t off = 0; off < len; off++)
+      v->reloc_at[off] = v->insn_at[off] = -1;
+  }
+
+  for (uint32_t i = 0; i < o->num_names; i++)
+    sym_of_name[i] = -1;
+  for (uint32_t i = 0; i < o->num_symbols; i++) {
+    sym_of_name[o->symbols[i].name] = i;
+    views[o->symbols[i].section].labelled[o->symbols[i].off] = true;
+  }
+  for (uint32_t i = 0; i < o->num_relocs; i++)
+    views[o->relocs[i].section].reloc_at[o->relocs[i].off] = i;
+  for (int i = 0; i < num_insns; i++)
+    views[insns[i].section].insn_at[insns[i].off] = i;
+
+  return views;
+}
+
+/// carries out `fates` and frees `views`, dead instructions and the
+/// relocations they held leave the lists
+static void
+apply(struct obj* o,
+      struct opt_insn* insns,
+      int* num_insns,
+      struct section_view* views,
+      const struct fate* fates,
+      struct opt_report* report)
+{
+  bool* reloc_dead = xcalloc(o->num_relocs, sizeof(bool));
+  uint32_t kept = 0;
+  int left = 0;
+
+  for (uint32_t i = 0; i < o->num_sections; i++) {
+    rewrite(o, i, &views[i], insns, fates, reloc_dead, report);
+    free(views[i].labelled);
+    free(views[i].reloc_at);
+    free(views[i].insn_at);
+  }
+  free(views);
+
+  for (uint32_t i = 0; i < o->num_relocs; i++)
+    if (!reloc_dead[i])
+      o->relocs[kept++] = o->relocs[i];
+  o->num_relocs = kept;
+
+  for (int i = 0; i < *num_insns; i++)
+    if (insns[i].len)
+      insns[left++] = insns[i];
+  *num_insns = left;
+
+  free(reloc_dead);
+}
+
+extern void
+opt_peephole(struct obj* o,
+             struct opt_insn* insns,
+             int* num_insns,
+             struct opt_report* report)
+{
+  int* sym_of_name = xcalloc(o->num_names, sizeof(int));
+  struct fate* fates = xcalloc(*num_insns, sizeof(*fates));
+  struct section_view* views = make_views(o, insns, *num_insns, sym_of_name);
+
+  thread_jumps(o, insns, *num_insns, views, sym_of_name, report);
+  scan(o, insns, *num_insns, views, sym_of_name, fates, report);
+
+  for (int i = 0; i < *num_insns; i++)
+    report->cycles += fates[i].dead;
+  apply(o, insns, num_insns, views, fates, report);
+
+  // what is left only gets shorter, relaxing has to see it laid out
+  memset(fates, 0, *num_insns * sizeof(*fates));
+  views = make_views(o, insns, *num_insns, sym_of_name);
+  relax(o, insns, *num_insns, views, sym_of_name, fates, report);
+  apply(o, insns, num_insns, views, fates, report);
+
+  free(sym_of_name);
+  free(fates);
+}
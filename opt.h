@@ -0,0 +1,57 @@
+#pragma once
+
+/* opt.h
+
+        peephole optimizer
+        runs over the instructions of a freshly assembled object, before it
+        is written or linked (-O). within a straight run of instructions,
+        one no label points into, it
+          - threads jumps and calls whose target is a JUMP to the final target
+          - drops JUMPs and branches to the very next instruction
+          - drops register moves that do nothing: LOAD %a %a, a LOAD of the
+            value %a already holds, and a LOAD whose value is overwritten
+            before anything reads it
+          - drops a TEST repeating one whose registers have not changed since.
+            arithmetic only sets the carry flag, so a TEST after it is
+            never redundant.
+          - uses the 2 byte reg-reg form of LOAD/ADD/SUB/MUL/DIV/TEST over the
+            4 byte reg-imm one when a register already holds the immediate
+
+        then it relaxes branches: a BRANCH, Bxx or CALL to a label in its own
+        section takes the 2 byte short form with a signed byte displacement
+        (BRANCH_SHORT and on, CALL_SHORT) when the label ends up within reach.
+        the distance between two places in a section does not change when
+        the linker moves it, so short branches need no relocation.
+
+        code has to be reached only through labels, jumps to literal
+        addresses into an optimized module land somewhere else.
+*/
+
+#include <stdint.h>
+
+#include "obj.h"
+
+/// an instruction the assembler emitted, `len` bytes at `off` in `section`
+/// from `line`:`col` of the source, both 1 based
+struct opt_insn
+{
+  uint32_t section, off;
+  uint8_t len;
+  uint32_t line, col;
+};
+
+struct opt_report
+{
+  unsigned threaded, jumps, moves, tests, shortened, relaxed;
+  // bytes saved, and instructions no longer executed per pass through the
+  // code, each of which is a cycle
+  long bytes, cycles;
+};
+
+/// optimizes `o` in place, adding what it did to `report`. `insns` are
+/// updated to what is left of them
+extern void
+opt_peephole(struct obj* o,
+             struct opt_insn* insns,
+             int* num_insns,
+             struct opt_report* report);
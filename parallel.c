@@ -1,7 +1,9 @@
+#define _POSIX_C_SOURCE 199309L
+
 #include "config.h"
 #include "defs.h"
-#include "interrupt.h"
 #include "parallel.h"
+#include "picovm.h"
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <pthread.h>
@@ -9,6 +11,7 @@
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 
 struct worker_args
@@ -22,6 +25,12 @@ struct worker_args
 
 static int num_parallel_workers;
 
+// the instance interrupts are raised on
+static struct picovm* parallel_vm;
+
+// latest byte received on each port, 0xFFFF before the first one
+static uint16_t parallel_latest[3];
+
 static void*
 parallel_listener(void* args);
 
@@ -44,7 +53,7 @@ parallel_listener(void* args)
     ERR("provided parallel socket path is too long (>%lu)\n",
         sizeof(addr.sun_path));
 
-  listen_sock = socket(AF_INET, SOCK_STREAM, 0);
+  listen_sock = socket(AF_UNIX, SOCK_STREAM, 0);
   if (listen_sock < 0)
     ERR("failed to create parallel socket at %s\n", vm_config.parallel_loc)
 
@@ -99,30 +108,22 @@ parallel_port_worker(void* _args)
   struct worker_args args = *(struct worker_args*)_args;
   free(_args);
 
-  char buf;
-  int fd, pipein, err;
-  int pipe_tmp[2];
-  enum interrupt_type ty;
+  uint8_t buf;
+  int fd, err;
+  enum picovm_interrupt ty;
+  struct timespec arrived;
 
   fd = args.fd;
 
-  if (pipe(pipe_tmp) < 0) {
-    perror("failed to create parallel port pipe forwarding channel");
-    return NULL;
-  }
-
   switch (args.idx) {
     case 0:
-      ty = INT_P0;
-      p0_fd = pipe_tmp[0];
+      ty = PICOVM_INT_P0;
       break;
     case 1:
-      ty = INT_P1;
-      p1_fd = pipe_tmp[0];
+      ty = PICOVM_INT_P1;
       break;
     case 2:
-      ty = INT_P2;
-      p2_fd = pipe_tmp[0];
+      ty = PICOVM_INT_P2;
       break;
 
     default:
@@ -131,6 +132,7 @@ parallel_port_worker(void* _args)
 
   for (;;) {
     err = read(fd, &buf, 1);
+    clock_gettime(CLOCK_MONOTONIC, &arrived);
 
     if (err == 0) {
       printf("disconnecting serial port\n");
@@ -142,26 +144,44 @@ parallel_port_worker(void* _args)
       break;
     }
 
-    pthread_mutex_lock(&interrupt_cond_mutex);
-    pthread_cond_wait(&interrupt_cond, &interrupt_cond_mutex);
-    current_interrupt = ty;
-    pthread_mutex_unlock(&interrupt_cond_mutex);
+    // one interrupt per byte, don't read ahead until the guest took it
+    // raising orders this store before the isr's read of the port
+    parallel_latest[args.idx] = buf;
+    picovm_raise_interrupt_at(parallel_vm, ty, &arrived);
+    picovm_wait_interrupt(parallel_vm, ty);
   }
 
   close(fd);
-  close(pipe_tmp[0]);
-  close(pipe_tmp[1]);
   num_parallel_workers -= 1;
 
   return NULL;
 }
 
+static enum picovm_io
+parallel_port_in(void* ctx, uint8_t port, int width, uint16_t* val)
+{
+  (void)ctx;
+  (void)width;
+
+  *val = parallel_latest[port - PARALLEL_PORT_BASE];
+  return PICOVM_IO_OK;
+}
+
 extern void
-parallel_init(void)
+parallel_init(struct picovm* vm)
 {
   num_parallel_workers = 0;
+  parallel_vm = vm;
+
+  for (int i = 0; i < 3; i++) {
+    parallel_latest[i] = 0xFFFF;
+    picovm_map_port(vm, PARALLEL_PORT_BASE + i, parallel_port_in, NULL, NULL);
+  }
+
+  if (vm_config.parallel_loc == NULL)
+    return;
 
-  p0_fd = -1;
-  p1_fd = -1;
-  p2_fd = -1;
+  pthread_t thread;
+  pthread_create(&thread, NULL, parallel_listener, NULL);
+  pthread_detach(thread);
 }
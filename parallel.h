@@ -13,7 +13,10 @@ enum parallel_interrupt {
 	PAR2,
 };
 
-extern void parallel_init(void);
+struct picovm;
 
-// output pipes for p0, p1, p2; read by the vm when taking input
-extern int p0_fd, p1_fd, p2_fd;
+// starts listening on vm_config.parallel_loc, if one was given
+extern void parallel_init(struct picovm* vm);
+
+// io ports of p0, p1, p2; IN reads the byte that raised the interrupt
+#define PARALLEL_PORT_BASE 0xA0
@@ -0,0 +1,375 @@
+#pragma once
+
+/* picovm.h
+
+        public interface of libpicovm
+        lets a host embed any number of vm instances in-process,
+        drive them for a bounded number of cycles and inspect their state.
+        nothing in here prints or exits, every fault is handed back as a
+        picovm_result.
+*/
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+struct picovm;
+
+enum picovm_result
+{
+  /// generic success
+  PICOVM_OK = 0,
+
+  /// picovm_run_for used up its cycle budget, the guest can keep going
+  PICOVM_BUDGET,
+
+  /// the guest executed HALT, or picovm_halt was called
+  PICOVM_HALTED,
+
+  /// picovm_step only: the guest is waiting on a port that has no data
+  PICOVM_BLOCKED,
+
+  /// picovm_step only: the guest is spinning until an interrupt arrives
+  PICOVM_IDLE,
+
+  /// the guest tried to execute a byte that is not an opcode
+  PICOVM_ERR_BAD_OPCODE,
+
+  /// the rom handed to picovm_load_rom does not fit in the rom window,
+  /// plus the banks of the mmu if it has one
+  PICOVM_ERR_ROM_TOO_LARGE,
+
+  /// a register index outside of 0..PICOVM_NUM_REGS
+  PICOVM_ERR_BAD_REGISTER,
+
+  /// allocating or initializing the instance failed
+  PICOVM_ERR_NOMEM,
+
+  /// a file handed to the instance could not be opened or written
+  PICOVM_ERR_IO,
+
+  /// the guest read a port or took an interrupt the replay log did not
+  /// expect, or ran past the end of it
+  PICOVM_ERR_REPLAY,
+
+  /// picovm_map_mmio was handed a page inside the rom window
+  PICOVM_ERR_BAD_PAGE,
+};
+
+enum picovm_interrupt
+{
+  PICOVM_INT_P0,
+  PICOVM_INT_P1,
+  PICOVM_INT_P2,
+
+  PICOVM_NUM_INTERRUPTS,
+};
+
+#define PICOVM_NUM_REGS 16
+#define PICOVM_NUM_PORTS 256
+
+enum picovm_io
+{
+  PICOVM_IO_OK,
+
+  /// the device has nothing for the guest yet. the instruction is retried
+  /// once the host calls picovm_wake.
+  PICOVM_IO_BLOCKED,
+};
+
+/// `width` is 1 for BIN/BOUT and 2 for SIN/SOUT
+typedef enum picovm_io (*picovm_port_in)(void* ctx,
+                                         uint8_t port,
+                                         int width,
+                                         uint16_t* val);
+typedef enum picovm_io (*picovm_port_out)(void* ctx,
+                                          uint8_t port,
+                                          int width,
+                                          uint16_t val);
+
+/// memory mapped devices are attached a page at a time
+#define PICOVM_PAGE_SIZE 256
+#define PICOVM_NUM_PAGES 256
+
+/// `addr` is the full guest address of the short being loaded or stored
+typedef uint16_t (*picovm_mmio_read)(void* ctx, uint16_t addr);
+typedef void (*picovm_mmio_write)(void* ctx, uint16_t addr, uint16_t val);
+
+/// hypercall ids below PICOVM_HCALL_USER belong to libpicovm, see hcall.h
+#define PICOVM_NUM_HCALLS 256
+#define PICOVM_HCALL_USER 0x80
+#define PICOVM_HCALL_ARGS 4
+
+/// runs on guest `ram` with the argument block the guest pointed at,
+/// args[0] and args[1] are a pointer and a length in bytes by convention.
+/// returns what the guest reads back
+typedef uint16_t (*picovm_hcall_fn)(void* ctx,
+                                    uint8_t* ram,
+                                    const uint16_t args[PICOVM_HCALL_ARGS]);
+
+struct picovm_hcall
+{
+  picovm_hcall_fn fn;
+  void* ctx;
+
+  // charged on top of the SOUT that made the call
+  uint32_t cycles;
+  // if not 0, one more cycle per this many bytes of args[1]
+  uint32_t bytes_per_cycle;
+};
+
+/// pass as the budget to picovm_run_for to run until halt or fault
+#define PICOVM_RUN_FOREVER UINT64_MAX
+
+struct picovm_options
+{
+  // if not 0, sleep n number of millis between vm steps
+  int step_sleep;
+
+  // run as fast as the host allows, instead of at the 500khz clock
+  bool unthrottled;
+
+  // park the calling thread when the guest spins waiting on an interrupt
+  bool idle_park;
+
+  // if not 0, total 16kb banks behind the bank switching mmu (see mmu.h)
+  unsigned banks;
+};
+
+/// fills `opts` with the defaults used when picovm_create is given NULL
+extern void
+picovm_default_options(struct picovm_options* opts);
+
+/// returns NULL if the instance could not be allocated
+extern struct picovm*
+picovm_create(const struct picovm_options* opts);
+
+extern void
+picovm_destroy(struct picovm* vm);
+
+/// clears ram and registers, copies `rom` into the rom window
+/// and points ip at the startup vector. with an mmu, whatever does not fit
+/// the rom window goes into the banks after the ones initially mapped
+extern enum picovm_result
+picovm_load_rom(struct picovm* vm, const uint8_t* rom, size_t len);
+
+/// runs until `cycles` cycles have been retired, the guest halts,
+/// or the guest faults. a faulted instance keeps returning its fault.
+extern enum picovm_result
+picovm_run_for(struct picovm* vm, uint64_t cycles);
+
+/// cooperative variant of picovm_run_for, for hosts with their own event loop
+/// never sleeps or parks: returns PICOVM_BUDGET, PICOVM_BLOCKED, PICOVM_IDLE,
+/// PICOVM_HALTED or a fault. the 500khz throttle is up to the host.
+extern enum picovm_result
+picovm_step(struct picovm* vm, uint64_t cycles);
+
+/// readable whenever picovm_step has work to do.
+/// stays quiet after PICOVM_BLOCKED or PICOVM_IDLE until picovm_wake or
+/// picovm_raise_interrupt is called. owned by the instance, do not close.
+extern int
+picovm_event_fd(struct picovm* vm);
+
+/// tells the instance a device may have data now, safe from any thread
+extern void
+picovm_wake(struct picovm* vm);
+
+/// attaches handlers for BIN/SIN and BOUT/SOUT on `port`, either may be NULL
+/// reads from unmapped ports return 0xFFFF, writes are dropped
+extern void
+picovm_map_port(struct picovm* vm,
+                uint8_t port,
+                picovm_port_in in,
+                picovm_port_out out,
+                void* ctx);
+
+/// sends LOAD and STOR on the page at `page` * PICOVM_PAGE_SIZE to `read`
+/// and `write` instead of ram, either may be NULL. a short belongs to the
+/// page of its first byte. everything else, fetches, the stack, block and
+/// lane ops, still sees the ram underneath. both NULL unmaps the page.
+/// fails for pages in the rom window
+extern enum picovm_result
+picovm_map_mmio(struct picovm* vm,
+                uint8_t page,
+                picovm_mmio_read read,
+                picovm_mmio_write write,
+                void* ctx);
+
+/// makes `call` what the guest runs for hypercall `id`, NULL removes it
+extern void
+picovm_register_hcall(struct picovm* vm,
+                      uint8_t id,
+                      const struct picovm_hcall* call);
+
+/// what is registered under `id`, NULL if nothing is.
+/// copy, change the cost and register again to retune a built-in
+extern const struct picovm_hcall*
+picovm_hcall(struct picovm* vm, uint8_t id);
+
+/// streams a binary trace of every retired instruction into `path`,
+/// optionally with the registers each one changed. see trace.h
+extern enum picovm_result
+picovm_trace_start(struct picovm* vm, const char* path, bool regs);
+
+/// flushes and closes the trace, if one is running
+extern void
+picovm_trace_stop(struct picovm* vm);
+
+/// labels and source lines to symbolize addresses against, from the
+/// assembler's -m map or the sidecar it writes next to a rom
+struct picovm_symtab;
+
+/// returns NULL if the map could not be read
+extern struct picovm_symtab*
+picovm_symtab_load(const char* path);
+
+extern void
+picovm_symtab_free(struct picovm_symtab* tab);
+
+/// writes "label+off file:line:col" for `addr` into `buf`, as much of it as
+/// is known, like snprintf. returns 0 if nothing is
+extern int
+picovm_symtab_describe(const struct picovm_symtab* tab,
+                       uint16_t addr,
+                       char* buf,
+                       size_t len);
+
+/// samples ip and the guest call stack every `period` cycles
+extern enum picovm_result
+picovm_profile_start(struct picovm* vm, uint64_t period);
+
+extern void
+picovm_profile_stop(struct picovm* vm);
+
+/// writes self samples per label into `flat_path`, and one line per unique
+/// call stack into `folded_path` (flamegraph.pl input). either may be NULL,
+/// as may `syms`, in which case raw addresses are printed
+extern enum picovm_result
+picovm_profile_write(struct picovm* vm,
+                     const struct picovm_symtab* syms,
+                     const char* flat_path,
+                     const char* folded_path);
+
+/// hot-path counters, only kept when built with PICOVM_STATS
+struct picovm_stats
+{
+  // indexed by opcode byte
+  uint64_t retired[256];
+
+  uint64_t branches_taken;
+  uint64_t branches_not_taken;
+
+  uint64_t interrupts[PICOVM_NUM_INTERRUPTS];
+
+  uint64_t port_bytes_in;
+  uint64_t port_bytes_out;
+
+  // LOAD/STOR that went to a memory mapped device
+  uint64_t mmio_loads;
+  uint64_t mmio_stores;
+
+  // nanosleep()ing to hold the 500khz clock
+  uint64_t throttle_ns;
+  // parked on idle loops and blocked ports
+  uint64_t idle_ns;
+};
+
+/// returns false (and zeroes `out`) when built without PICOVM_STATS
+extern bool
+picovm_get_stats(const struct picovm* vm, struct picovm_stats* out);
+
+/// writes the counters in the prometheus text format
+extern void
+picovm_write_stats(const struct picovm* vm, FILE* out);
+
+/// serves picovm_write_stats to every connection on a unix socket at `path`
+extern enum picovm_result
+picovm_stats_listen(struct picovm* vm, const char* path);
+
+extern void
+picovm_stats_close(struct picovm* vm);
+
+/// logs every port read and interrupt delivery into `path` against the cycle
+/// it happened at, until picovm_replay_stop. start right after
+/// picovm_load_rom so the log covers the whole run
+extern enum picovm_result
+picovm_record_start(struct picovm* vm, const char* path);
+
+/// feeds the guest the port reads and interrupts logged by
+/// picovm_record_start instead of asking its devices. runs unthrottled and
+/// never parks, the guest halts where the recording stopped
+extern enum picovm_result
+picovm_replay_start(struct picovm* vm, const char* path);
+
+/// finishes a recording, or ends a replay and restores the options
+extern void
+picovm_replay_stop(struct picovm* vm);
+
+/// histograms the time from a device seeing input to the guest isr
+/// starting, per interrupt source. start before running the instance
+extern enum picovm_result
+picovm_latency_start(struct picovm* vm);
+
+extern void
+picovm_latency_stop(struct picovm* vm);
+
+/// percentile table per source and stage, in microseconds
+/// the same histograms are part of picovm_write_stats
+extern void
+picovm_latency_write(const struct picovm* vm, FILE* out);
+
+/// asks a running instance to stop, safe to call from a signal handler
+extern void
+picovm_halt(struct picovm* vm);
+
+/// marks an interrupt as pending, safe to call from any thread
+extern void
+picovm_raise_interrupt(struct picovm* vm, enum picovm_interrupt src);
+
+/// picovm_raise_interrupt for a device that knows when its input arrived
+/// (CLOCK_MONOTONIC), so the wait before the raise shows up in the latency
+/// histograms. `arrived` may be NULL
+extern void
+picovm_raise_interrupt_at(struct picovm* vm,
+                          enum picovm_interrupt src,
+                          const struct timespec* arrived);
+
+/// blocks until `src` has been delivered to the guest
+extern void
+picovm_wait_interrupt(struct picovm* vm, enum picovm_interrupt src);
+
+extern enum picovm_result
+picovm_get_reg(const struct picovm* vm, int idx, uint16_t* out);
+
+extern enum picovm_result
+picovm_set_reg(struct picovm* vm, int idx, uint16_t val);
+
+extern uint16_t
+picovm_get_ip(const struct picovm* vm);
+
+extern void
+picovm_set_ip(struct picovm* vm, uint16_t ip);
+
+extern uint8_t
+picovm_get_flags(const struct picovm* vm);
+
+/// total cycles retired since the rom was loaded
+extern uint64_t
+picovm_cycles(const struct picovm* vm);
+
+/// the full 64kb of guest memory
+extern uint8_t*
+picovm_memory(struct picovm* vm);
+
+/// returns NULL for an invalid index
+extern const char*
+picovm_reg_name(int idx);
+
+extern const char*
+picovm_strerror(enum picovm_result res);
+
+/// how often the instance parked on an idle loop, and for how long
+extern void
+picovm_idle_time(const struct picovm* vm, unsigned long* parks, uint64_t* ns);
@@ -0,0 +1,269 @@
+/* profile.c
+
+        sample aggregation and report output for the sampling profiler
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "picovm.h"
+#include "profile.h"
+#include "symtab.h"
+#include "vm.h"
+
+#define PROFILE_INITIAL_STACKS 256
+
+extern struct profile*
+profile_new(uint64_t period)
+{
+  struct profile* p = calloc(1, sizeof(struct profile));
+  if (!p)
+    return NULL;
+
+  p->period = period;
+  p->cap = PROFILE_INITIAL_STACKS;
+  p->stacks = calloc(p->cap, sizeof(struct profile_stack));
+  if (!p->stacks) {
+    free(p);
+    return NULL;
+  }
+
+  return p;
+}
+
+extern void
+profile_free(struct profile* p)
+{
+  if (!p)
+    return;
+
+  free(p->stacks);
+  free(p);
+}
+
+static uint32_t
+hash_frames(const uint16_t* frames, int depth)
+{
+  // fnv-1a
+  uint32_t h = 2166136261u;
+  for (int i = 0; i < depth; i++) {
+    h = (h ^ (frames[i] & 0xFF)) * 16777619u;
+    h = (h ^ (frames[i] >> 8)) * 16777619u;
+  }
+  return h;
+}
+
+static struct profile_stack*
+find_slot(struct profile_stack* stacks,
+          size_t cap,
+          uint32_t hash,
+          const uint16_t* frames,
+          int depth)
+{
+  size_t i = hash & (cap - 1);
+
+  for (;;) {
+    struct profile_stack* s = &stacks[i];
+    if (s->count == 0)
+      return s;
+    if (s->hash == hash && s->depth == depth &&
+        memcmp(s->frames, frames, depth * sizeof(uint16_t)) == 0)
+      return s;
+    i = (i + 1) & (cap - 1);
+  }
+}
+
+static bool
+grow(struct profile* p)
+{
+  const size_t cap = p->cap * 2;
+  struct profile_stack* stacks = calloc(cap, sizeof(struct profile_stack));
+  if (!stacks)
+    return false;
+
+  for (size_t i = 0; i < p->cap; i++) {
+    const struct profile_stack* s = &p->stacks[i];
+    if (s->count)
+      *find_slot(stacks, cap, s->hash, s->frames, s->depth) = *s;
+  }
+
+  free(p->stacks);
+  p->stacks = stacks;
+  p->cap = cap;
+  return true;
+}
+
+extern void
+profile_sample(struct profile* p, uint16_t ip, uint64_t n)
+{
+  uint16_t frames[PROFILE_MAX_DEPTH + 1];
+  const int calls = p->depth < PROFILE_MAX_DEPTH ? p->depth : PROFILE_MAX_DEPTH;
+
+  p->samples += n;
+  p->flat[ip] += n;
+
+  memcpy(frames, p->shadow, calls * sizeof(uint16_t));
+  frames[calls] = ip;
+
+  // keep the table at most half full
+  if ((p->len + 1) * 2 > p->cap && !grow(p))
+    return;
+
+  const uint32_t hash = hash_frames(frames, calls + 1);
+  struct profile_stack* s =
+    find_slot(p->stacks, p->cap, hash, frames, calls + 1);
+
+  if (s->count == 0) {
+    s->hash = hash;
+    s->depth = calls + 1;
+    memcpy(s->frames, frames, (calls + 1) * sizeof(uint16_t));
+    p->len += 1;
+  }
+  s->count += n;
+}
+
+static void
+print_frame(FILE* out, const struct picovm_symtab* syms, uint16_t addr)
+{
+  const char* name = symtab_lookup(syms, addr);
+  if (name)
+    fputs(name, out);
+  else
+    fprintf(out, "%04Xh", addr);
+}
+
+struct flat_entry
+{
+  const char* name;
+  uint16_t addr;
+  uint64_t count;
+};
+
+static int
+flat_cmp(const void* left, const void* right)
+{
+  const struct flat_entry* l = left;
+  const struct flat_entry* r = right;
+  if (l->count != r->count)
+    return l->count < r->count ? 1 : -1;
+  return (int)l->addr - (int)r->addr;
+}
+
+/// self samples per label, or per address when there is no label for it
+static void
+write_flat(const struct profile* p,
+           const struct picovm_symtab* syms,
+           FILE* out)
+{
+  struct flat_entry* entries = malloc(RAMSIZE * sizeof(struct flat_entry));
+  size_t len = 0;
+
+  if (!entries)
+    return;
+
+  for (size_t addr = 0; addr < RAMSIZE; addr++) {
+    if (!p->flat[addr])
+      continue;
+
+    const char* name = symtab_lookup(syms, addr);
+
+    // addresses under one label are contiguous, so merge into the last one
+    if (name && len && entries[len - 1].name == name) {
+      entries[len - 1].count += p->flat[addr];
+      continue;
+    }
+
+    entries[len++] = (struct flat_entry){
+      .name = name,
+      .addr = addr,
+      .count = p->flat[addr],
+    };
+  }
+
+  qsort(entries, len, sizeof(struct flat_entry), flat_cmp);
+
+  fprintf(out, "%10s %7s  %s\n", "samples", "self", "symbol");
+  for (size_t i = 0; i < len; i++) {
+    fprintf(out,
+            "%10lu %6.2f%%  ",
+            (unsigned long)entries[i].count,
+            100.0 * entries[i].count / p->samples);
+    print_frame(out, syms, entries[i].addr);
+    fputc('\n', out);
+  }
+
+  free(entries);
+}
+
+/// one line per unique stack, in the format flamegraph.pl expects
+static void
+write_folded(const struct profile* p,
+             const struct picovm_symtab* syms,
+             FILE* out)
+{
+  for (size_t i = 0; i < p->cap; i++) {
+    const struct profile_stack* s = &p->stacks[i];
+    if (!s->count)
+      continue;
+
+    for (int f = 0; f < s->depth; f++) {
+      if (f)
+        fputc(';', out);
+      print_frame(out, syms, s->frames[f]);
+    }
+    fprintf(out, " %lu\n", (unsigned long)s->count);
+  }
+}
+
+extern enum picovm_result
+picovm_profile_start(struct picovm* vm, uint64_t period)
+{
+  picovm_profile_stop(vm);
+
+  if (period == 0)
+    period = 1;
+
+  vm->profile = profile_new(period);
+  if (!vm->profile)
+    return PICOVM_ERR_NOMEM;
+
+  vm->sample_at = vm->cycles + period;
+  return PICOVM_OK;
+}
+
+extern void
+picovm_profile_stop(struct picovm* vm)
+{
+  profile_free(vm->profile);
+  vm->profile = NULL;
+  vm->sample_at = UINT64_MAX;
+}
+
+extern enum picovm_result
+picovm_profile_write(struct picovm* vm,
+                     const struct picovm_symtab* syms,
+                     const char* flat_path,
+                     const char* folded_path)
+{
+  FILE* out;
+
+  if (!vm->profile)
+    return PICOVM_OK;
+
+  if (flat_path) {
+    if (!(out = fopen(flat_path, "w")))
+      return PICOVM_ERR_IO;
+    write_flat(vm->profile, syms, out);
+    fclose(out);
+  }
+
+  if (folded_path) {
+    if (!(out = fopen(folded_path, "w")))
+      return PICOVM_ERR_IO;
+    write_folded(vm->profile, syms, out);
+    fclose(out);
+  }
+
+  return PICOVM_OK;
+}
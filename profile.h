@@ -0,0 +1,70 @@
+#pragma once
+
+/* profile.h
+
+        sampling profiler
+        every `period` retired cycles the interpreter samples ip together
+        with a shadow of the guest call stack, kept up to date on
+        CALL/CALL_SHORT/CALLDYN/RET and interrupt entry/RTI. samples are
+        aggregated per address (flat) and per unique stack (folded).
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "defs.h"
+
+// frames kept per stack, deeper calls are still tracked but not sampled
+#define PROFILE_MAX_DEPTH 64
+
+struct profile_stack
+{
+  uint32_t hash;
+  uint64_t count;
+  uint16_t depth;
+  // call sites outermost first, the sampled ip last
+  uint16_t frames[PROFILE_MAX_DEPTH + 1];
+};
+
+struct profile
+{
+  uint64_t period;
+  uint64_t samples;
+
+  // call sites of the currently active calls
+  uint16_t shadow[PROFILE_MAX_DEPTH];
+  int depth;
+
+  // samples per ip
+  uint64_t flat[RAMSIZE];
+
+  // open addressing, cap is a power of two
+  struct profile_stack* stacks;
+  size_t cap, len;
+};
+
+extern struct profile*
+profile_new(uint64_t period);
+
+extern void
+profile_free(struct profile* p);
+
+/// `n` samples at `ip` and the current shadow stack, one per period an
+/// instruction crossed
+extern void
+profile_sample(struct profile* p, uint16_t ip, uint64_t n);
+
+__attribute__((always_inline)) static inline void
+profile_call(struct profile* p, uint16_t site)
+{
+  if (p->depth < PROFILE_MAX_DEPTH)
+    p->shadow[p->depth] = site;
+  p->depth += 1;
+}
+
+__attribute__((always_inline)) static inline void
+profile_ret(struct profile* p)
+{
+  if (p->depth > 0)
+    p->depth -= 1;
+}
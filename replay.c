@@ -0,0 +1,233 @@
+/* replay.c
+
+        reading and writing of record/replay logs
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "leb.h"
+#include "picovm.h"
+#include "replay.h"
+#include "vm.h"
+
+// the recorder runs on the vm thread, keep the write() calls rare
+#define REPLAY_BUFSIZE (1 << 16)
+
+static void
+put_event(struct replay* r, enum replay_kind kind, uint64_t cycles)
+{
+  putc(kind, r->file);
+  put_leb(r->file, cycles - r->last);
+  r->last = cycles;
+}
+
+extern void
+replay_log_in(struct replay* r, uint64_t cycles, uint8_t port, uint16_t val)
+{
+  put_event(r, REPLAY_IN, cycles);
+  putc(port, r->file);
+  put_leb(r->file, val);
+}
+
+extern void
+replay_log_load(struct replay* r, uint64_t cycles, uint16_t addr, uint16_t val)
+{
+  put_event(r, REPLAY_LOAD, cycles);
+  put_leb(r->file, addr);
+  put_leb(r->file, val);
+}
+
+extern void
+replay_log_int(struct replay* r, uint64_t cycles, unsigned src)
+{
+  put_event(r, REPLAY_INT, cycles);
+  putc(src, r->file);
+}
+
+static bool
+read_event(struct replay* r)
+{
+  uint64_t delta, addr, val;
+  int kind, c;
+
+  if ((kind = getc(r->file)) == EOF || !get_leb64(r->file, &delta))
+    return false;
+
+  r->next.kind = kind;
+  r->next.at = r->last + delta;
+
+  switch (kind) {
+    case REPLAY_IN:
+      if ((c = getc(r->file)) == EOF || !get_leb64(r->file, &val))
+        return false;
+      r->next.port = c;
+      r->next.val = val;
+      break;
+
+    case REPLAY_LOAD:
+      if (!get_leb64(r->file, &addr) || !get_leb64(r->file, &val))
+        return false;
+      r->next.addr = addr;
+      r->next.val = val;
+      break;
+
+    case REPLAY_INT:
+      if ((c = getc(r->file)) == EOF || c >= PICOVM_NUM_INTERRUPTS)
+        return false;
+      r->next.src = c;
+      break;
+
+    case REPLAY_END:
+      break;
+
+    default:
+      return false;
+  }
+
+  r->last = r->next.at;
+  return true;
+}
+
+extern void
+replay_advance(struct picovm* vm)
+{
+  struct replay* r = vm->replay;
+
+  if (r->next.kind == REPLAY_END || !read_event(r)) {
+    r->next.kind = REPLAY_NONE;
+    r->next.at = UINT64_MAX;
+  }
+
+  vm->replay_at = r->next.at;
+}
+
+extern enum picovm_io
+replay_port_in(struct picovm* vm, uint8_t port, uint16_t* val)
+{
+  struct replay* r = vm->replay;
+
+  if (r->next.kind != REPLAY_IN || r->next.at != vm->cycles ||
+      r->next.port != port) {
+    *val = 0xFFFF;
+    vm->fault = PICOVM_ERR_REPLAY;
+    vm->flags |= HALT_FLAG;
+    return PICOVM_IO_OK;
+  }
+
+  *val = r->next.val;
+  replay_advance(vm);
+  return PICOVM_IO_OK;
+}
+
+extern uint16_t
+replay_mmio_load(struct picovm* vm, uint16_t addr)
+{
+  struct replay* r = vm->replay;
+  uint16_t val;
+
+  if (r->next.kind != REPLAY_LOAD || r->next.at != vm->cycles ||
+      r->next.addr != addr) {
+    vm->fault = PICOVM_ERR_REPLAY;
+    vm->flags |= HALT_FLAG;
+    return 0xFFFF;
+  }
+
+  val = r->next.val;
+  replay_advance(vm);
+  return val;
+}
+
+static struct replay*
+replay_open(const char* path, bool recording)
+{
+  struct replay* r = calloc(1, sizeof(struct replay));
+  if (!r)
+    return NULL;
+
+  r->recording = recording;
+  r->file = fopen(path, recording ? "wb" : "rb");
+  if (!r->file) {
+    free(r);
+    return NULL;
+  }
+  setvbuf(r->file, NULL, _IOFBF, REPLAY_BUFSIZE);
+
+  return r;
+}
+
+extern enum picovm_result
+picovm_record_start(struct picovm* vm, const char* path)
+{
+  picovm_replay_stop(vm);
+
+  vm->replay = replay_open(path, true);
+  if (!vm->replay)
+    return PICOVM_ERR_IO;
+
+  vm->replay->last = vm->cycles;
+  fwrite(REPLAY_MAGIC, 1, 4, vm->replay->file);
+  putc(REPLAY_VERSION, vm->replay->file);
+
+  return PICOVM_OK;
+}
+
+extern enum picovm_result
+picovm_replay_start(struct picovm* vm, const char* path)
+{
+  char magic[4];
+  struct replay* r;
+
+  picovm_replay_stop(vm);
+
+  r = replay_open(path, false);
+  if (!r)
+    return PICOVM_ERR_IO;
+
+  if (fread(magic, 1, 4, r->file) != 4 ||
+      memcmp(magic, REPLAY_MAGIC, 4) != 0 ||
+      getc(r->file) != REPLAY_VERSION) {
+    fclose(r->file);
+    free(r);
+    return PICOVM_ERR_IO;
+  }
+
+  // the log stands in for wall clock time, neither wait nor park on it
+  r->opts = vm->opts;
+  vm->opts.unthrottled = true;
+  vm->opts.idle_park = false;
+  vm->opts.step_sleep = 0;
+
+  // from here on interrupts only come out of the log
+  pthread_mutex_lock(&vm->int_mutex);
+  atomic_store_explicit(&vm->int_pending, 0, memory_order_relaxed);
+  pthread_cond_broadcast(&vm->int_taken_cond);
+  pthread_mutex_unlock(&vm->int_mutex);
+
+  r->last = vm->cycles;
+  r->next.kind = REPLAY_IN;
+  vm->replay = r;
+  replay_advance(vm);
+
+  return PICOVM_OK;
+}
+
+extern void
+picovm_replay_stop(struct picovm* vm)
+{
+  struct replay* r = vm->replay;
+
+  if (!r)
+    return;
+
+  if (r->recording)
+    put_event(r, REPLAY_END, vm->cycles);
+  else
+    vm->opts = r->opts;
+
+  fclose(r->file);
+  free(r);
+  vm->replay = NULL;
+  vm->replay_at = UINT64_MAX;
+}
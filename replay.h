@@ -0,0 +1,88 @@
+#pragma once
+
+/* replay.h
+
+        deterministic record/replay
+        everything that reaches the guest from outside, port reads,
+        loads from memory mapped devices and interrupt deliveries, is logged
+        against the cycle count it happened at. replaying feeds the same
+        values back at the same cycles, no matter how devices, sockets or the
+        host scheduler behave that time.
+
+        file layout:
+          header  "PVMR", version byte
+          event   kind byte (enum replay_kind)
+                  leb128 cycles since the previous event
+                  REPLAY_IN:  port byte, leb128 value
+                  REPLAY_INT: interrupt source byte
+                  REPLAY_LOAD: leb128 address, leb128 value
+                  REPLAY_END: nothing, the recorded run stopped here
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "picovm.h"
+
+#define REPLAY_MAGIC "PVMR"
+#define REPLAY_VERSION 1
+
+enum replay_kind
+{
+  REPLAY_IN,
+  REPLAY_INT,
+  REPLAY_END,
+  REPLAY_LOAD,
+
+  // replaying only: the log ran out without an end, nothing more will come
+  REPLAY_NONE,
+};
+
+struct replay
+{
+  FILE* file;
+  bool recording;
+
+  // cycle count of the previous event
+  uint64_t last;
+
+  // replaying only: the event after the ones already fed to the guest
+  struct
+  {
+    enum replay_kind kind;
+    uint64_t at;
+    uint8_t port;
+    uint8_t src;
+    uint16_t addr;
+    uint16_t val;
+  } next;
+
+  // options of the instance before replaying forced them, restored on stop
+  struct picovm_options opts;
+};
+
+struct picovm;
+
+extern void
+replay_log_in(struct replay* r, uint64_t cycles, uint8_t port, uint16_t val);
+
+extern void
+replay_log_load(struct replay* r, uint64_t cycles, uint16_t addr, uint16_t val);
+
+extern void
+replay_log_int(struct replay* r, uint64_t cycles, unsigned src);
+
+/// reads the next event and points vm->replay_at at it
+extern void
+replay_advance(struct picovm* vm);
+
+/// hands the guest the port read that was recorded at this point
+/// faults the instance if the log expected something else
+extern enum picovm_io
+replay_port_in(struct picovm* vm, uint8_t port, uint16_t* val);
+
+/// hands the guest the device load that was recorded at this point
+/// faults the instance if the log expected something else
+extern uint16_t
+replay_mmio_load(struct picovm* vm, uint16_t addr);
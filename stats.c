@@ -0,0 +1,196 @@
+#define _POSIX_C_SOURCE 199309L
+
+/* stats.c
+
+        text exposition of the instance counters, and the unix socket
+        monitoring scrapes them from
+*/
+
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "latency.h"
+#include "picovm.h"
+#include "stats.h"
+#include "vm.h"
+
+// how often the server thread checks whether it should stop
+#define STATS_POLL_MS 100
+
+extern bool
+picovm_get_stats(const struct picovm* vm, struct picovm_stats* out)
+{
+#ifdef PICOVM_STATS
+  *out = vm->stats;
+  out->idle_ns = (uint64_t)vm->idle.parked.tv_sec * 1000000000 +
+                 (uint64_t)vm->idle.parked.tv_nsec;
+  return true;
+#else
+  (void)vm;
+  memset(out, 0, sizeof(struct picovm_stats));
+  return false;
+#endif
+}
+
+static void
+write_counter(FILE* out, const char* name, const char* help)
+{
+  fprintf(out, "# HELP %s %s\n# TYPE %s counter\n", name, help, name);
+}
+
+extern void
+picovm_write_stats(const struct picovm* vm, FILE* out)
+{
+  struct picovm_stats st;
+  unsigned long parks;
+  uint64_t idle_ns;
+
+  picovm_idle_time(vm, &parks, &idle_ns);
+
+  write_counter(out, "picovm_cycles_total", "cycles retired");
+  fprintf(out, "picovm_cycles_total %lu\n", (unsigned long)vm->cycles);
+
+  write_counter(out, "picovm_idle_seconds_total", "time spent parked");
+  fprintf(out, "picovm_idle_seconds_total %.9f\n", idle_ns / 1e9);
+
+  if (vm->latency)
+    latency_write_prometheus(vm->latency, out);
+
+  if (!picovm_get_stats(vm, &st))
+    return;
+
+  write_counter(
+    out, "picovm_instructions_retired_total", "instructions per opcode");
+  for (int op = 0; op < 256; op++)
+    if (st.retired[op])
+      fprintf(out,
+              "picovm_instructions_retired_total{op=\"%02X\"} %lu\n",
+              op,
+              (unsigned long)st.retired[op]);
+
+  write_counter(out, "picovm_branches_total", "conditional branches");
+  fprintf(out,
+          "picovm_branches_total{taken=\"true\"} %lu\n"
+          "picovm_branches_total{taken=\"false\"} %lu\n",
+          (unsigned long)st.branches_taken,
+          (unsigned long)st.branches_not_taken);
+
+  write_counter(out, "picovm_interrupts_total", "interrupts delivered");
+  for (int i = 0; i < PICOVM_NUM_INTERRUPTS; i++)
+    fprintf(out,
+            "picovm_interrupts_total{source=\"p%i\"} %lu\n",
+            i,
+            (unsigned long)st.interrupts[i]);
+
+  write_counter(out, "picovm_port_bytes_total", "bytes moved through ports");
+  fprintf(out,
+          "picovm_port_bytes_total{dir=\"in\"} %lu\n"
+          "picovm_port_bytes_total{dir=\"out\"} %lu\n",
+          (unsigned long)st.port_bytes_in,
+          (unsigned long)st.port_bytes_out);
+
+  write_counter(
+    out, "picovm_mmio_accesses_total", "loads and stores sent to devices");
+  fprintf(out,
+          "picovm_mmio_accesses_total{dir=\"in\"} %lu\n"
+          "picovm_mmio_accesses_total{dir=\"out\"} %lu\n",
+          (unsigned long)st.mmio_loads,
+          (unsigned long)st.mmio_stores);
+
+  write_counter(
+    out, "picovm_throttle_seconds_total", "time slept to hold the clock");
+  fprintf(out, "picovm_throttle_seconds_total %.9f\n", st.throttle_ns / 1e9);
+}
+
+static void*
+stats_server_thread(void* arg)
+{
+  struct stats_server* srv = arg;
+  struct pollfd pfd = { .fd = srv->sock, .events = POLLIN };
+
+  while (!atomic_load(&srv->stop)) {
+    if (poll(&pfd, 1, STATS_POLL_MS) <= 0)
+      continue;
+
+    int conn = accept(srv->sock, NULL, NULL);
+    if (conn < 0)
+      continue;
+
+    FILE* out = fdopen(conn, "w");
+    if (!out) {
+      close(conn);
+      continue;
+    }
+
+    picovm_write_stats(srv->vm, out);
+    fclose(out);
+  }
+
+  return NULL;
+}
+
+extern enum picovm_result
+picovm_stats_listen(struct picovm* vm, const char* path)
+{
+  struct stats_server* srv;
+
+  picovm_stats_close(vm);
+
+  if (strlen(path) >= sizeof(srv->addr.sun_path))
+    return PICOVM_ERR_IO;
+
+  srv = calloc(1, sizeof(struct stats_server));
+  if (!srv)
+    return PICOVM_ERR_NOMEM;
+
+  srv->vm = vm;
+  atomic_init(&srv->stop, false);
+
+  srv->addr.sun_family = AF_UNIX;
+  strcpy(srv->addr.sun_path, path);
+
+  srv->sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (srv->sock < 0)
+    goto fail;
+
+  // a socket left behind by an earlier run would make bind fail
+  unlink(path);
+  if (bind(srv->sock,
+           (const struct sockaddr*)&srv->addr,
+           sizeof(srv->addr)) < 0 ||
+      listen(srv->sock, 4) < 0)
+    goto fail_sock;
+
+  if (pthread_create(&srv->thread, NULL, stats_server_thread, srv) != 0)
+    goto fail_sock;
+
+  vm->stats_server = srv;
+  return PICOVM_OK;
+
+fail_sock:
+  close(srv->sock);
+fail:
+  free(srv);
+  return PICOVM_ERR_IO;
+}
+
+extern void
+picovm_stats_close(struct picovm* vm)
+{
+  struct stats_server* srv = vm->stats_server;
+
+  if (!srv)
+    return;
+
+  atomic_store(&srv->stop, true);
+  pthread_join(srv->thread, NULL);
+  close(srv->sock);
+  unlink(srv->addr.sun_path);
+  free(srv);
+  vm->stats_server = NULL;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+/* stats.h
+
+        hot-path counters, only compiled in with -DPICOVM_STATS
+        (set STATS=y in tup.config). counters are plain per-instance
+        integers bumped by the thread running the instance, readers on
+        other threads may see slightly stale values.
+*/
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/un.h>
+
+#include "picovm.h"
+
+#ifdef PICOVM_STATS
+#define STAT(...) __VA_ARGS__
+#else
+#define STAT(...)
+#endif
+
+/// serves picovm_write_stats over a unix socket, one dump per connection
+struct stats_server
+{
+  struct picovm* vm;
+  struct sockaddr_un addr;
+  int sock;
+  pthread_t thread;
+  atomic_bool stop;
+};
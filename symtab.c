@@ -0,0 +1,246 @@
+/* symtab.c
+
+        loads the assembler's label map or sidecar and looks addresses up
+        in it, see symtab.h
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "leb.h"
+#include "picovm.h"
+#include "symtab.h"
+
+// longest label the loader accepts
+#define SYMTAB_MAX_NAME 256
+#define SYMTAB_ADDRS (UINT16_MAX + 1)
+// most files, labels or lines a sidecar may claim to have
+#define SYMTAB_MAX_ENTRIES (1 << 20)
+
+static int
+symtab_cmp(const void* left, const void* right)
+{
+  const struct symtab_entry* l = left;
+  const struct symtab_entry* r = right;
+  return (int)l->addr - (int)r->addr;
+}
+
+/// a length and that many bytes as a string, NULL if it does not read
+static char*
+read_string(FILE* f)
+{
+  uint32_t len;
+  char* str;
+
+  if (!get_leb(f, &len) || len > UINT16_MAX || !(str = malloc(len + 1)))
+    return NULL;
+  if (fread(str, 1, len, f) != len || memchr(str, 0, len)) {
+    free(str);
+    return NULL;
+  }
+  str[len] = 0;
+  return str;
+}
+
+static bool
+load_map(FILE* file, struct picovm_symtab* tab)
+{
+  size_t cap = 64;
+  unsigned addr;
+  char name[SYMTAB_MAX_NAME];
+
+  tab->syms = malloc(cap * sizeof(struct symtab_entry));
+  if (!tab->syms)
+    return false;
+
+  while (fscanf(file, "%x %255s", &addr, name) == 2) {
+    if (tab->len == cap) {
+      cap *= 2;
+      void* grown = realloc(tab->syms, cap * sizeof(struct symtab_entry));
+      if (!grown)
+        return false;
+      tab->syms = grown;
+    }
+
+    tab->syms[tab->len].addr = (uint16_t)addr;
+    tab->syms[tab->len].name = malloc(strlen(name) + 1);
+    if (!tab->syms[tab->len].name)
+      return false;
+    strcpy(tab->syms[tab->len].name, name);
+    tab->len += 1;
+  }
+
+  qsort(tab->syms, tab->len, sizeof(struct symtab_entry), symtab_cmp);
+  return true;
+}
+
+/// the sidecar after its header, every count checked before it is trusted
+static bool
+load_sidecar(FILE* file, struct picovm_symtab* tab)
+{
+  uint32_t n, v;
+  uint16_t addr = 0;
+
+  if (!get_leb(file, &n) || n > SYMTAB_MAX_ENTRIES ||
+      !(tab->files = calloc(n ? n : 1, sizeof(char*))))
+    return false;
+  for (; tab->num_files < n; tab->num_files++)
+    if (!(tab->files[tab->num_files] = read_string(file)))
+      return false;
+
+  if (!get_leb(file, &n) || n > SYMTAB_MAX_ENTRIES ||
+      !(tab->syms = calloc(n ? n : 1, sizeof(struct symtab_entry))))
+    return false;
+  for (; tab->len < n; tab->len++) {
+    struct symtab_entry* e = &tab->syms[tab->len];
+
+    if (!get_leb(file, &v) || v > UINT16_MAX ||
+        (tab->len && v < tab->syms[tab->len - 1].addr) ||
+        !(e->name = read_string(file)))
+      return false;
+    e->addr = (uint16_t)v;
+  }
+
+  if (!get_leb(file, &n) || n > SYMTAB_MAX_ENTRIES ||
+      !(tab->lines = calloc(n ? n : 1, sizeof(struct symtab_line))))
+    return false;
+  for (; tab->num_lines < n; tab->num_lines++) {
+    struct symtab_line* l = &tab->lines[tab->num_lines];
+
+    if (!get_leb(file, &v) || v > (uint32_t)(UINT16_MAX - addr) ||
+        !get_leb(file, &l->file) || !get_leb(file, &l->line) ||
+        !get_leb(file, &l->col) || l->file >= tab->num_files)
+      return false;
+    l->addr = addr += (uint16_t)v;
+  }
+
+  return true;
+}
+
+/// the per address tables, later entries at an address win
+static bool
+build_index(struct picovm_symtab* tab)
+{
+  size_t s = 0, l = 0;
+
+  tab->sym_at = malloc(SYMTAB_ADDRS * sizeof(uint32_t));
+  tab->line_at = malloc(SYMTAB_ADDRS * sizeof(uint32_t));
+  if (!tab->sym_at || !tab->line_at)
+    return false;
+
+  for (uint32_t addr = 0; addr < SYMTAB_ADDRS; addr++) {
+    while (s < tab->len && tab->syms[s].addr <= addr)
+      s++;
+    while (l < tab->num_lines && tab->lines[l].addr <= addr)
+      l++;
+    tab->sym_at[addr] = (uint32_t)s;
+    tab->line_at[addr] = (uint32_t)l;
+  }
+
+  return true;
+}
+
+extern struct picovm_symtab*
+picovm_symtab_load(const char* path)
+{
+  FILE* file;
+  struct picovm_symtab* tab;
+  uint8_t header[5];
+  bool ok;
+
+  file = fopen(path, "rb");
+  if (!file)
+    return NULL;
+
+  tab = calloc(1, sizeof(struct picovm_symtab));
+  if (!tab)
+    goto fail;
+
+  if (fread(header, 1, sizeof(header), file) == sizeof(header) &&
+      memcmp(header, SYMTAB_MAGIC, 4) == 0) {
+    ok = header[4] == SYMTAB_VERSION && load_sidecar(file, tab);
+  } else {
+    rewind(file);
+    ok = load_map(file, tab);
+  }
+
+  if (!ok || !build_index(tab))
+    goto fail;
+
+  fclose(file);
+  return tab;
+
+fail:
+  fclose(file);
+  picovm_symtab_free(tab);
+  return NULL;
+}
+
+extern void
+picovm_symtab_free(struct picovm_symtab* tab)
+{
+  if (!tab)
+    return;
+
+  for (size_t i = 0; i < tab->len; i++)
+    free(tab->syms[i].name);
+  for (size_t i = 0; i < tab->num_files; i++)
+    free(tab->files[i]);
+  free(tab->syms);
+  free(tab->lines);
+  free(tab->files);
+  free(tab->sym_at);
+  free(tab->line_at);
+  free(tab);
+}
+
+extern const char*
+symtab_lookup(const struct picovm_symtab* tab, uint16_t addr)
+{
+  if (!tab || !tab->sym_at[addr])
+    return NULL;
+  return tab->syms[tab->sym_at[addr] - 1].name;
+}
+
+extern const struct symtab_line*
+symtab_line(const struct picovm_symtab* tab, uint16_t addr)
+{
+  if (!tab || !tab->line_at[addr])
+    return NULL;
+  return &tab->lines[tab->line_at[addr] - 1];
+}
+
+extern int
+picovm_symtab_describe(const struct picovm_symtab* tab,
+                       uint16_t addr,
+                       char* buf,
+                       size_t len)
+{
+  const char* name = symtab_lookup(tab, addr);
+  const struct symtab_line* line = symtab_line(tab, addr);
+  int n = 0;
+
+  if (len)
+    *buf = 0;
+
+  if (name) {
+    const uint16_t at = tab->syms[tab->sym_at[addr] - 1].addr;
+    n = snprintf(buf,
+                 len,
+                 at == addr ? "%s" : "%s+%u",
+                 name,
+                 (unsigned)(addr - at));
+  }
+
+  if (line && n >= 0 && (size_t)n < len)
+    n += snprintf(buf + n,
+                  len - n,
+                  "%s%s:%u:%u",
+                  n ? " " : "",
+                  tab->files[line->file],
+                  (unsigned)line->line,
+                  (unsigned)line->col);
+
+  return n;
+}
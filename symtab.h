@@ -0,0 +1,67 @@
+#pragma once
+
+/* symtab.h
+
+        label and line table for symbolizing guest addresses
+        loaded from either
+          - the label map the assembler writes with -m, one "ADDR label"
+            pair per line, ADDR in hex
+          - the binary sidecar the assembler writes next to every rom,
+            which also knows the source line of every instruction
+
+        lookups index a table with an entry per address, built on load, so
+        they cost the same however many labels there are.
+
+        sidecar layout, every number leb128:
+          header  "PVMS", version byte
+          files   count, then per source file its length and bytes
+          labels  count, then per label address, length and bytes, by
+                  address
+          lines   count, then per instruction its address as the delta from
+                  the one before, file index, line and column (1 based), by
+                  address
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SYMTAB_MAGIC "PVMS"
+#define SYMTAB_VERSION 1
+
+struct picovm_symtab
+{
+  struct symtab_entry
+  {
+    uint16_t addr;
+    char* name;
+  }* syms;
+
+  // sorted by addr
+  size_t len;
+
+  struct symtab_line
+  {
+    uint16_t addr;
+    uint32_t file, line, col;
+  }* lines;
+
+  // sorted by addr, empty for a label map
+  size_t num_lines;
+
+  char** files;
+  size_t num_files;
+
+  // per address index + 1 into syms of the closest label at or below it,
+  // and into lines of the closest instruction at or below it, 0 if none
+  uint32_t* sym_at;
+  uint32_t* line_at;
+};
+
+/// the closest label at or below `addr`, NULL if there is none
+extern const char*
+symtab_lookup(const struct picovm_symtab* tab, uint16_t addr);
+
+/// the source line of the instruction at or closest below `addr`, NULL if
+/// there is none. its file is tab->files[line->file]
+extern const struct symtab_line*
+symtab_line(const struct picovm_symtab* tab, uint16_t addr);
@@ -0,0 +1,172 @@
+#define _POSIX_C_SOURCE 199309L
+
+/* trace.c
+
+        writer thread and decoder for the binary execution trace
+        see trace.h for the format
+*/
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "leb.h"
+#include "trace.h"
+
+// how long the writer naps when the ring is empty
+#define TRACE_WRITER_NAP_NS 1000000
+
+/// writes out everything between tail and head, returns false if empty
+static bool
+trace_flush(struct trace* t)
+{
+  const size_t head = atomic_load_explicit(&t->head, memory_order_acquire);
+  size_t tail = atomic_load_explicit(&t->tail, memory_order_relaxed);
+
+  if (head == tail)
+    return false;
+
+  while (tail != head) {
+    const size_t at = tail & (TRACE_RING_SIZE - 1);
+    size_t len = head - tail;
+
+    // split at the end of the ring
+    if (at + len > TRACE_RING_SIZE)
+      len = TRACE_RING_SIZE - at;
+
+    fwrite(&t->ring[at], 1, len, t->out);
+    tail += len;
+  }
+
+  atomic_store_explicit(&t->tail, tail, memory_order_release);
+  return true;
+}
+
+static void*
+trace_writer(void* arg)
+{
+  struct trace* t = arg;
+  const struct timespec nap = { .tv_sec = 0, .tv_nsec = TRACE_WRITER_NAP_NS };
+
+  while (!atomic_load_explicit(&t->stop, memory_order_acquire)) {
+    if (!trace_flush(t))
+      nanosleep(&nap, NULL);
+  }
+
+  trace_flush(t);
+  return NULL;
+}
+
+extern struct trace*
+trace_open(const char* path, bool regs)
+{
+  struct trace* t = calloc(1, sizeof(struct trace));
+  if (!t)
+    return NULL;
+
+  t->ring = malloc(TRACE_RING_SIZE);
+  t->out = fopen(path, "wb");
+  if (!t->ring || !t->out)
+    goto fail;
+
+  const uint8_t header[] = {
+    TRACE_MAGIC[0], TRACE_MAGIC[1], TRACE_MAGIC[2], TRACE_MAGIC[3],
+    TRACE_VERSION,  regs ? TRACE_FLAG_REGS : 0,
+  };
+  fwrite(header, 1, sizeof(header), t->out);
+
+  t->regs = regs;
+  // the first record carries a delta from 0, and every non-zero register
+  t->last_ip = 0;
+  memset(t->last_rs, 0, sizeof(t->last_rs));
+
+  atomic_init(&t->head, 0);
+  atomic_init(&t->tail, 0);
+  atomic_init(&t->stop, false);
+
+  if (pthread_create(&t->writer, NULL, trace_writer, t) != 0)
+    goto fail;
+
+  return t;
+
+fail:
+  if (t->out)
+    fclose(t->out);
+  free(t->ring);
+  free(t);
+  return NULL;
+}
+
+extern void
+trace_close(struct trace* t)
+{
+  atomic_store_explicit(&t->stop, true, memory_order_release);
+  pthread_join(t->writer, NULL);
+
+  fclose(t->out);
+  free(t->ring);
+  free(t);
+}
+
+extern void
+trace_wait_room(struct trace* t)
+{
+  const size_t head = atomic_load_explicit(&t->head, memory_order_relaxed);
+
+  do {
+    sched_yield();
+    t->cached_tail = atomic_load_explicit(&t->tail, memory_order_acquire);
+  } while (head - t->cached_tail > TRACE_RING_SIZE - TRACE_MAX_RECORD);
+}
+
+extern bool
+trace_decode(FILE* in, FILE* out, const struct picovm_symtab* syms)
+{
+  char where[256];
+  uint8_t header[6];
+  uint16_t ip = 0;
+  uint16_t rs[PICOVM_NUM_REGS] = { 0 };
+  uint32_t zz, mask;
+  unsigned long n = 0;
+  int op;
+
+  if (fread(header, 1, sizeof(header), in) != sizeof(header) ||
+      memcmp(header, TRACE_MAGIC, 4) != 0 || header[4] != TRACE_VERSION)
+    return false;
+
+  const bool regs = header[5] & TRACE_FLAG_REGS;
+
+  while ((op = fgetc(in)) != EOF) {
+    if (!get_leb(in, &zz))
+      break;
+    ip += (uint16_t)((zz >> 1) ^ -(zz & 1));
+
+    fprintf(out, "%8lu | ip = %04Xh; op = %02Xh", n++, ip, op);
+    if (picovm_symtab_describe(syms, ip, where, sizeof(where)))
+      fprintf(out, " <%s>", where);
+
+    if (regs) {
+      if (!get_leb(in, &mask))
+        break;
+      for (int i = 0; i < PICOVM_NUM_REGS; i++) {
+        if (!(mask & (1u << i)))
+          continue;
+        const int lo = fgetc(in);
+        const int hi = fgetc(in);
+        if (hi == EOF)
+          return true;
+        rs[i] = (uint16_t)(lo | hi << 8);
+        fprintf(out, "; %s = %04Xh", picovm_reg_name(i), rs[i]);
+      }
+    }
+
+    fputc('\n', out);
+  }
+
+  return true;
+}
@@ -0,0 +1,129 @@
+#pragma once
+
+/* trace.h
+
+        binary execution trace
+        the interpreter appends one compact record per retired instruction
+        into a ring owned by the instance (and so by whichever thread is
+        running it). a writer thread streams the ring to a file, and
+        trace_decode turns that file back into text.
+
+        file layout:
+          header  "PVMT", version byte, flags byte (TRACE_FLAG_*)
+          record  opcode byte
+                  zigzag leb128 delta of ip from the previous record
+                  if TRACE_FLAG_REGS: leb128 mask of registers that changed,
+                  then each changed register as a little endian short
+*/
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "picovm.h"
+
+#define TRACE_MAGIC "PVMT"
+#define TRACE_VERSION 1
+#define TRACE_FLAG_REGS 0x01
+
+// must be a power of two
+#define TRACE_RING_SIZE (1 << 20)
+
+// opcode + ip delta + reg mask + every register
+#define TRACE_MAX_RECORD (1 + 3 + 3 + PICOVM_NUM_REGS * 2)
+
+struct trace
+{
+  uint8_t* ring;
+
+  // head is only written by the vm thread, tail only by the writer
+  atomic_size_t head;
+  atomic_size_t tail;
+  // the vm thread's last look at tail, refreshed only when the ring looks full
+  size_t cached_tail;
+
+  uint16_t last_ip;
+  uint16_t last_rs[PICOVM_NUM_REGS];
+  bool regs;
+
+  FILE* out;
+  pthread_t writer;
+  atomic_bool stop;
+};
+
+/// returns NULL if the file or writer thread could not be set up
+extern struct trace*
+trace_open(const char* path, bool regs);
+
+/// drains whatever is left in the ring, then closes the file
+extern void
+trace_close(struct trace* t);
+
+/// reads a trace file from `in` and prints it as text into `out`, with the
+/// label and source line of every ip if `syms` is not NULL
+/// returns false if `in` is not a trace file
+extern bool
+trace_decode(FILE* in, FILE* out, const struct picovm_symtab* syms);
+
+// blocks until the writer has made room, only called when the ring is full
+extern void
+trace_wait_room(struct trace* t);
+
+__attribute__((always_inline)) static inline size_t
+trace_put_leb(uint8_t* ring, size_t at, uint32_t v)
+{
+  while (v >= 0x80) {
+    ring[at++ & (TRACE_RING_SIZE - 1)] = (uint8_t)(v | 0x80);
+    v >>= 7;
+  }
+  ring[at++ & (TRACE_RING_SIZE - 1)] = (uint8_t)v;
+  return at;
+}
+
+__attribute__((always_inline)) static inline void
+trace_record(struct trace* t, uint16_t ip, uint8_t op, const uint16_t* rs)
+{
+  size_t head = atomic_load_explicit(&t->head, memory_order_relaxed);
+
+  if (head - t->cached_tail > TRACE_RING_SIZE - TRACE_MAX_RECORD) {
+    t->cached_tail = atomic_load_explicit(&t->tail, memory_order_acquire);
+    if (head - t->cached_tail > TRACE_RING_SIZE - TRACE_MAX_RECORD)
+      trace_wait_room(t);
+  }
+
+  const int32_t delta = (int16_t)(ip - t->last_ip);
+  t->last_ip = ip;
+
+  t->ring[head++ & (TRACE_RING_SIZE - 1)] = op;
+  head = trace_put_leb(
+    t->ring, head, ((uint32_t)delta << 1) ^ (uint32_t)(delta >> 31));
+
+  if (t->regs) {
+    // most instructions touch one register, so compare four at a time
+    uint64_t now[PICOVM_NUM_REGS / 4], last[PICOVM_NUM_REGS / 4];
+    uint32_t mask = 0;
+    memcpy(now, rs, sizeof(now));
+    memcpy(last, t->last_rs, sizeof(last));
+    for (int c = 0; c < PICOVM_NUM_REGS / 4; c++) {
+      if (now[c] == last[c])
+        continue;
+      for (int i = c * 4; i < c * 4 + 4; i++)
+        mask |= (uint32_t)(rs[i] != t->last_rs[i]) << i;
+    }
+
+    head = trace_put_leb(t->ring, head, mask);
+    while (mask) {
+      const int i = __builtin_ctz(mask);
+      mask &= mask - 1;
+      t->ring[head++ & (TRACE_RING_SIZE - 1)] = (uint8_t)rs[i];
+      t->ring[head++ & (TRACE_RING_SIZE - 1)] = (uint8_t)(rs[i] >> 8);
+      t->last_rs[i] = rs[i];
+    }
+  }
+
+  atomic_store_explicit(&t->head, head, memory_order_release);
+}
@@ -0,0 +1,442 @@
+/* vector.c
+
+        scalar, sse2 and avx2 kernels for the packed lane ops
+        the simd kernels do whole registers and leave the tail to the
+        next narrower table. short lanes are big endian in guest ram,
+        so they are byte swapped into host order wherever carries or
+        ordering matter.
+*/
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "vector.h"
+#include "vm.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define VECTOR_X86
+#include <immintrin.h>
+#endif
+
+static inline uint16_t
+load_be16(const uint8_t* p)
+{
+  return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static inline void
+store_be16(uint8_t* p, uint16_t v)
+{
+  p[0] = (uint8_t)(v >> 8);
+  p[1] = (uint8_t)v;
+}
+
+// scalar, the reference every other table has to agree with
+
+static uint16_t
+scalar_add8(uint8_t* a, const uint8_t* b, size_t n)
+{
+  for (size_t i = 0; i < n; i++)
+    a[i] += b[i];
+  return 0;
+}
+
+static uint16_t
+scalar_add16(uint8_t* a, const uint8_t* b, size_t n)
+{
+  for (size_t i = 0; i < n * 2; i += 2)
+    store_be16(a + i, load_be16(a + i) + load_be16(b + i));
+  return 0;
+}
+
+static uint16_t
+scalar_xor8(uint8_t* a, const uint8_t* b, size_t n)
+{
+  for (size_t i = 0; i < n; i++)
+    a[i] ^= b[i];
+  return 0;
+}
+
+static uint16_t
+scalar_xor16(uint8_t* a, const uint8_t* b, size_t n)
+{
+  return scalar_xor8(a, b, n * 2);
+}
+
+static uint16_t
+scalar_cmpeq8(uint8_t* a, const uint8_t* b, size_t n)
+{
+  for (size_t i = 0; i < n; i++)
+    a[i] = a[i] == b[i] ? 0xFF : 0x00;
+  return 0;
+}
+
+static uint16_t
+scalar_cmpeq16(uint8_t* a, const uint8_t* b, size_t n)
+{
+  for (size_t i = 0; i < n * 2; i += 2)
+    store_be16(a + i, load_be16(a + i) == load_be16(b + i) ? 0xFFFF : 0);
+  return 0;
+}
+
+static uint16_t
+scalar_min8(uint8_t* a, const uint8_t* b, size_t n)
+{
+  for (size_t i = 0; i < n; i++)
+    a[i] = a[i] < b[i] ? a[i] : b[i];
+  return 0;
+}
+
+static uint16_t
+scalar_min16(uint8_t* a, const uint8_t* b, size_t n)
+{
+  for (size_t i = 0; i < n * 2; i += 2) {
+    const uint16_t x = load_be16(a + i), y = load_be16(b + i);
+    store_be16(a + i, x < y ? x : y);
+  }
+  return 0;
+}
+
+static uint16_t
+scalar_max8(uint8_t* a, const uint8_t* b, size_t n)
+{
+  for (size_t i = 0; i < n; i++)
+    a[i] = a[i] > b[i] ? a[i] : b[i];
+  return 0;
+}
+
+static uint16_t
+scalar_max16(uint8_t* a, const uint8_t* b, size_t n)
+{
+  for (size_t i = 0; i < n * 2; i += 2) {
+    const uint16_t x = load_be16(a + i), y = load_be16(b + i);
+    store_be16(a + i, x > y ? x : y);
+  }
+  return 0;
+}
+
+static uint16_t
+scalar_sum8(uint8_t* a, const uint8_t* b, size_t n)
+{
+  uint16_t sum = 0;
+
+  (void)b;
+  for (size_t i = 0; i < n; i++)
+    sum += a[i];
+  return sum;
+}
+
+static uint16_t
+scalar_sum16(uint8_t* a, const uint8_t* b, size_t n)
+{
+  uint16_t sum = 0;
+
+  (void)b;
+  for (size_t i = 0; i < n * 2; i += 2)
+    sum += load_be16(a + i);
+  return sum;
+}
+
+const struct vector_kernels vector_scalar = {
+  .name = "scalar",
+  .k = {
+    [VECTOR_ADD] = { scalar_add8, scalar_add16 },
+    [VECTOR_XOR] = { scalar_xor8, scalar_xor16 },
+    [VECTOR_CMPEQ] = { scalar_cmpeq8, scalar_cmpeq16 },
+    [VECTOR_MIN] = { scalar_min8, scalar_min16 },
+    [VECTOR_MAX] = { scalar_max8, scalar_max16 },
+    [VECTOR_SUM] = { scalar_sum8, scalar_sum16 },
+  },
+};
+
+#ifdef VECTOR_X86
+
+#define SSE2 __attribute__((target("sse2")))
+#define AVX2 __attribute__((target("avx2")))
+
+// sse2, 16 bytes at a time
+
+static SSE2 inline __m128i
+sse2_bswap16(__m128i x)
+{
+  return _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+}
+
+static SSE2 inline __m128i
+sse2_add16_v(__m128i x, __m128i y)
+{
+  return sse2_bswap16(_mm_add_epi16(sse2_bswap16(x), sse2_bswap16(y)));
+}
+
+// sse2 has no unsigned 16 bit min/max, a - sat(a - b) and b + sat(a - b)
+static SSE2 inline __m128i
+sse2_min16_v(__m128i x, __m128i y)
+{
+  x = sse2_bswap16(x);
+  y = sse2_bswap16(y);
+  return sse2_bswap16(_mm_sub_epi16(x, _mm_subs_epu16(x, y)));
+}
+
+static SSE2 inline __m128i
+sse2_max16_v(__m128i x, __m128i y)
+{
+  x = sse2_bswap16(x);
+  y = sse2_bswap16(y);
+  return sse2_bswap16(_mm_add_epi16(y, _mm_subs_epu16(x, y)));
+}
+
+#define SSE2_BINARY(name, lane, fn)                                            \
+  static SSE2 uint16_t sse2_##name(uint8_t* a, const uint8_t* b, size_t n)     \
+  {                                                                            \
+    const size_t len = n * (lane);                                             \
+    size_t i = 0;                                                              \
+    for (; i + 16 <= len; i += 16) {                                           \
+      const __m128i x = _mm_loadu_si128((const __m128i*)(a + i));              \
+      const __m128i y = _mm_loadu_si128((const __m128i*)(b + i));              \
+      _mm_storeu_si128((__m128i*)(a + i), fn(x, y));                           \
+    }                                                                          \
+    return scalar_##name(a + i, b + i, (len - i) / (lane));                    \
+  }
+
+SSE2_BINARY(add8, 1, _mm_add_epi8)
+SSE2_BINARY(add16, 2, sse2_add16_v)
+SSE2_BINARY(xor8, 1, _mm_xor_si128)
+SSE2_BINARY(xor16, 2, _mm_xor_si128)
+SSE2_BINARY(cmpeq8, 1, _mm_cmpeq_epi8)
+SSE2_BINARY(cmpeq16, 2, _mm_cmpeq_epi16)
+SSE2_BINARY(min8, 1, _mm_min_epu8)
+SSE2_BINARY(min16, 2, sse2_min16_v)
+SSE2_BINARY(max8, 1, _mm_max_epu8)
+SSE2_BINARY(max16, 2, sse2_max16_v)
+
+static SSE2 uint16_t
+sse2_sum8(uint8_t* a, const uint8_t* b, size_t n)
+{
+  const __m128i zero = _mm_setzero_si128();
+  __m128i acc = zero;
+  uint64_t halves[2];
+  size_t i = 0;
+
+  // psadbw against zero sums each 8 bytes into a 64 bit lane
+  for (; i + 16 <= n; i += 16)
+    acc = _mm_add_epi64(
+      acc, _mm_sad_epu8(_mm_loadu_si128((const __m128i*)(a + i)), zero));
+
+  _mm_storeu_si128((__m128i*)halves, acc);
+  return (uint16_t)(halves[0] + halves[1] + scalar_sum8(a + i, b, n - i));
+}
+
+static SSE2 uint16_t
+sse2_sum16(uint8_t* a, const uint8_t* b, size_t n)
+{
+  __m128i acc = _mm_setzero_si128();
+  uint16_t lanes[8];
+  uint16_t sum;
+  size_t i = 0;
+
+  // the sum is modulo 64k anyway, so 16 bit lanes can't lose anything
+  for (; i + 16 <= n * 2; i += 16)
+    acc = _mm_add_epi16(
+      acc, sse2_bswap16(_mm_loadu_si128((const __m128i*)(a + i))));
+
+  _mm_storeu_si128((__m128i*)lanes, acc);
+  sum = scalar_sum16(a + i, b, n - i / 2);
+  for (int l = 0; l < 8; l++)
+    sum += lanes[l];
+  return sum;
+}
+
+static const struct vector_kernels vector_sse2 = {
+  .name = "sse2",
+  .k = {
+    [VECTOR_ADD] = { sse2_add8, sse2_add16 },
+    [VECTOR_XOR] = { sse2_xor8, sse2_xor16 },
+    [VECTOR_CMPEQ] = { sse2_cmpeq8, sse2_cmpeq16 },
+    [VECTOR_MIN] = { sse2_min8, sse2_min16 },
+    [VECTOR_MAX] = { sse2_max8, sse2_max16 },
+    [VECTOR_SUM] = { sse2_sum8, sse2_sum16 },
+  },
+};
+
+// avx2, 32 bytes at a time
+// tails go to the sse2 kernels, after a vzeroupper so the switch back to
+// legacy sse encodings doesn't stall
+
+static AVX2 inline __m256i
+avx2_bswap16(__m256i x)
+{
+  return _mm256_or_si256(_mm256_slli_epi16(x, 8), _mm256_srli_epi16(x, 8));
+}
+
+static AVX2 inline __m256i
+avx2_add16_v(__m256i x, __m256i y)
+{
+  return avx2_bswap16(_mm256_add_epi16(avx2_bswap16(x), avx2_bswap16(y)));
+}
+
+static AVX2 inline __m256i
+avx2_min16_v(__m256i x, __m256i y)
+{
+  return avx2_bswap16(_mm256_min_epu16(avx2_bswap16(x), avx2_bswap16(y)));
+}
+
+static AVX2 inline __m256i
+avx2_max16_v(__m256i x, __m256i y)
+{
+  return avx2_bswap16(_mm256_max_epu16(avx2_bswap16(x), avx2_bswap16(y)));
+}
+
+#define AVX2_BINARY(name, lane, fn)                                            \
+  static AVX2 uint16_t avx2_##name(uint8_t* a, const uint8_t* b, size_t n)     \
+  {                                                                            \
+    const size_t len = n * (lane);                                             \
+    size_t i = 0;                                                              \
+    for (; i + 32 <= len; i += 32) {                                           \
+      const __m256i x = _mm256_loadu_si256((const __m256i*)(a + i));           \
+      const __m256i y = _mm256_loadu_si256((const __m256i*)(b + i));           \
+      _mm256_storeu_si256((__m256i*)(a + i), fn(x, y));                        \
+    }                                                                          \
+    _mm256_zeroupper();                                                        \
+    return sse2_##name(a + i, b + i, (len - i) / (lane));                      \
+  }
+
+AVX2_BINARY(add8, 1, _mm256_add_epi8)
+AVX2_BINARY(add16, 2, avx2_add16_v)
+AVX2_BINARY(xor8, 1, _mm256_xor_si256)
+AVX2_BINARY(xor16, 2, _mm256_xor_si256)
+AVX2_BINARY(cmpeq8, 1, _mm256_cmpeq_epi8)
+AVX2_BINARY(cmpeq16, 2, _mm256_cmpeq_epi16)
+AVX2_BINARY(min8, 1, _mm256_min_epu8)
+AVX2_BINARY(min16, 2, avx2_min16_v)
+AVX2_BINARY(max8, 1, _mm256_max_epu8)
+AVX2_BINARY(max16, 2, avx2_max16_v)
+
+static AVX2 uint16_t
+avx2_sum8(uint8_t* a, const uint8_t* b, size_t n)
+{
+  const __m256i zero = _mm256_setzero_si256();
+  __m256i acc = zero;
+  uint64_t quarters[4];
+  size_t i = 0;
+
+  for (; i + 32 <= n; i += 32)
+    acc = _mm256_add_epi64(
+      acc, _mm256_sad_epu8(_mm256_loadu_si256((const __m256i*)(a + i)), zero));
+
+  _mm256_storeu_si256((__m256i*)quarters, acc);
+  _mm256_zeroupper();
+  return (uint16_t)(quarters[0] + quarters[1] + quarters[2] + quarters[3] +
+                    sse2_sum8(a + i, b, n - i));
+}
+
+static AVX2 uint16_t
+avx2_sum16(uint8_t* a, const uint8_t* b, size_t n)
+{
+  __m256i acc = _mm256_setzero_si256();
+  uint16_t lanes[16];
+  uint16_t sum;
+  size_t i = 0;
+
+  for (; i + 32 <= n * 2; i += 32)
+    acc = _mm256_add_epi16(
+      acc, avx2_bswap16(_mm256_loadu_si256((const __m256i*)(a + i))));
+
+  _mm256_storeu_si256((__m256i*)lanes, acc);
+  _mm256_zeroupper();
+  sum = sse2_sum16(a + i, b, n - i / 2);
+  for (int l = 0; l < 16; l++)
+    sum += lanes[l];
+  return sum;
+}
+
+static const struct vector_kernels vector_avx2 = {
+  .name = "avx2",
+  .k = {
+    [VECTOR_ADD] = { avx2_add8, avx2_add16 },
+    [VECTOR_XOR] = { avx2_xor8, avx2_xor16 },
+    [VECTOR_CMPEQ] = { avx2_cmpeq8, avx2_cmpeq16 },
+    [VECTOR_MIN] = { avx2_min8, avx2_min16 },
+    [VECTOR_MAX] = { avx2_max8, avx2_max16 },
+    [VECTOR_SUM] = { avx2_sum8, avx2_sum16 },
+  },
+};
+
+#endif
+
+const struct vector_kernels* const vector_tables[] = {
+  &vector_scalar,
+#ifdef VECTOR_X86
+  &vector_sse2,
+  &vector_avx2,
+#endif
+  NULL,
+};
+
+extern bool
+vector_supported(const struct vector_kernels* tab)
+{
+#ifdef VECTOR_X86
+  if (tab == &vector_avx2)
+    return __builtin_cpu_supports("avx2");
+  if (tab == &vector_sse2)
+    return __builtin_cpu_supports("sse2");
+#endif
+  return tab == &vector_scalar;
+}
+
+extern const struct vector_kernels*
+vector_best(void)
+{
+  const struct vector_kernels* best = &vector_scalar;
+
+  for (int i = 1; vector_tables[i]; i++)
+    if (vector_supported(vector_tables[i]))
+      best = vector_tables[i];
+
+  return best;
+}
+
+extern uint16_t
+vector_exec(struct picovm* vm,
+            unsigned op,
+            uint16_t a,
+            uint16_t b,
+            uint16_t lanes)
+{
+  const enum vector_op vop = op / 2;
+  const unsigned width = op % 2 + 1;
+  const uint32_t len = (uint32_t)lanes * width;
+  uint16_t sum = 0;
+
+  if (vop == VECTOR_SUM) {
+    if (len <= RAMSIZE - (uint32_t)a)
+      return vm->vec->k[vop][width - 1](&vm->ram[a], NULL, lanes);
+  } else {
+    vm->idle.dirty = true;
+
+    // partly overlapping ranges would depend on the kernel's stride
+    if (len <= RAMSIZE - (uint32_t)a && len <= RAMSIZE - (uint32_t)b &&
+        (a == b || (uint32_t)a + len <= b || (uint32_t)b + len <= a))
+      return vm->vec->k[vop][width - 1](&vm->ram[a], &vm->ram[b], lanes);
+  }
+
+  // wraps around at 64kb or overlaps, lane by lane in order
+  for (uint32_t i = 0; i < lanes; i++) {
+    const uint16_t at = a + i * width, bt = b + i * width;
+    uint8_t x[2], y[2];
+
+    for (unsigned w = 0; w < width; w++) {
+      x[w] = vm->ram[(uint16_t)(at + w)];
+      y[w] = vm->ram[(uint16_t)(bt + w)];
+    }
+
+    sum += vector_scalar.k[vop][width - 1](x, y, 1);
+
+    if (vop != VECTOR_SUM)
+      for (unsigned w = 0; w < width; w++)
+        vm->ram[(uint16_t)(at + w)] = x[w];
+  }
+
+  return sum;
+}
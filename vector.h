@@ -0,0 +1,63 @@
+#pragma once
+
+/* vector.h
+
+        packed lane ops (VADDB .. VSUMW)
+        every op comes as a table of kernels per host instruction set,
+        the best one the host supports is picked when an instance is
+        created. kernels work on host memory that does not wrap, byte
+        lanes or big endian short lanes, and must give exactly the same
+        result as the scalar table, so a replay is the same on any host.
+*/
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct picovm;
+
+/// in opcode order, see VADDB in defs.h
+enum vector_op
+{
+  VECTOR_ADD,
+  VECTOR_XOR,
+  VECTOR_CMPEQ,
+  VECTOR_MIN,
+  VECTOR_MAX,
+  VECTOR_SUM,
+
+  VECTOR_NUM_OPS,
+};
+
+/// `a` = `a` op `b` over `lanes` lanes, returns 0
+/// VECTOR_SUM only reads `a` and returns the sum of its lanes modulo 64k
+typedef uint16_t (*vector_kernel)(uint8_t* a, const uint8_t* b, size_t lanes);
+
+struct vector_kernels
+{
+  const char* name;
+  // [op][0] for byte lanes, [op][1] for short lanes
+  vector_kernel k[VECTOR_NUM_OPS][2];
+};
+
+extern const struct vector_kernels vector_scalar;
+
+/// every table this build has, scalar first, NULL terminated
+/// tables the host cpu can't run are still listed, check vector_supported
+extern const struct vector_kernels* const vector_tables[];
+
+extern bool
+vector_supported(const struct vector_kernels* tab);
+
+/// the fastest table the host supports
+extern const struct vector_kernels*
+vector_best(void);
+
+/// runs opcode VADDB + `op` on guest ram with the instance's kernels
+/// for VSUMB/VSUMW `b` is ignored and the sum is returned
+extern uint16_t
+vector_exec(struct picovm* vm,
+            unsigned op,
+            uint16_t a,
+            uint16_t b,
+            uint16_t lanes);
@@ -1,94 +1,87 @@
 #define _POSIX_C_SOURCE 199309L
 
-#include <arpa/inet.h>
-#include <errno.h>
+/* vm.c
+
+        the interpreter behind libpicovm
+        every bit of guest state lives in a struct picovm, so a host can run
+        as many instances side by side as it likes. faults are returned as
+        a picovm_result, never printed or exited on.
+*/
+
 #include <fcntl.h>
-#include <netinet/ip.h>
 #include <pthread.h>
-#include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/poll.h>
-#include <sys/signal.h>
-#include <sys/stat.h>
-#include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
 
-#include "config.h"
 #include "defs.h"
-#include "interrupt.h"
-#include "parallel.h"
-
-// define interrupt values here
-extern pthread_mutex_t interrupt_mutex;
-extern enum interrupt_type interrupt_queue[64];
-extern int interrupt_queue_len;
-
-// 16 registers, as we can fit two 4bit reg selectors into one byte
-#define NUM_REGS 16
-
-static uint8_t ram[RAMSIZE];
-static uint16_t rs[NUM_REGS];
-static uint16_t ip;
-static uint8_t flags;
-static bool interrupt_mask;
-
-static void
-dump_registers(void);
-
-void
-signal_handler(int sig)
-{
-  (void)sig;
-  flags |= HALT_FLAG;
-}
+#include "latency.h"
+#include "mmu.h"
+#include "picovm.h"
+#include "profile.h"
+#include "replay.h"
+#include "stats.h"
+#include "trace.h"
+#include "vector.h"
+#include "vm.h"
+
+// the longest backwards branch (in bytes) still considered an idle loop
+#define IDLE_LOOP_MAX_LEN 32
+
+// upper bound on a single park, so a halt request is still noticed promptly
+#define IDLE_PARK_SLICE_NS 10000000
 
 __attribute__((always_inline)) static inline bool
-is_halting(void)
+is_halting(struct picovm* vm)
 {
-  return flags & HALT_FLAG;
+  if (atomic_load_explicit(&vm->halt_request, memory_order_relaxed))
+    vm->flags |= HALT_FLAG;
+  return vm->flags & HALT_FLAG;
 }
 
 __attribute__((always_inline)) static inline uint8_t
-next_byte_adv(void)
+next_byte_adv(struct picovm* vm)
 {
-  return ram[ip++];
+  return vm->ram[vm->ip++];
 }
 
 __attribute__((always_inline)) static inline uint16_t
-next_short_adv(void)
+next_short_adv(struct picovm* vm)
 {
-  uint8_t high = next_byte_adv();
-  uint8_t low = next_byte_adv();
+  uint8_t high = next_byte_adv(vm);
+  uint8_t low = next_byte_adv(vm);
   uint16_t out = (((uint16_t)high) << 8) | (uint16_t)low;
   return out;
 }
 
 __attribute__((always_inline)) static inline void
-set_loc_short(const uint16_t in, const uint16_t at)
+set_loc_short(struct picovm* vm, const uint16_t in, const uint16_t at)
 {
-  ram[at] = (uint8_t)(in >> 8);
-  ram[at + 1] = (uint8_t)in;
+  vm->idle.dirty = true;
+  vm->ram[at] = (uint8_t)(in >> 8);
+  vm->ram[(uint16_t)(at + 1)] = (uint8_t)in;
 }
 
 __attribute__((always_inline)) static inline void
-set_loc_byte(const uint8_t in, const uint16_t at)
+set_loc_byte(struct picovm* vm, const uint8_t in, const uint16_t at)
 {
-  ram[at] = in;
+  vm->idle.dirty = true;
+  vm->ram[at] = in;
 }
 
 __attribute__((always_inline)) static inline uint16_t
-get_loc_short(const uint16_t loc)
+get_loc_short(struct picovm* vm, const uint16_t loc)
 {
   uint8_t h, l;
   uint16_t out;
 
-  h = ram[loc];
-  l = ram[loc + 1];
+  h = vm->ram[loc];
+  l = vm->ram[(uint16_t)(loc + 1)];
 
   out = ((uint16_t)(h << 8)) | (uint16_t)l;
 
@@ -96,40 +89,185 @@ get_loc_short(const uint16_t loc)
 }
 
 __attribute__((always_inline)) static inline uint8_t
-get_loc_byte(const uint16_t loc)
+get_loc_byte(struct picovm* vm, const uint16_t loc)
 {
   uint8_t out;
 
-  out = ram[loc];
+  out = vm->ram[loc];
 
   return out;
 }
 
+// a device's reads are outside input like a port's, so they get logged
+__attribute__((noinline)) static uint16_t
+mmio_load(struct picovm* vm, const uint16_t loc)
+{
+  const uint8_t page = loc / PICOVM_PAGE_SIZE;
+  uint16_t val;
+
+  vm->idle.dirty = true;
+  STAT(vm->stats.mmio_loads += 1);
+
+  if (vm->replay && !vm->replay->recording)
+    return replay_mmio_load(vm, loc);
+
+  val = vm->mmio[page].read ? vm->mmio[page].read(vm->mmio[page].ctx, loc)
+                            : 0xFFFF;
+
+  if (vm->replay)
+    replay_log_load(vm->replay, vm->cycles, loc, val);
+  return val;
+}
+
+__attribute__((noinline)) static void
+mmio_store(struct picovm* vm, const uint16_t in, const uint16_t at)
+{
+  const uint8_t page = at / PICOVM_PAGE_SIZE;
+
+  vm->idle.dirty = true;
+  STAT(vm->stats.mmio_stores += 1);
+
+  if (vm->mmio[page].write)
+    vm->mmio[page].write(vm->mmio[page].ctx, at, in);
+}
+
+// the page handlers of a page nothing is mapped on
+static uint16_t
+ram_load(struct picovm* vm, const uint16_t loc)
+{
+  return get_loc_short(vm, loc);
+}
+
+static void
+ram_store(struct picovm* vm, const uint16_t in, const uint16_t at)
+{
+  set_loc_short(vm, in, at);
+}
+
+/// get_loc_short/set_loc_short for LOAD and STOR, the only accesses
+/// a device page can intercept
+__attribute__((always_inline)) static inline uint16_t
+load_short(struct picovm* vm, const uint16_t loc)
+{
+  return vm->page_load[loc / PICOVM_PAGE_SIZE](vm, loc);
+}
+
 __attribute__((always_inline)) static inline void
-stack_push_byte(const uint8_t val)
+store_short(struct picovm* vm, const uint16_t in, const uint16_t at)
 {
-  ram[rs[STACK_HEAD_REGISTER]] = val;
-  rs[STACK_HEAD_REGISTER] += 1;
+  vm->page_store[at / PICOVM_PAGE_SIZE](vm, in, at);
+}
+
+/// whether [at, at + len) stays clear of the wrap at 64kb
+__attribute__((always_inline)) static inline bool
+block_linear(const uint16_t at, const uint16_t len)
+{
+  return (uint32_t)at + len <= RAMSIZE;
+}
+
+static void
+block_copy(struct picovm* vm, uint16_t dst, uint16_t src, uint16_t len)
+{
+  vm->idle.dirty = true;
+
+  if (block_linear(dst, len) && block_linear(src, len)) {
+    memmove(&vm->ram[dst], &vm->ram[src], len);
+    return;
+  }
+
+  // wraps around, go backwards if dst sits inside the source
+  if ((uint16_t)(dst - src) < len) {
+    for (uint16_t i = len; i-- > 0;)
+      vm->ram[(uint16_t)(dst + i)] = vm->ram[(uint16_t)(src + i)];
+  } else {
+    for (uint16_t i = 0; i < len; i++)
+      vm->ram[(uint16_t)(dst + i)] = vm->ram[(uint16_t)(src + i)];
+  }
+}
+
+static void
+block_fill(struct picovm* vm, uint16_t dst, uint8_t val, uint16_t len)
+{
+  vm->idle.dirty = true;
+
+  if (block_linear(dst, len)) {
+    memset(&vm->ram[dst], val, len);
+    return;
+  }
+
+  memset(&vm->ram[dst], val, RAMSIZE - dst);
+  memset(&vm->ram[0], val, len - (RAMSIZE - dst));
+}
+
+// chunk size memcmp narrows a difference down to before scanning bytes
+#define BLOCK_CMP_CHUNK 64
+
+/// returns the offset of the first differing byte, or len
+static uint16_t
+block_compare(struct picovm* vm, uint16_t a, uint16_t b, uint16_t len)
+{
+  uint16_t i = 0;
+
+  if (block_linear(a, len) && block_linear(b, len)) {
+    while (len - i >= BLOCK_CMP_CHUNK &&
+           memcmp(&vm->ram[a + i], &vm->ram[b + i], BLOCK_CMP_CHUNK) == 0)
+      i += BLOCK_CMP_CHUNK;
+  }
+
+  while (i < len &&
+         vm->ram[(uint16_t)(a + i)] == vm->ram[(uint16_t)(b + i)])
+    i++;
+
+  return i;
+}
+
+/// flags after comparing `tmp`, the 32 bit difference of two values
+__attribute__((always_inline)) static inline void
+test_flags(struct picovm* vm, const uint32_t tmp)
+{
+  // abusing the underflow principal once more...
+  if (tmp > UINT16_MAX)
+    vm->flags |= PLUS_FLAG;
+  else
+    vm->flags &= ~PLUS_FLAG;
+
+  if (tmp == 0)
+    vm->flags |= ZERO_FLAG;
+  else
+    vm->flags &= ~ZERO_FLAG;
+
+  if (tmp % 2)
+    vm->flags |= PRTY_FLAG;
+  else
+    vm->flags &= ~PRTY_FLAG;
+}
+
+__attribute__((always_inline)) static inline void
+stack_push_byte(struct picovm* vm, const uint8_t val)
+{
+  vm->idle.dirty = true;
+  vm->ram[vm->rs[STACK_HEAD_REGISTER]] = val;
+  vm->rs[STACK_HEAD_REGISTER] += 1;
 }
 
 __attribute__((always_inline)) static inline void
-stack_push_short(const uint16_t val)
+stack_push_short(struct picovm* vm, const uint16_t val)
 {
-  stack_push_byte(val >> 8);
-  stack_push_byte(val & 0xFF);
+  stack_push_byte(vm, val >> 8);
+  stack_push_byte(vm, val & 0xFF);
 }
 
 __attribute__((always_inline)) static inline uint8_t
-stack_pop_byte(void)
+stack_pop_byte(struct picovm* vm)
 {
-  rs[STACK_HEAD_REGISTER] -= 1;
-  return ram[rs[STACK_HEAD_REGISTER]];
+  vm->rs[STACK_HEAD_REGISTER] -= 1;
+  return vm->ram[vm->rs[STACK_HEAD_REGISTER]];
 }
 
 __attribute__((always_inline)) static inline uint16_t
-stack_pop_short(void)
+stack_pop_short(struct picovm* vm)
 {
-  return ((uint16_t)stack_pop_byte()) | ((uint16_t)stack_pop_byte()) << 8;
+  return ((uint16_t)stack_pop_byte(vm)) | ((uint16_t)stack_pop_byte(vm)) << 8;
 }
 
 __attribute__((always_inline)) static inline struct timespec
@@ -147,24 +285,51 @@ diff_timespec(struct timespec left, struct timespec right)
   return diff;
 }
 
+__attribute__((always_inline)) static inline struct timespec
+add_timespec(struct timespec left, struct timespec right)
+{
+  struct timespec sum;
+
+  sum.tv_nsec = left.tv_nsec + right.tv_nsec;
+  sum.tv_sec = left.tv_sec + right.tv_sec;
+  if (sum.tv_nsec >= 1000000000) {
+    sum.tv_sec += 1;
+    sum.tv_nsec -= 1000000000;
+  }
+
+  return sum;
+}
+
+__attribute__((always_inline)) static inline uint64_t
+timespec_ns(struct timespec ts)
+{
+  return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
 __attribute__((always_inline)) static inline bool
 timespec_lessthan(struct timespec left, struct timespec right)
 {
-  if (left.tv_sec < right.tv_sec)
-    return true;
-  if (left.tv_nsec < right.tv_nsec)
-    return true;
-  return false;
+  if (left.tv_sec != right.tv_sec)
+    return left.tv_sec < right.tv_sec;
+  return left.tv_nsec < right.tv_nsec;
+}
+
+__attribute__((always_inline)) static inline struct timespec
+scale_timespec(struct timespec ts, uint64_t n)
+{
+  const uint64_t ns = timespec_ns(ts) * n;
+  return (struct timespec){ .tv_sec = ns / 1000000000,
+                            .tv_nsec = ns % 1000000000 };
 }
 
 #define CLOCK_INTERONSET_INTERVAL 2000
 
 static struct timespec
-gen_min_tick_time(void)
+gen_min_tick_time(int step_sleep)
 {
   struct timespec out;
 
-  out.tv_nsec = (vm_config.step_sleep * 1000000) + CLOCK_INTERONSET_INTERVAL;
+  out.tv_nsec = (step_sleep * 1000000) + CLOCK_INTERONSET_INTERVAL;
 
   out.tv_sec = 0;
   while (out.tv_nsec >= 1000000000) {
@@ -175,525 +340,1154 @@ gen_min_tick_time(void)
   return out;
 }
 
+/// called after a taken backwards branch at `tail` (ip is the target)
+/// returns true once the same loop comes around without any state changing
+static bool
+idle_loop_repeats(struct picovm* vm, const uint16_t tail)
+{
+  if (vm->idle.armed && !vm->idle.dirty && vm->idle.head == vm->ip &&
+      vm->idle.tail == tail && vm->idle.flags == vm->flags &&
+      memcmp(vm->idle.rs, vm->rs, sizeof(vm->rs)) == 0)
+    return true;
+
+  if (tail - vm->ip > IDLE_LOOP_MAX_LEN) {
+    vm->idle.armed = false;
+    return false;
+  }
+
+  vm->idle.head = vm->ip;
+  vm->idle.tail = tail;
+  vm->idle.flags = vm->flags;
+  memcpy(vm->idle.rs, vm->rs, sizeof(vm->rs));
+  vm->idle.armed = true;
+  vm->idle.dirty = false;
+
+  return false;
+}
+
+/// block the host thread until an interrupt is pending, picovm_wake is
+/// called, or a slice elapses
 static void
-run(void)
+idle_park(struct picovm* vm)
+{
+  struct timespec start, end, deadline;
+  const struct timespec slice = { .tv_sec = 0, .tv_nsec = IDLE_PARK_SLICE_NS };
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  // condvars wait against the realtime clock by default
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline = add_timespec(deadline, slice);
+
+  pthread_mutex_lock(&vm->int_mutex);
+  if (!vm->wake_pending &&
+      !atomic_load_explicit(&vm->int_pending, memory_order_relaxed) &&
+      !is_halting(vm))
+    pthread_cond_timedwait(&vm->wake_cond, &vm->int_mutex, &deadline);
+  vm->wake_pending = false;
+  pthread_mutex_unlock(&vm->int_mutex);
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  vm->idle.parked = add_timespec(vm->idle.parked, diff_timespec(end, start));
+  vm->idle.parks += 1;
+}
+
+/// make picovm_event_fd readable, at most one byte is ever in flight
+static void
+notify_event(struct picovm* vm)
+{
+  if (!atomic_exchange(&vm->event_signalled, true))
+    (void)!write(vm->event_fds[1], "", 1);
+}
+
+static void
+drain_event(struct picovm* vm)
+{
+  char c;
+
+  if (atomic_exchange(&vm->event_signalled, false))
+    (void)!read(vm->event_fds[0], &c, 1);
+}
+
+__attribute__((always_inline)) static inline enum picovm_io
+port_in(struct picovm* vm, uint8_t port, int width, uint16_t* val)
+{
+  enum picovm_io res;
+
+  // port reads are outside input, a loop polling one is not idle
+  vm->idle.dirty = true;
+  STAT(vm->stats.port_bytes_in += width);
+
+  if (vm->replay && !vm->replay->recording)
+    return replay_port_in(vm, port, val);
+
+  if (!vm->ports[port].in)
+    *val = 0xFFFF;
+  else if ((res = vm->ports[port].in(vm->ports[port].ctx, port, width, val)) !=
+           PICOVM_IO_OK)
+    return res;
+
+  if (vm->replay)
+    replay_log_in(vm->replay, vm->cycles, port, *val);
+  return PICOVM_IO_OK;
+}
+
+__attribute__((always_inline)) static inline enum picovm_io
+port_out(struct picovm* vm, uint8_t port, int width, uint16_t val)
 {
-  uint16_t op0, op1;
+  vm->idle.dirty = true;
+  STAT(vm->stats.port_bytes_out += width);
+
+  if (!vm->ports[port].out)
+    return PICOVM_IO_OK;
+
+  return vm->ports[port].out(vm->ports[port].ctx, port, width, val);
+}
+
+static void
+record_latency(struct picovm* vm,
+               unsigned src,
+               struct timespec arrived,
+               struct timespec raised)
+{
+  struct timespec taken;
+  struct latency_hist* hist = vm->latency->hist[src];
+
+  clock_gettime(CLOCK_MONOTONIC, &taken);
+
+  latency_record(&hist[LATENCY_QUEUE],
+                 timespec_ns(diff_timespec(raised, arrived)));
+  latency_record(&hist[LATENCY_DISPATCH],
+                 timespec_ns(diff_timespec(taken, raised)));
+  latency_record(&hist[LATENCY_TOTAL],
+                 timespec_ns(diff_timespec(taken, arrived)));
+}
+
+/// jump to the vector of `src`
+/// vectors live at the bottom of ram, one short per source
+static void
+enter_isr(struct picovm* vm, unsigned src)
+{
+  STAT(vm->stats.interrupts[src] += 1);
+
+  // RTI pops the flags, then the return address
+  vm->perf_int = true;
+  if (vm->profile)
+    profile_call(vm->profile, vm->ip);
+  stack_push_short(vm, vm->ip);
+  stack_push_byte(vm, vm->flags);
+  vm->ip = get_loc_short(vm, src * 2);
+}
+
+/// take the lowest pending interrupt
+static void
+deliver_interrupt(struct picovm* vm)
+{
+  unsigned pending, src;
+  struct timespec arrived, raised;
+
+  pthread_mutex_lock(&vm->int_mutex);
+  pending = atomic_load_explicit(&vm->int_pending, memory_order_relaxed);
+  for (src = 0; !(pending & (1u << src)); src++)
+    ;
+  atomic_store_explicit(
+    &vm->int_pending, pending & ~(1u << src), memory_order_relaxed);
+  arrived = vm->int_arrived[src];
+  raised = vm->int_raised[src];
+  pthread_cond_broadcast(&vm->int_taken_cond);
+  pthread_mutex_unlock(&vm->int_mutex);
+
+  if (vm->latency)
+    record_latency(vm, src, arrived, raised);
+  if (vm->replay)
+    replay_log_int(vm->replay, vm->cycles, src);
+
+  enter_isr(vm, src);
+}
+
+/// the replay log has an event due at this cycle
+/// returns false when the next instruction should run as normal
+static bool
+replay_event(struct picovm* vm)
+{
+  const struct replay* r = vm->replay;
+
+  // port and device reads are picked up by the read itself,
+  // as long as it is on time
+  if ((r->next.kind == REPLAY_IN || r->next.kind == REPLAY_LOAD) &&
+      r->next.at == vm->cycles)
+    return false;
+
+  if (r->next.kind == REPLAY_END) {
+    vm->flags |= HALT_FLAG;
+  } else if (r->next.kind == REPLAY_INT && vm->interrupt_mask &&
+             !vm->perf_int) {
+    enter_isr(vm, r->next.src);
+  } else {
+    vm->fault = PICOVM_ERR_REPLAY;
+    vm->flags |= HALT_FLAG;
+    return true;
+  }
+
+  replay_advance(vm);
+  return true;
+}
+
+static enum picovm_result
+run(struct picovm* vm, uint64_t budget)
+{
+  uint16_t op0, op1, val;
   uint32_t tmp;
 
+  const uint64_t end = budget > UINT64_MAX - vm->cycles
+                         ? UINT64_MAX
+                         : vm->cycles + budget;
+
   // in nanoseconds
-  struct timespec cur_tick, last_tick, clock_io, diff;
-  clock_io = gen_min_tick_time();
+  struct timespec cur_tick, last_tick, clock_io, due, diff;
+  clock_io = gen_min_tick_time(vm->opts.step_sleep);
+  // cycles already paid for, block ops retire more than one at a time
+  uint64_t ticked = vm->cycles;
 
   clock_gettime(CLOCK_MONOTONIC, &cur_tick);
 
-  /// whether or not we are currently performing an interrupt
-  bool perf_int = false;
-
-  while (!is_halting()) {
-    if (interrupt_mask) {
-      if (!perf_int) {
-        if (current_interrupt != INT_NONE) {
-          // begin interrupt procedure
-          perf_int = true;
-          current_interrupt = INT_NONE;
-          stack_push_short(ip);
-
-          switch (current_interrupt) {
-            case INT_P0:
-              ip = get_loc_short(0x0000);
-              break;
-            case INT_P1:
-              ip = get_loc_short(0x0002);
-              break;
-
-            case INT_P2:
-              ip = get_loc_short(0x0004);
-              break;
-
-            default:
-              ERR("invalid value in interrupt switch\n");
-          }
-        } else
-          pthread_cond_signal(&interrupt_cond);
-      }
-    }
+  while (!is_halting(vm)) {
+    if (vm->cycles >= end)
+      return PICOVM_BUDGET;
 
-    const uint8_t op_byte = next_byte_adv();
-    const enum vm_ops op = op_byte;
+    if (vm->interrupt_mask && !vm->perf_int &&
+        atomic_load_explicit(&vm->int_pending, memory_order_relaxed))
+      deliver_interrupt(vm);
+
+    // UINT64_MAX unless replaying
+    if (vm->cycles >= vm->replay_at && replay_event(vm))
+      continue;
 
-    if (vm_config.show_steps)
-      printf("stepped | ip = %Xh; op = %Xh\n", ip - 1, op_byte);
+    const uint16_t op_ip = vm->ip;
+    const uint8_t op_byte = next_byte_adv(vm);
+    const enum vm_ops op = op_byte;
 
     switch (op) {
       case NOP:
         break;
 
       case HALT:
-        flags |= HALT_FLAG;
+        vm->flags |= HALT_FLAG;
         break;
 
       case LOAD_REG_REG:
-        op0 = next_byte_adv();
-        rs[(op0 & 0xF0) >> 4] = rs[op0 & 0x0F];
+        op0 = next_byte_adv(vm);
+        vm->rs[(op0 & 0xF0) >> 4] = vm->rs[op0 & 0x0F];
         break;
 
       case LOAD_REG_IMM:
-        op0 = next_byte_adv();
-        op1 = next_short_adv();
-        rs[op0] = op1;
+        op0 = next_byte_adv(vm);
+        op1 = next_short_adv(vm);
+        vm->rs[op0 & 0x0F] = op1;
         break;
 
       case LOAD_REG_DEREF:
-        op0 = next_byte_adv();
-        op1 = next_short_adv();
-        rs[op0] = get_loc_short(op1);
+        op0 = next_byte_adv(vm);
+        op1 = next_short_adv(vm);
+        vm->rs[op0 & 0x0F] = load_short(vm, op1);
         break;
 
       case LOAD_REG_REGDEREF:
-        op0 = next_byte_adv();
-        rs[(op0 & 0xF0) >> 4] = get_loc_short(rs[(op0 & 0x0F)]);
+        op0 = next_byte_adv(vm);
+        vm->rs[(op0 & 0xF0) >> 4] = load_short(vm, vm->rs[(op0 & 0x0F)]);
         break;
 
       case LOAD_REG_REGDEREF_OFF:
-        op0 = next_byte_adv();
-        op1 = next_short_adv();
-        rs[(op0 & 0xF0) >> 4] = get_loc_short(rs[(op0 & 0x0F)] + op1);
+        op0 = next_byte_adv(vm);
+        op1 = next_short_adv(vm);
+        vm->rs[(op0 & 0xF0) >> 4] =
+          load_short(vm, vm->rs[(op0 & 0x0F)] + op1);
         break;
 
       case STOR_PTRDEREF_REG:
-        op0 = next_short_adv();
-        op1 = next_byte_adv();
-        set_loc_short(rs[op1], op0);
+        op0 = next_short_adv(vm);
+        op1 = next_byte_adv(vm);
+        store_short(vm, vm->rs[op1], op0);
         break;
 
       case STOR_REGDEREF_REG:
-        op0 = next_byte_adv();
-        set_loc_short(rs[(op0 & 0xF0) >> 4], ram[op0 & 0x0F]);
+        op0 = next_byte_adv(vm);
+        store_short(vm, vm->rs[(op0 & 0xF0) >> 4], vm->rs[op0 & 0x0F]);
         break;
 
       case STOR_REGDEREF_OFF_REG:
-        op0 = next_byte_adv();
-        op1 = next_short_adv();
-        set_loc_short(rs[(op0 & 0xF0) >> 4] + op1, ram[op0 & 0x0F]);
+        op0 = next_byte_adv(vm);
+        op1 = next_short_adv(vm);
+        store_short(vm, vm->rs[(op0 & 0xF0) >> 4], vm->rs[op0 & 0x0F] + op1);
         break;
 
       case STOR_PTRDEREF_IMM:
-        op0 = next_short_adv();
-        op1 = next_short_adv();
-        set_loc_short(op1, op0);
+        op0 = next_short_adv(vm);
+        op1 = next_short_adv(vm);
+        store_short(vm, op1, op0);
         break;
 
       case STOR_REGDEREF_IMM:
-        op0 = next_byte_adv();
-        op1 = next_short_adv();
-        set_loc_short(op1, rs[op0 & 0x0f]);
+        op0 = next_byte_adv(vm);
+        op1 = next_short_adv(vm);
+        store_short(vm, op1, vm->rs[op0 & 0x0f]);
         break;
       case STOR_REGDEREF_OFF_IMM:
-        op0 = next_byte_adv();
-        op1 = next_short_adv();
-        tmp = next_short_adv();
-        set_loc_short(tmp, rs[op0 & 0x0f] + op1);
+        op0 = next_byte_adv(vm);
+        op1 = next_short_adv(vm);
+        tmp = next_short_adv(vm);
+        store_short(vm, tmp, vm->rs[op0 & 0x0f] + op1);
         break;
 
       case ADD_REG_REG:
-        op0 = next_byte_adv();
-        tmp = (uint32_t)rs[op0 & 0x0F] + (uint32_t)rs[(op0 & 0xF0) >> 4];
+        op0 = next_byte_adv(vm);
+        tmp =
+          (uint32_t)vm->rs[op0 & 0x0F] + (uint32_t)vm->rs[(op0 & 0xF0) >> 4];
 
         if (tmp > UINT16_MAX)
-          flags |= CRRY_FLAG;
+          vm->flags |= CRRY_FLAG;
         else
-          flags &= ~CRRY_FLAG;
+          vm->flags &= ~CRRY_FLAG;
 
-        rs[(op0 & 0xF0) >> 4] = (uint16_t)tmp;
+        vm->rs[(op0 & 0xF0) >> 4] = (uint16_t)tmp;
         break;
 
       case ADD_REG_IMM:
-        op0 = next_byte_adv();
-        op1 = next_short_adv();
-        tmp = (uint32_t)rs[op0 & 0x0F] + op1;
+        op0 = next_byte_adv(vm);
+        op1 = next_short_adv(vm);
+        tmp = (uint32_t)vm->rs[op0 & 0x0F] + op1;
 
         if (tmp > UINT16_MAX)
-          flags |= CRRY_FLAG;
+          vm->flags |= CRRY_FLAG;
         else
-          flags &= ~CRRY_FLAG;
+          vm->flags &= ~CRRY_FLAG;
 
-        rs[op0 & 0x0F] = tmp;
+        vm->rs[op0 & 0x0F] = tmp;
         break;
 
       case SUB_REG_REG:
-        op0 = next_byte_adv();
-        tmp = (uint32_t)rs[(op0 & 0xF0) >> 4] - (uint32_t)rs[op0 & 0x0F];
+        op0 = next_byte_adv(vm);
+        tmp =
+          (uint32_t)vm->rs[(op0 & 0xF0) >> 4] - (uint32_t)vm->rs[op0 & 0x0F];
 
         // we can abuse some principles of register math here
         // if we underflow the u32, it's going to have a val > UINT16_MAX
         if (tmp > UINT16_MAX)
-          flags |= CRRY_FLAG;
+          vm->flags |= CRRY_FLAG;
         else
-          flags &= ~CRRY_FLAG;
+          vm->flags &= ~CRRY_FLAG;
 
-        rs[(op0 & 0xF0) >> 4] = tmp;
+        vm->rs[(op0 & 0xF0) >> 4] = tmp;
         break;
 
       case SUB_REG_IMM:
-        op0 = next_byte_adv();
-        op1 = next_short_adv();
+        op0 = next_byte_adv(vm);
+        op1 = next_short_adv(vm);
 
-        tmp = rs[op0 & 0x0F] - op1;
+        tmp = vm->rs[op0 & 0x0F] - op1;
 
         // we can abuse some principles of register math here
         // if we underflow the u32, it's going to have a val > UINT16_MAX
         if (tmp > UINT16_MAX)
-          flags |= CRRY_FLAG;
+          vm->flags |= CRRY_FLAG;
         else
-          flags &= ~CRRY_FLAG;
+          vm->flags &= ~CRRY_FLAG;
 
-        rs[op0 & 0x0F] = tmp;
+        vm->rs[op0 & 0x0F] = tmp;
         break;
 
       case MUL_REG_REG:
-        op0 = next_byte_adv();
+        op0 = next_byte_adv(vm);
 
-        tmp = (uint32_t)rs[op0 & 0x0F] * (uint32_t)rs[(op0 & 0xF0) >> 4];
+        tmp =
+          (uint32_t)vm->rs[op0 & 0x0F] * (uint32_t)vm->rs[(op0 & 0xF0) >> 4];
 
         if (tmp > UINT16_MAX)
-          flags |= CRRY_FLAG;
+          vm->flags |= CRRY_FLAG;
         else
-          flags &= ~CRRY_FLAG;
+          vm->flags &= ~CRRY_FLAG;
 
-        rs[(op0 & 0xF0) >> 4] = tmp;
+        vm->rs[(op0 & 0xF0) >> 4] = tmp;
         break;
 
       case MUL_REG_IMM:
-        op0 = next_byte_adv();
-        op1 = next_short_adv();
+        op0 = next_byte_adv(vm);
+        op1 = next_short_adv(vm);
 
-        tmp = (uint32_t)rs[op0 & 0x0F] * (uint32_t)op1;
+        tmp = (uint32_t)vm->rs[op0 & 0x0F] * (uint32_t)op1;
 
         if (tmp > UINT16_MAX)
-          flags |= CRRY_FLAG;
+          vm->flags |= CRRY_FLAG;
         else
-          flags &= ~CRRY_FLAG;
+          vm->flags &= ~CRRY_FLAG;
 
-        rs[op0 & 0x0F] = tmp;
+        vm->rs[op0 & 0x0F] = tmp;
         break;
 
       case DIV_REG_REG:
-        op0 = next_byte_adv();
+        op0 = next_byte_adv(vm);
 
-        if (rs[(op0 & 0xF0) >> 4] == 0)
-          rs[(op0 & 0xF0) >> 4] = 0;
+        if (vm->rs[(op0 & 0xF0) >> 4] == 0)
+          vm->rs[(op0 & 0xF0) >> 4] = 0;
         else
-          rs[(op0 & 0xF0) >> 4] /= rs[op0 & 0x0F];
+          vm->rs[(op0 & 0xF0) >> 4] /= vm->rs[op0 & 0x0F];
 
         break;
 
       case DIV_REG_IMM:
-        op0 = next_byte_adv();
-        op1 = next_short_adv();
+        op0 = next_byte_adv(vm);
+        op1 = next_short_adv(vm);
         if (op1 == 0)
-          rs[op0 & 0x0F] = 0;
+          vm->rs[op0 & 0x0F] = 0;
         else
-          rs[op0 & 0x0F] /= op1;
+          vm->rs[op0 & 0x0F] /= op1;
 
         break;
 
       case NOT_REG:
-        op0 = next_byte_adv();
-        rs[op0] = ~rs[op0];
+        op0 = next_byte_adv(vm);
+        vm->rs[op0 & 0x0F] = ~vm->rs[op0 & 0x0F];
         break;
 
       case OR_REG_REG:
-        op0 = next_byte_adv();
-        rs[(op0 & 0xF0) >> 4] |= rs[op0 & 0x0F];
+        op0 = next_byte_adv(vm);
+        vm->rs[(op0 & 0xF0) >> 4] |= vm->rs[op0 & 0x0F];
         break;
 
       case OR_REG_IMM:
-        op0 = next_byte_adv();
-        op1 = next_short_adv();
-        rs[op0] |= op1;
+        op0 = next_byte_adv(vm);
+        op1 = next_short_adv(vm);
+        vm->rs[op0 & 0x0F] |= op1;
         break;
 
       case AND_REG_REG:
-        op0 = next_byte_adv();
-        rs[(op0 & 0xF0) >> 4] &= rs[op0 & 0x0F];
+        op0 = next_byte_adv(vm);
+        vm->rs[(op0 & 0xF0) >> 4] &= vm->rs[op0 & 0x0F];
         break;
 
       case AND_REG_IMM:
-        op0 = next_byte_adv();
-        op1 = next_short_adv();
-        rs[op0] &= op1;
+        op0 = next_byte_adv(vm);
+        op1 = next_short_adv(vm);
+        vm->rs[op0 & 0x0F] &= op1;
         break;
 
       case XOR_REG_REG:
-        op0 = next_byte_adv();
-        rs[(op0 & 0xF0) >> 4] ^= rs[op0 & 0x0F];
+        op0 = next_byte_adv(vm);
+        vm->rs[(op0 & 0xF0) >> 4] ^= vm->rs[op0 & 0x0F];
         break;
 
       case XOR_REG_IMM:
-        op0 = next_byte_adv();
-        op1 = next_short_adv();
-        rs[op0] ^= op1;
+        op0 = next_byte_adv(vm);
+        op1 = next_short_adv(vm);
+        vm->rs[op0 & 0x0F] ^= op1;
         break;
 
       case TEST_REG_REG:
-        op0 = next_byte_adv();
-        tmp = rs[(op0 & 0xF0) >> 4] - rs[op0 & 0x0F];
-
-        // abusing the underflow principal once more...
-        if (tmp > UINT16_MAX)
-          flags |= PLUS_FLAG;
-        else
-          flags &= ~PLUS_FLAG;
-
-        if (tmp == 0)
-          flags |= ZERO_FLAG;
-        else
-          flags &= ~ZERO_FLAG;
-
-        if (tmp % 2)
-          flags |= PRTY_FLAG;
-        else
-          flags &= ~PRTY_FLAG;
+        op0 = next_byte_adv(vm);
+        tmp = vm->rs[(op0 & 0xF0) >> 4] - vm->rs[op0 & 0x0F];
+        test_flags(vm, tmp);
         break;
 
       case TEST_REG_IMM:
-        op0 = next_byte_adv();
-        op1 = next_short_adv();
-        tmp = rs[op0 & 0x0F] - op1;
+        op0 = next_byte_adv(vm);
+        op1 = next_short_adv(vm);
+        tmp = vm->rs[op0 & 0x0F] - op1;
+        test_flags(vm, tmp);
+        break;
 
-        // abusing the underflow principal once more...
-        if (tmp > UINT16_MAX)
-          flags |= PLUS_FLAG;
-        else
-          flags &= ~PLUS_FLAG;
+      case MEMCPY:
+      case MEMSET:
+      case MEMCMP:
+        op0 = next_byte_adv(vm);
+        op1 = next_byte_adv(vm) & 0x0F;
+        val = vm->rs[op1];
+
+        if (op == MEMCPY)
+          block_copy(vm, vm->rs[(op0 & 0xF0) >> 4], vm->rs[op0 & 0x0F], val);
+        else if (op == MEMSET)
+          block_fill(
+            vm, vm->rs[(op0 & 0xF0) >> 4], (uint8_t)vm->rs[op0 & 0x0F], val);
+        else {
+          const uint16_t a = vm->rs[(op0 & 0xF0) >> 4];
+          const uint16_t b = vm->rs[op0 & 0x0F];
+          const uint16_t at = block_compare(vm, a, b, val);
+
+          if (at == val) {
+            test_flags(vm, 0);
+          } else {
+            test_flags(vm,
+                       (uint32_t)vm->ram[(uint16_t)(a + at)] -
+                         vm->ram[(uint16_t)(b + at)]);
+            vm->rs[op1] = at;
+          }
+        }
 
-        if (tmp == 0)
-          flags |= ZERO_FLAG;
-        else
-          flags &= ~ZERO_FLAG;
+        // the instruction itself is retired below
+        vm->cycles += val / BLOCK_BYTES_PER_CYCLE;
+        break;
 
-        if (tmp % 2)
-          flags |= PRTY_FLAG;
-        else
-          flags &= ~PRTY_FLAG;
+      case VADDB:
+      case VADDW:
+      case VXORB:
+      case VXORW:
+      case VCMPEQB:
+      case VCMPEQW:
+      case VMINB:
+      case VMINW:
+      case VMAXB:
+      case VMAXW:
+      case VSUMB:
+      case VSUMW:
+        op0 = next_byte_adv(vm);
+        op1 = vm->rs[next_byte_adv(vm) & 0x0F];
+        val = vector_exec(vm,
+                          op - VADDB,
+                          vm->rs[(op0 & 0xF0) >> 4],
+                          vm->rs[op0 & 0x0F],
+                          op1);
+        if (op >= VSUMB)
+          vm->rs[op0 & 0x0F] = val;
+
+        vm->cycles += (uint32_t)op1 * ((op - VADDB) % 2 + 1) /
+                      BLOCK_BYTES_PER_CYCLE;
         break;
 
       case SWAP:
-        op0 = next_byte_adv();
-        tmp = rs[op0 & 0x0F];
-        rs[op0 & 0x0F] = rs[(op0 & 0xF0) >> 4];
-        rs[(op0 & 0xF0) >> 4] = tmp;
+        op0 = next_byte_adv(vm);
+        tmp = vm->rs[op0 & 0x0F];
+        vm->rs[op0 & 0x0F] = vm->rs[(op0 & 0xF0) >> 4];
+        vm->rs[(op0 & 0xF0) >> 4] = tmp;
         break;
 
       case CALL:
-        op0 = next_short_adv();
-        set_loc_short(ip, rs[STACK_HEAD_REGISTER]);
-        rs[STACK_HEAD_REGISTER] += 2;
-        ip = op0;
+        op0 = next_short_adv(vm);
+        set_loc_short(vm, vm->ip, vm->rs[STACK_HEAD_REGISTER]);
+        vm->rs[STACK_HEAD_REGISTER] += 2;
+        vm->ip = op0;
+        if (vm->profile)
+          profile_call(vm->profile, op_ip);
+        break;
+
+      case CALL_SHORT:
+        op0 = next_byte_adv(vm);
+        set_loc_short(vm, vm->ip, vm->rs[STACK_HEAD_REGISTER]);
+        vm->rs[STACK_HEAD_REGISTER] += 2;
+        vm->ip += (int8_t)op0;
+        if (vm->profile)
+          profile_call(vm->profile, op_ip);
         break;
 
       case CALLDYN:
-        op0 = next_byte_adv();
-        set_loc_short(ip, rs[STACK_HEAD_REGISTER]);
-        rs[STACK_HEAD_REGISTER] += 2;
-        ip = rs[op0 & 0x0F];
+        op0 = next_byte_adv(vm);
+        set_loc_short(vm, vm->ip, vm->rs[STACK_HEAD_REGISTER]);
+        vm->rs[STACK_HEAD_REGISTER] += 2;
+        vm->ip = vm->rs[op0 & 0x0F];
+        if (vm->profile)
+          profile_call(vm->profile, op_ip);
         break;
 
       case RET:
-        rs[STACK_HEAD_REGISTER] -= 2;
-        ip = get_loc_short(rs[STACK_HEAD_REGISTER]);
+        vm->rs[STACK_HEAD_REGISTER] -= 2;
+        vm->ip = get_loc_short(vm, vm->rs[STACK_HEAD_REGISTER]);
+        if (vm->profile)
+          profile_ret(vm->profile);
         break;
 
       case PUSH:
-        op0 = next_byte_adv();
-        tmp = rs[op0 & 0x0F];
-        set_loc_short(tmp, rs[STACK_HEAD_REGISTER]);
-        rs[STACK_HEAD_REGISTER] += 2;
+        op0 = next_byte_adv(vm);
+        tmp = vm->rs[op0 & 0x0F];
+        set_loc_short(vm, tmp, vm->rs[STACK_HEAD_REGISTER]);
+        vm->rs[STACK_HEAD_REGISTER] += 2;
         break;
 
       case POP:
-        op0 = next_byte_adv();
-        rs[STACK_HEAD_REGISTER] -= 2;
-        rs[op0 & 0x0F] = get_loc_short(rs[STACK_HEAD_REGISTER]);
+        op0 = next_byte_adv(vm);
+        vm->rs[STACK_HEAD_REGISTER] -= 2;
+        vm->rs[op0 & 0x0F] = get_loc_short(vm, vm->rs[STACK_HEAD_REGISTER]);
         break;
 
       case ENINT:
-        interrupt_mask = true;
+        vm->interrupt_mask = true;
         break;
 
       case DISINT:
-        interrupt_mask = false;
+        vm->interrupt_mask = false;
         break;
 
       case BRANCH:
-        ip = next_short_adv();
+        vm->ip = next_short_adv(vm);
         break;
 
       case BRANCH_EQUAL:
-        op0 = next_short_adv();
-        if (flags & ZERO_FLAG)
-          ip = op0;
+        op0 = next_short_adv(vm);
+        if (vm->flags & ZERO_FLAG)
+          vm->ip = op0;
         break;
 
       case BRANCH_NOT_EQUAL:
-        op0 = next_short_adv();
-        if (!(flags & ZERO_FLAG))
-          ip = op0;
+        op0 = next_short_adv(vm);
+        if (!(vm->flags & ZERO_FLAG))
+          vm->ip = op0;
         break;
 
       case BRANCH_LESS_THAN:
-        op0 = next_short_adv();
-        if (!(flags & ZERO_FLAG) && !(flags & PLUS_FLAG))
-          ip = op0;
+        op0 = next_short_adv(vm);
+        if (!(vm->flags & ZERO_FLAG) && !(vm->flags & PLUS_FLAG))
+          vm->ip = op0;
         break;
 
       case BRANCH_GREATER_THAN:
-        op0 = next_short_adv();
-        if (!(flags & ZERO_FLAG) && !(flags & PLUS_FLAG))
-          ip = op0;
+        op0 = next_short_adv(vm);
+        if (!(vm->flags & ZERO_FLAG) && !(vm->flags & PLUS_FLAG))
+          vm->ip = op0;
         break;
 
       case BRANCH_LESS_THAN_EQUAL:
-        op0 = next_short_adv();
-        if ((flags & ZERO_FLAG) || !(flags & PLUS_FLAG))
-          ip = op0;
+        op0 = next_short_adv(vm);
+        if ((vm->flags & ZERO_FLAG) || !(vm->flags & PLUS_FLAG))
+          vm->ip = op0;
         break;
 
       case BRANCH_GREATER_THAN_EQUAL:
-        op0 = next_short_adv();
-        if ((flags & ZERO_FLAG) || !(flags & PLUS_FLAG))
-          ip = op0;
+        op0 = next_short_adv(vm);
+        if ((vm->flags & ZERO_FLAG) || !(vm->flags & PLUS_FLAG))
+          vm->ip = op0;
+        break;
+
+      // short branches, the same conditions as above
+      case BRANCH_SHORT:
+        op0 = next_byte_adv(vm);
+        vm->ip += (int8_t)op0;
+        break;
+
+      case BRANCH_EQUAL_SHORT:
+        op0 = next_byte_adv(vm);
+        if (vm->flags & ZERO_FLAG)
+          vm->ip += (int8_t)op0;
+        break;
+
+      case BRANCH_NOT_EQUAL_SHORT:
+        op0 = next_byte_adv(vm);
+        if (!(vm->flags & ZERO_FLAG))
+          vm->ip += (int8_t)op0;
+        break;
+
+      case BRANCH_LESS_THAN_SHORT:
+        op0 = next_byte_adv(vm);
+        if (!(vm->flags & ZERO_FLAG) && !(vm->flags & PLUS_FLAG))
+          vm->ip += (int8_t)op0;
+        break;
+
+      case BRANCH_GREATER_THAN_SHORT:
+        op0 = next_byte_adv(vm);
+        if (!(vm->flags & ZERO_FLAG) && !(vm->flags & PLUS_FLAG))
+          vm->ip += (int8_t)op0;
+        break;
+
+      case BRANCH_LESS_THAN_EQUAL_SHORT:
+        op0 = next_byte_adv(vm);
+        if ((vm->flags & ZERO_FLAG) || !(vm->flags & PLUS_FLAG))
+          vm->ip += (int8_t)op0;
+        break;
+
+      case BRANCH_GREATER_THAN_EQUAL_SHORT:
+        op0 = next_byte_adv(vm);
+        if ((vm->flags & ZERO_FLAG) || !(vm->flags & PLUS_FLAG))
+          vm->ip += (int8_t)op0;
         break;
 
       case RTI:
-        rs[STACK_HEAD_REGISTER] -= 1;
-        flags = get_loc_byte(rs[STACK_HEAD_REGISTER]);
-        rs[STACK_HEAD_REGISTER] -= 2;
-        ip = get_loc_short(rs[STACK_HEAD_REGISTER]);
-        perf_int = false;
+        vm->rs[STACK_HEAD_REGISTER] -= 1;
+        vm->flags = get_loc_byte(vm, vm->rs[STACK_HEAD_REGISTER]);
+        vm->rs[STACK_HEAD_REGISTER] -= 2;
+        vm->ip = get_loc_short(vm, vm->rs[STACK_HEAD_REGISTER]);
+        vm->perf_int = false;
+        if (vm->profile)
+          profile_ret(vm->profile);
         break;
+
+      // port io
+      // a blocked device leaves ip on the instruction so it is retried
+      case BIN:
+      case SIN:
+        op0 = next_short_adv(vm);
+        op1 = next_byte_adv(vm);
+        if (port_in(vm, op0, op == SIN ? 2 : 1, &val) != PICOVM_IO_OK) {
+          vm->ip = op_ip;
+          if (vm->async)
+            return PICOVM_BLOCKED;
+          idle_park(vm);
+          continue;
+        }
+        vm->rs[op1 & 0x0F] = op == SIN ? val : (uint8_t)val;
+        break;
+
+      case BOUT:
+      case SOUT:
+        op0 = next_short_adv(vm);
+        op1 = next_byte_adv(vm);
+        val = vm->rs[op1 & 0x0F];
+        if (op == BOUT)
+          val &= 0xFF;
+        if (port_out(vm, op0, op == SOUT ? 2 : 1, val) != PICOVM_IO_OK) {
+          vm->ip = op_ip;
+          if (vm->async)
+            return PICOVM_BLOCKED;
+          idle_park(vm);
+          continue;
+        }
+        break;
+
+      default:
+        vm->ip = op_ip;
+        vm->fault = PICOVM_ERR_BAD_OPCODE;
+        return vm->fault;
     }
 
+    vm->cycles += 1;
+
+#ifdef PICOVM_STATS
+    vm->stats.retired[op_byte] += 1;
+    // a branch that was not taken falls through its 3 bytes, 2 if short
+    if (op > BRANCH && op <= BRANCH_GREATER_THAN_EQUAL) {
+      if (vm->ip == (uint16_t)(op_ip + 3))
+        vm->stats.branches_not_taken += 1;
+      else
+        vm->stats.branches_taken += 1;
+    } else if (op > BRANCH_SHORT && op <= BRANCH_GREATER_THAN_EQUAL_SHORT) {
+      if (vm->ip == (uint16_t)(op_ip + 2))
+        vm->stats.branches_not_taken += 1;
+      else
+        vm->stats.branches_taken += 1;
+    }
+#endif
+
+    if (vm->trace)
+      trace_record(vm->trace, op_ip, op_byte, vm->rs);
+
+    // UINT64_MAX unless profiling. block ops and device charges retire
+    // many cycles at once, every period they crossed is theirs
+    if (vm->cycles >= vm->sample_at) {
+      const uint64_t period = vm->profile->period;
+      const uint64_t n = (vm->cycles - vm->sample_at) / period + 1;
+
+      profile_sample(vm->profile, op_ip, n);
+      vm->sample_at += n * period;
+    }
+
+    // a taken backwards branch while we are waiting on interrupts
+    if (vm->ip <= op_ip &&
+        ((op >= BRANCH && op <= BRANCH_GREATER_THAN_EQUAL) ||
+         (op >= BRANCH_SHORT && op <= BRANCH_GREATER_THAN_EQUAL_SHORT)) &&
+        vm->interrupt_mask && !vm->perf_int && vm->opts.idle_park &&
+        idle_loop_repeats(vm, op_ip)) {
+      if (vm->async)
+        return PICOVM_IDLE;
+      idle_park(vm);
+    }
+
+    if (vm->opts.unthrottled || vm->async)
+      continue;
+
     last_tick = cur_tick;
     clock_gettime(CLOCK_MONOTONIC, &cur_tick);
 
+    due = vm->cycles - ticked == 1
+            ? clock_io
+            : scale_timespec(clock_io, vm->cycles - ticked);
+    ticked = vm->cycles;
+
     diff = diff_timespec(cur_tick, last_tick);
-    // printf("diff: %li %li\n", diff.tv_sec, diff.tv_nsec);
-    // printf("io: %li %li\n", clock_io.tv_sec, clock_io.tv_nsec);
-    if (timespec_lessthan(diff, clock_io)) {
-      const struct timespec to_sleep = diff_timespec(clock_io, diff);
-      // printf("%li %li\n", to_sleep.tv_sec, to_sleep.tv_nsec);
+    if (timespec_lessthan(diff, due)) {
+      const struct timespec to_sleep = diff_timespec(due, diff);
       struct timespec rem;
       nanosleep(&to_sleep, &rem);
+      STAT(last_tick = cur_tick);
+      clock_gettime(CLOCK_MONOTONIC, &cur_tick);
+      STAT(diff = diff_timespec(cur_tick, last_tick));
+      STAT(vm->stats.throttle_ns += timespec_ns(diff));
     }
-
-    clock_gettime(CLOCK_MONOTONIC, &cur_tick);
   }
+
+  // a replay that diverged stops the guest like a halt does
+  return vm->fault != PICOVM_OK ? vm->fault : PICOVM_HALTED;
 }
 
-static const char*
-get_register_name_by_idx(size_t idx)
-{
-  switch (idx) {
-    case 0:
-      return "%r0";
-    case 1:
-      return "%r1";
-    case 2:
-      return "%r2";
-    case 3:
-      return "%r3";
-    case 4:
-      return "%r4";
-    case 5:
-      return "%r5";
-    case 6:
-      return "%r6";
-    case 7:
-      return "%r7";
-    case 8:
-      return "%r8";
-    case 9:
-      return "%r9";
-    case 10:
-      return "%x0";
-    case 11:
-      return "%x1";
-    case 12:
-      return "%x2";
-    case 13:
-      return "%x3";
-    case 14:
-      return "%sh";
-    case 15:
-      return "%sb";
-    default:
-      ERR("invalid reg index when trying to get register name\n");
+extern void
+picovm_default_options(struct picovm_options* opts)
+{
+  *opts = (struct picovm_options){
+    .step_sleep = 0,
+    .unthrottled = false,
+    .idle_park = true,
+    .banks = 0,
   };
 }
 
-static void
-dump_registers(void)
-{
-  for (size_t i = 0; i < NUM_REGS; i++) {
-    printf("\x1b[32;49m%s\x1b[39;49m = \x1b[33;49m%04Xh\x1b[39;49m ",
-           get_register_name_by_idx(i),
-           rs[i]);
-    if (i % 4 == 3)
-      printf("\n");
+extern struct picovm*
+picovm_create(const struct picovm_options* opts)
+{
+  struct picovm* vm = calloc(1, sizeof(struct picovm));
+  if (!vm)
+    return NULL;
+
+  if (opts)
+    vm->opts = *opts;
+  else
+    picovm_default_options(&vm->opts);
+
+  vm->sample_at = UINT64_MAX;
+  vm->replay_at = UINT64_MAX;
+  for (size_t i = 0; i < PICOVM_NUM_PAGES; i++) {
+    vm->page_load[i] = ram_load;
+    vm->page_store[i] = ram_store;
   }
+  vm->vec = vector_best();
+  hcall_attach(vm);
+  hash_attach(vm);
+
+  atomic_init(&vm->halt_request, false);
+  atomic_init(&vm->int_pending, 0);
+  atomic_init(&vm->event_signalled, false);
+
+  if (pipe(vm->event_fds) < 0) {
+    free(vm);
+    return NULL;
+  }
+
+  for (int i = 0; i < 2; i++) {
+    fcntl(vm->event_fds[i], F_SETFL, O_NONBLOCK);
+    fcntl(vm->event_fds[i], F_SETFD, FD_CLOEXEC);
+  }
+
+  if (pthread_mutex_init(&vm->int_mutex, NULL) != 0)
+    goto fail_mutex;
+
+  if (pthread_cond_init(&vm->wake_cond, NULL) != 0)
+    goto fail_wake_cond;
+
+  if (pthread_cond_init(&vm->int_taken_cond, NULL) != 0)
+    goto fail_taken_cond;
+
+  if (vm->opts.banks) {
+    if (!(vm->mmu = mmu_new(vm->opts.banks)))
+      goto fail_mmu;
+    mmu_attach(vm);
+  }
+
+  // a fresh instance is runnable until told otherwise
+  notify_event(vm);
+
+  return vm;
+
+fail_mmu:
+  pthread_cond_destroy(&vm->int_taken_cond);
+fail_taken_cond:
+  pthread_cond_destroy(&vm->wake_cond);
+fail_wake_cond:
+  pthread_mutex_destroy(&vm->int_mutex);
+fail_mutex:
+  close(vm->event_fds[0]);
+  close(vm->event_fds[1]);
+  free(vm);
+  return NULL;
 }
 
 extern void
-run_with_rom(const uint8_t* in, size_t len, int pipeout_stdin)
+picovm_destroy(struct picovm* vm)
 {
-  fake_stdin = pipeout_stdin;
+  if (!vm)
+    return;
+
+  picovm_stats_close(vm);
+  picovm_trace_stop(vm);
+  picovm_profile_stop(vm);
+  picovm_latency_stop(vm);
+  picovm_replay_stop(vm);
+  mmu_free(vm->mmu);
+
+  pthread_cond_destroy(&vm->int_taken_cond);
+  pthread_cond_destroy(&vm->wake_cond);
+  pthread_mutex_destroy(&vm->int_mutex);
+  close(vm->event_fds[0]);
+  close(vm->event_fds[1]);
+  free(vm);
+}
 
-  signal(SIGINT, signal_handler);
-  ip = 0;
-  interrupt_mask = false;
+extern enum picovm_result
+picovm_load_rom(struct picovm* vm, const uint8_t* rom, size_t len)
+{
+  if (len > ROMLEN) {
+    if (!vm->mmu || !mmu_reset(vm->mmu, rom + ROMLEN, len - ROMLEN))
+      return PICOVM_ERR_ROM_TOO_LARGE;
+    len = ROMLEN;
+  } else if (vm->mmu) {
+    mmu_reset(vm->mmu, NULL, 0);
+  }
 
-  if (mkfifo(INTFIFO, 0666) < 0 && errno != EEXIST)
-    ERR("failed to make fifo for sysints");
+  memset(vm->ram, 0, sizeof(vm->ram));
+  memset(vm->rs, 0, sizeof(vm->rs));
+  memset(&vm->idle, 0, sizeof(vm->idle));
+  vm->flags = 0;
+  vm->interrupt_mask = false;
+  vm->perf_int = false;
+  vm->fault = PICOVM_OK;
+  vm->cycles = 0;
+  STAT(memset(&vm->stats, 0, sizeof(vm->stats)));
+  atomic_store(&vm->halt_request, false);
 
-  intfd = open(INTFIFO, O_RDONLY | O_NONBLOCK);
+  memcpy(&vm->ram[ROMLOC], rom, len);
 
-  if (intfd < 0)
-    ERR("failed to open fifo for sysints");
+  // setup the vector
+  vm->ip = get_loc_short(vm, STARTUP_VECTOR);
 
-  intpollfd.events = POLLIN;
-  intpollfd.fd = intfd;
+  return PICOVM_OK;
+}
 
-  int stdin_fl = fcntl(STDIN_FILENO, F_GETFL);
-  fcntl(STDIN_FILENO, F_SETFL, stdin_fl | O_NONBLOCK);
+extern enum picovm_result
+picovm_run_for(struct picovm* vm, uint64_t cycles)
+{
+  if (vm->fault != PICOVM_OK)
+    return vm->fault;
 
-  if (len > ROMLEN)
-    ERR("rom len is too large: %lu | must be <= %lu\n", len, ROMLEN);
+  return run(vm, cycles);
+}
 
-  memcpy(&ram[ROMLOC], in, len);
+extern enum picovm_result
+picovm_step(struct picovm* vm, uint64_t cycles)
+{
+  enum picovm_result res;
 
-  // setup the vector
-  uint16_t startup_vector = get_loc_short(STARTUP_VECTOR);
-  ip = startup_vector;
-
-  run();
-  printf("\nvm halted\n");
-
-  if (vm_config.dump_registers)
-    dump_registers();
-
-  if (vm_config.dump_memory) {
-    const char* outfile = vm_config.output_filename;
-    if (!outfile)
-      outfile = "./vm.dump";
-    printf("memory contents dumped to: %s\n", outfile);
-    FILE* dumpfile = fopen(outfile, "w");
-    if (!dumpfile)
-      ERR("failed to open dumpfile for writing\n");
-    fwrite(ram, 1, RAMSIZE, dumpfile);
-    fclose(dumpfile);
+  // anything that wakes us from here on leaves the fd readable again
+  drain_event(vm);
+
+  if (vm->fault != PICOVM_OK)
+    return vm->fault;
+
+  vm->async = true;
+  res = run(vm, cycles);
+  vm->async = false;
+
+  if (res == PICOVM_BUDGET)
+    notify_event(vm);
+
+  return res;
+}
+
+extern enum picovm_result
+picovm_trace_start(struct picovm* vm, const char* path, bool regs)
+{
+  picovm_trace_stop(vm);
+
+  vm->trace = trace_open(path, regs);
+  if (!vm->trace)
+    return PICOVM_ERR_IO;
+
+  return PICOVM_OK;
+}
+
+extern void
+picovm_trace_stop(struct picovm* vm)
+{
+  if (!vm->trace)
+    return;
+
+  trace_close(vm->trace);
+  vm->trace = NULL;
+}
+
+extern int
+picovm_event_fd(struct picovm* vm)
+{
+  return vm->event_fds[0];
+}
+
+extern void
+picovm_wake(struct picovm* vm)
+{
+  pthread_mutex_lock(&vm->int_mutex);
+  vm->wake_pending = true;
+  pthread_cond_signal(&vm->wake_cond);
+  pthread_mutex_unlock(&vm->int_mutex);
+
+  notify_event(vm);
+}
+
+extern void
+picovm_map_port(struct picovm* vm,
+                uint8_t port,
+                picovm_port_in in,
+                picovm_port_out out,
+                void* ctx)
+{
+  vm->ports[port].in = in;
+  vm->ports[port].out = out;
+  vm->ports[port].ctx = ctx;
+}
+
+extern enum picovm_result
+picovm_map_mmio(struct picovm* vm,
+                uint8_t page,
+                picovm_mmio_read read,
+                picovm_mmio_write write,
+                void* ctx)
+{
+  if (page >= ROMLOC / PICOVM_PAGE_SIZE)
+    return PICOVM_ERR_BAD_PAGE;
+
+  vm->mmio[page].read = read;
+  vm->mmio[page].write = write;
+  vm->mmio[page].ctx = ctx;
+  vm->page_load[page] = read || write ? mmio_load : ram_load;
+  vm->page_store[page] = read || write ? mmio_store : ram_store;
+  return PICOVM_OK;
+}
+
+extern void
+picovm_halt(struct picovm* vm)
+{
+  atomic_store_explicit(&vm->halt_request, true, memory_order_relaxed);
+}
+
+extern void
+picovm_raise_interrupt(struct picovm* vm, enum picovm_interrupt src)
+{
+  picovm_raise_interrupt_at(vm, src, NULL);
+}
+
+extern void
+picovm_raise_interrupt_at(struct picovm* vm,
+                          enum picovm_interrupt src,
+                          const struct timespec* arrived)
+{
+  // a replaying guest only sees the interrupts in its log
+  if (vm->replay && !vm->replay->recording)
+    return;
+
+  pthread_mutex_lock(&vm->int_mutex);
+  // a raise that coalesces into a pending one keeps the older stamps
+  if (vm->latency &&
+      !(atomic_load_explicit(&vm->int_pending, memory_order_relaxed) &
+        (1u << src))) {
+    clock_gettime(CLOCK_MONOTONIC, &vm->int_raised[src]);
+    vm->int_arrived[src] = arrived ? *arrived : vm->int_raised[src];
   }
+  atomic_fetch_or_explicit(&vm->int_pending, 1u << src, memory_order_relaxed);
+  pthread_cond_signal(&vm->wake_cond);
+  pthread_mutex_unlock(&vm->int_mutex);
+
+  notify_event(vm);
+}
+
+extern void
+picovm_wait_interrupt(struct picovm* vm, enum picovm_interrupt src)
+{
+  pthread_mutex_lock(&vm->int_mutex);
+  while (atomic_load_explicit(&vm->int_pending, memory_order_relaxed) &
+         (1u << src))
+    pthread_cond_wait(&vm->int_taken_cond, &vm->int_mutex);
+  pthread_mutex_unlock(&vm->int_mutex);
+}
 
-  close(intfd);
+extern enum picovm_result
+picovm_get_reg(const struct picovm* vm, int idx, uint16_t* out)
+{
+  if (idx < 0 || idx >= NUM_REGS)
+    return PICOVM_ERR_BAD_REGISTER;
+
+  *out = vm->rs[idx];
+  return PICOVM_OK;
+}
+
+extern enum picovm_result
+picovm_set_reg(struct picovm* vm, int idx, uint16_t val)
+{
+  if (idx < 0 || idx >= NUM_REGS)
+    return PICOVM_ERR_BAD_REGISTER;
+
+  vm->rs[idx] = val;
+  return PICOVM_OK;
+}
+
+extern uint16_t
+picovm_get_ip(const struct picovm* vm)
+{
+  return vm->ip;
+}
+
+extern void
+picovm_set_ip(struct picovm* vm, uint16_t ip)
+{
+  vm->ip = ip;
+}
+
+extern uint8_t
+picovm_get_flags(const struct picovm* vm)
+{
+  return vm->flags;
+}
+
+extern uint64_t
+picovm_cycles(const struct picovm* vm)
+{
+  return vm->cycles;
+}
+
+extern uint8_t*
+picovm_memory(struct picovm* vm)
+{
+  return vm->ram;
+}
+
+extern const char*
+picovm_reg_name(int idx)
+{
+  static const char* names[NUM_REGS] = {
+    "%r0", "%r1", "%r2", "%r3", "%r4", "%r5", "%r6", "%r7",
+    "%r8", "%r9", "%x0", "%x1", "%x2", "%x3", "%sh", "%sb",
+  };
+
+  if (idx < 0 || idx >= NUM_REGS)
+    return NULL;
+
+  return names[idx];
+}
+
+extern const char*
+picovm_strerror(enum picovm_result res)
+{
+  switch (res) {
+    case PICOVM_OK:
+      return "ok";
+    case PICOVM_BUDGET:
+      return "cycle budget exhausted";
+    case PICOVM_HALTED:
+      return "halted";
+    case PICOVM_BLOCKED:
+      return "blocked on port io";
+    case PICOVM_IDLE:
+      return "idle, waiting on an interrupt";
+    case PICOVM_ERR_BAD_OPCODE:
+      return "invalid opcode";
+    case PICOVM_ERR_ROM_TOO_LARGE:
+      return "rom is too large";
+    case PICOVM_ERR_BAD_REGISTER:
+      return "invalid register index";
+    case PICOVM_ERR_NOMEM:
+      return "out of memory";
+    case PICOVM_ERR_IO:
+      return "file io failed";
+    case PICOVM_ERR_REPLAY:
+      return "guest diverged from its replay log";
+    case PICOVM_ERR_BAD_PAGE:
+      return "page is inside the rom window";
+  }
+
+  return "unknown error";
+}
+
+extern void
+picovm_idle_time(const struct picovm* vm, unsigned long* parks, uint64_t* ns)
+{
+  *parks = vm->idle.parks;
+  *ns = timespec_ns(vm->idle.parked);
 }
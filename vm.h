@@ -0,0 +1,143 @@
+#pragma once
+
+/* vm.h
+
+        internal layout of a picovm instance
+        shared between vm.c and anything that needs to poke at an
+        instance directly. hosts should stick to picovm.h.
+*/
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "defs.h"
+#include "hash.h"
+#include "hcall.h"
+#include "latency.h"
+#include "mmu.h"
+#include "picovm.h"
+#include "profile.h"
+#include "replay.h"
+#include "stats.h"
+#include "trace.h"
+#include "vector.h"
+
+// 16 registers, as we can fit two 4bit reg selectors into one byte
+#define NUM_REGS PICOVM_NUM_REGS
+
+struct picovm
+{
+  uint8_t ram[RAMSIZE];
+  uint16_t rs[NUM_REGS];
+  uint16_t ip;
+  uint8_t flags;
+  bool interrupt_mask;
+
+  /// whether or not we are currently performing an interrupt
+  bool perf_int;
+
+  /// set by picovm_halt, possibly from another thread or a signal handler
+  atomic_bool halt_request;
+
+  /// set once the guest faults, returned by every later run
+  enum picovm_result fault;
+
+  uint64_t cycles;
+
+  struct picovm_options opts;
+
+  /// true while inside picovm_step, never park or sleep
+  bool async;
+
+  /// bank switching, NULL unless created with opts.banks
+  struct mmu* mmu;
+
+  /// hypercall table and the device's registers
+  struct hcall hcall;
+
+  /// checksum device state
+  struct hash hash;
+
+  /// kernels behind the lane ops, the best the host supports
+  const struct vector_kernels* vec;
+
+  /// binary execution trace, NULL when not tracing
+  struct trace* trace;
+
+  /// sampling profiler, NULL when not profiling
+  struct profile* profile;
+  // cycle count of the next sample, UINT64_MAX when not profiling
+  uint64_t sample_at;
+
+  /// record/replay log, NULL when doing neither
+  struct replay* replay;
+  // cycle count of the next replayed event, UINT64_MAX when not replaying
+  uint64_t replay_at;
+
+  /// interrupt latency histograms, NULL when not recording
+  struct latency* latency;
+
+#ifdef PICOVM_STATS
+  struct picovm_stats stats;
+#endif
+  struct stats_server* stats_server;
+
+  struct
+  {
+    picovm_port_in in;
+    picovm_port_out out;
+    void* ctx;
+  } ports[PICOVM_NUM_PORTS];
+
+  /// per page LOAD/STOR handlers. ram pages point straight at ram and a
+  /// mapped page at its device, so the ram path never tests anything
+  uint16_t (*page_load[PICOVM_NUM_PAGES])(struct picovm*, uint16_t);
+  void (*page_store[PICOVM_NUM_PAGES])(struct picovm*, uint16_t, uint16_t);
+  struct
+  {
+    picovm_mmio_read read;
+    picovm_mmio_write write;
+    void* ctx;
+  } mmio[PICOVM_NUM_PAGES];
+
+  /// bitmask of pending interrupts, 1 << enum picovm_interrupt
+  /// only ever modified while holding int_mutex
+  atomic_uint_fast8_t int_pending;
+  pthread_mutex_t int_mutex;
+  /// set by picovm_wake under int_mutex, consumed by a parked vm
+  bool wake_pending;
+  // signalled on an interrupt or a wake, unparks the vm
+  pthread_cond_t wake_cond;
+  // signalled when an interrupt has been delivered to the guest
+  pthread_cond_t int_taken_cond;
+  // when each pending interrupt's input arrived and was raised,
+  // CLOCK_MONOTONIC, only stamped while latency is recorded
+  struct timespec int_arrived[PICOVM_NUM_INTERRUPTS];
+  struct timespec int_raised[PICOVM_NUM_INTERRUPTS];
+
+  /// self-pipe behind picovm_event_fd, [0] is handed out
+  int event_fds[2];
+  // whether a byte is sitting in the pipe
+  atomic_bool event_signalled;
+
+  /// idle-loop detector
+  /// a short backwards branch reached twice with the same registers and
+  /// flags, and no stores in between, can only be left by an interrupt.
+  /// once that is seen the host thread is parked instead of spinning.
+  struct
+  {
+    uint16_t head, tail;
+    uint16_t rs[NUM_REGS];
+    uint8_t flags;
+
+    bool armed;
+    // set by any store, invalidates the snapshot
+    bool dirty;
+
+    unsigned long parks;
+    struct timespec parked;
+  } idle;
+};